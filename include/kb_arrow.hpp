@@ -0,0 +1,625 @@
+/*
+    Karabo bridge Apache Arrow exporter.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_CPP_KB_ARROW_HPP
+#define KARABO_BRIDGE_CPP_KB_ARROW_HPP
+
+#include "kb_client.hpp"
+#include "kb_async_writer.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <cerrno>
+#include <limits>
+#include <memory>
+
+
+namespace karabo_bridge {
+
+/*
+ * A minimal FlatBuffers serializer, enough for the Arrow IPC metadata.
+ *
+ * The buffer is laid out front to back: a table is written before the
+ * strings, vectors and tables it refers to, so that all the offsets point
+ * forward as required by the format.
+ */
+class FbNode {
+public:
+    enum Kind { TABLE, STRING, VECTOR, TABLE_VECTOR };
+
+    using Ptr = std::shared_ptr<FbNode>;
+
+private:
+    struct Field {
+        uint16_t id;
+        std::string bytes; // inline scalar or struct
+        std::size_t align;
+        Ptr child; // referenced node
+    };
+
+    Kind kind_;
+    std::vector<Field> fields_; // TABLE
+    std::string bytes_; // STRING, VECTOR
+    std::size_t align_ = 1; // element alignment of VECTOR
+    uint32_t length_ = 0; // number of elements of VECTOR and TABLE_VECTOR
+    std::vector<Ptr> children_; // TABLE_VECTOR
+
+    explicit FbNode(Kind kind): kind_(kind) {}
+
+    static void pad(std::string& buf, std::size_t align, std::size_t offset = 0) {
+        while ((buf.size() + offset) % align) buf.push_back('\0');
+    }
+
+    template <typename T>
+    static void put(std::string& buf, std::size_t pos, T v) {
+        memcpy(&buf[pos], &v, sizeof v);
+    }
+
+    template <typename T>
+    static void append(std::string& buf, T v) {
+        buf.append(reinterpret_cast<const char*>(&v), sizeof v);
+    }
+
+    /*
+     * Serialize the node at the end of the buffer and return the position
+     * offsets must point to.
+     */
+    std::size_t serialize(std::string& buf) const {
+        if (kind_ == STRING || kind_ == VECTOR) {
+            pad(buf, std::max<std::size_t>(4, align_), 4);
+            std::size_t pos = buf.size();
+            append<uint32_t>(buf, kind_ == STRING ? static_cast<uint32_t>(bytes_.size()) : length_);
+            buf.append(bytes_);
+            if (kind_ == STRING) buf.push_back('\0');
+            return pos;
+        }
+
+        if (kind_ == TABLE_VECTOR) {
+            pad(buf, 4);
+            std::size_t pos = buf.size();
+            append<uint32_t>(buf, static_cast<uint32_t>(children_.size()));
+            std::size_t slots = buf.size();
+            buf.append(4 * children_.size(), '\0');
+            for (std::size_t i = 0; i < children_.size(); ++i) {
+                std::size_t child = children_[i]->serialize(buf);
+                put<uint32_t>(buf, slots + 4 * i, static_cast<uint32_t>(child - slots - 4 * i));
+            }
+            return pos;
+        }
+
+        // table: inline layout after the soffset to the vtable
+        uint16_t n_ids = 0;
+        std::size_t table_align = 4;
+        for (auto& f : fields_) {
+            n_ids = std::max<uint16_t>(n_ids, f.id + 1);
+            table_align = std::max(table_align, f.align);
+        }
+        std::vector<uint16_t> vtable(2 + n_ids, 0);
+        std::vector<std::size_t> field_pos(fields_.size());
+        std::size_t size = 4;
+        for (std::size_t i = 0; i < fields_.size(); ++i) {
+            std::size_t len = fields_[i].child ? 4 : fields_[i].bytes.size();
+            while (size % fields_[i].align) ++size;
+            field_pos[i] = size;
+            vtable[2 + fields_[i].id] = static_cast<uint16_t>(size);
+            size += len;
+        }
+        vtable[0] = static_cast<uint16_t>(2 * vtable.size());
+        vtable[1] = static_cast<uint16_t>(size);
+
+        pad(buf, 2);
+        std::size_t vtable_pos = buf.size();
+        for (auto v : vtable) append<uint16_t>(buf, v);
+        pad(buf, table_align);
+        std::size_t table_pos = buf.size();
+        buf.append(size, '\0');
+        put<int32_t>(buf, table_pos, static_cast<int32_t>(table_pos - vtable_pos));
+        for (std::size_t i = 0; i < fields_.size(); ++i)
+            if (!fields_[i].child) buf.replace(table_pos + field_pos[i], fields_[i].bytes.size(), fields_[i].bytes);
+
+        for (std::size_t i = 0; i < fields_.size(); ++i) {
+            if (!fields_[i].child) continue;
+            std::size_t slot = table_pos + field_pos[i];
+            std::size_t child = fields_[i].child->serialize(buf);
+            put<uint32_t>(buf, slot, static_cast<uint32_t>(child - slot));
+        }
+        return table_pos;
+    }
+
+public:
+    static Ptr table() { return Ptr(new FbNode(TABLE)); }
+
+    static Ptr string(const std::string& s) {
+        Ptr node(new FbNode(STRING));
+        node->bytes_ = s;
+        return node;
+    }
+
+    // vector of scalars, or of structs made of n_fields scalars each
+    template <typename T>
+    static Ptr vector(const std::vector<T>& v, std::size_t align = sizeof(T), std::size_t n_fields = 1) {
+        Ptr node(new FbNode(VECTOR));
+        node->bytes_.assign(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+        node->align_ = align;
+        node->length_ = static_cast<uint32_t>(v.size() / n_fields);
+        return node;
+    }
+
+    static Ptr tables(const std::vector<Ptr>& v) {
+        Ptr node(new FbNode(TABLE_VECTOR));
+        node->children_ = v;
+        return node;
+    }
+
+    template <typename T>
+    FbNode& add(uint16_t id, T v) {
+        Field f;
+        f.id = id;
+        f.bytes.assign(reinterpret_cast<const char*>(&v), sizeof v);
+        f.align = sizeof v;
+        fields_.push_back(f);
+        return *this;
+    }
+
+    FbNode& add(uint16_t id, const Ptr& child) {
+        Field f;
+        f.id = id;
+        f.align = 4;
+        f.child = child;
+        fields_.push_back(f);
+        return *this;
+    }
+
+    // serialize with this node as the root
+    std::string finish() const {
+        std::string buf(4, '\0');
+        std::size_t root = serialize(buf);
+        put<uint32_t>(buf, 0, static_cast<uint32_t>(root));
+        return buf;
+    }
+};
+
+/*
+ * Data type of an Arrow column.
+ */
+struct ArrowType {
+    char kind; // 'b': bool, 'i': signed integer, 'u': unsigned integer, 'f': floating point, 's': utf8
+    int bit_width;
+
+    bool operator==(const ArrowType& other) const {
+        return kind == other.kind && bit_width == other.bit_width;
+    }
+};
+
+/*
+ * Map a c++ or python data type string to the Arrow type.
+ *
+ * Exceptions:
+ * std::invalid_argument if the data type is unknown
+ */
+ArrowType arrow_type(const std::string& type_string) {
+    int bits = static_cast<int>(dtype_size(type_string) * 8);
+    // numpy booleans are bytes, not bits
+    if (type_string == "bool") return {'u', 8};
+    if (type_string.find("float") != std::string::npos || type_string == "double") return {'f', bits};
+    if (type_string.compare(0, 4, "uint") == 0) return {'u', bits};
+    return {'i', bits};
+}
+
+/*
+ * A column of a record batch with a single row.
+ *
+ * The values are referenced, not copied, unless they are owned by the
+ * column. Columns with a shape hold a tensor and are exported as the
+ * "arrow.fixed_shape_tensor" extension type.
+ */
+struct ArrowColumn {
+    std::string name;
+    ArrowType type;
+    std::vector<unsigned int> shape; // empty for a scalar
+    const void* data = nullptr;
+    std::size_t size = 0; // bytes
+    std::string owned; // values owned by the column, e.g. converted scalars
+
+    const void* values() const { return owned.empty() ? data : owned.data(); }
+
+    std::size_t nbytes() const { return owned.empty() ? size : owned.size(); }
+};
+
+/*
+ * Convert a train into columns.
+ *
+ * The first column is the "trainId". The others are named "<source>/<path>".
+ * Arrays reference the data held by kb_data, which must therefore outlive
+ * the columns. Integers and floating points in the msgpack data are
+ * exported as int64 and float64, respectively, so that the schema does not
+ * depend on their values, except for the integers above INT64_MAX, which
+ * are exported as uint64. Containers in the msgpack data are skipped.
+ */
+std::vector<ArrowColumn> toArrowColumns(std::map<std::string, kb_data>& data_pkg) {
+    std::vector<ArrowColumn> columns;
+
+    ArrowColumn tid;
+    tid.name = "trainId";
+    tid.type = {'u', 64};
+    uint64_t train_id = trainId(data_pkg);
+    tid.owned.assign(reinterpret_cast<const char*>(&train_id), sizeof train_id);
+    columns.push_back(std::move(tid));
+
+    for (auto& data : data_pkg) {
+        for (auto& v : data.second.msgpack_data) {
+            ArrowColumn column;
+            column.name = data.first + "/" + v.first;
+            msgpack::object obj = v.second.get();
+            switch (obj.type) {
+                case msgpack::type::object_type::BOOLEAN:
+                    column.type = {'b', 1};
+                    column.owned.assign(1, obj.via.boolean ? '\1' : '\0');
+                    break;
+                case msgpack::type::object_type::POSITIVE_INTEGER:
+                    if (obj.via.u64 > static_cast<uint64_t>(std::numeric_limits<int64_t>::max())) {
+                        column.type = {'u', 64};
+                        column.owned.assign(reinterpret_cast<const char*>(&obj.via.u64), sizeof obj.via.u64);
+                        break;
+                    }
+                    // fall through
+                case msgpack::type::object_type::NEGATIVE_INTEGER: {
+                    column.type = {'i', 64};
+                    int64_t value = obj.type == msgpack::type::object_type::POSITIVE_INTEGER ?
+                        static_cast<int64_t>(obj.via.u64) : obj.via.i64;
+                    column.owned.assign(reinterpret_cast<const char*>(&value), sizeof value);
+                    break;
+                }
+                case msgpack::type::object_type::FLOAT32:
+                case msgpack::type::object_type::FLOAT64:
+                    column.type = {'f', 64};
+                    column.owned.assign(reinterpret_cast<const char*>(&obj.via.f64), sizeof obj.via.f64);
+                    break;
+                case msgpack::type::object_type::STR:
+                    column.type = {'s', 8};
+                    column.data = obj.via.str.ptr;
+                    column.size = obj.via.str.size;
+                    break;
+                default:
+                    continue;
+            }
+            columns.push_back(std::move(column));
+        }
+
+        for (auto& v : data.second.array) {
+            ArrowColumn column;
+            column.name = data.first + "/" + v.first;
+            column.type = arrow_type(v.second.dtype());
+            column.shape = v.second.shape();
+            column.data = v.second.data();
+            column.size = dtype_size(v.second.dtype());
+            for (auto s : column.shape) column.size *= s;
+            columns.push_back(std::move(column));
+        }
+    }
+
+    return columns;
+}
+
+/*
+ * Write trains as an Arrow IPC stream, one record batch with a single row
+ * per train, to a file, a pipe or a shared memory object.
+ *
+ * The schema is taken from the first train and the following trains must
+ * have the same structure. A non-negative int64 scalar may still be
+ * written to a column which is uint64 in the schema, since a msgpack
+ * integer is only exported as uint64 above INT64_MAX. The other way
+ * round, an integer above INT64_MAX does not fit in a column which is
+ * int64 in the schema and is rejected as a change of structure.
+ *
+ * The array data is written with writev directly from the received
+ * frames, without being copied into a serialization buffer.
+ *
+ * The stream can be read, e.g., with pyarrow.ipc.open_stream().
+ */
+class ArrowStreamWriter {
+    int fd_ = -1;
+    bool own_fd_ = false;
+    AsyncFileWriter* file_ = nullptr;
+    std::vector<ArrowColumn> schema_; // names, types and shapes of the columns
+    bool closed_ = false;
+
+    // enumerators rather than static const members, which would need a
+    // definition out of the class as soon as they are bound to a reference
+    // or their address is taken
+    enum : uint32_t { continuation = 0xFFFFFFFF };
+    enum : int16_t { metadata_version = 4 }; // V5
+
+    enum : uint8_t {
+        type_int = 2,
+        type_floating_point = 3,
+        type_utf8 = 5,
+        type_bool = 6,
+        type_fixed_size_list = 16
+    };
+
+    enum : uint8_t {
+        header_schema = 1,
+        header_record_batch = 3
+    };
+
+    static std::size_t padded(std::size_t n) { return (n + 7) & ~std::size_t(7); }
+
+    static FbNode::Ptr keyValue(const std::string& key, const std::string& value) {
+        auto kv = FbNode::table();
+        kv->add(0, FbNode::string(key)).add(1, FbNode::string(value));
+        return kv;
+    }
+
+    static void addType(FbNode& field, const ArrowType& type) {
+        auto t = FbNode::table();
+        uint8_t type_type;
+        if (type.kind == 'b') {
+            type_type = type_bool;
+        } else if (type.kind == 's') {
+            type_type = type_utf8;
+        } else if (type.kind == 'f') {
+            type_type = type_floating_point;
+            t->add<int16_t>(0, type.bit_width == 16 ? 0 : (type.bit_width == 32 ? 1 : 2));
+        } else {
+            type_type = type_int;
+            t->add<int32_t>(0, type.bit_width).add<uint8_t>(1, type.kind == 'i');
+        }
+        field.add<uint8_t>(2, type_type).add(3, t);
+    }
+
+    static FbNode::Ptr field(const ArrowColumn& column) {
+        auto f = FbNode::table();
+        f->add(0, FbNode::string(column.name)).add<uint8_t>(1, column.name != "trainId");
+        if (column.shape.empty()) {
+            addType(*f, column.type);
+            return f;
+        }
+
+        std::size_t n = 1;
+        for (auto s : column.shape) n *= s;
+        auto list = FbNode::table();
+        list->add<int32_t>(0, static_cast<int32_t>(n));
+        f->add<uint8_t>(2, type_fixed_size_list).add(3, list);
+
+        auto item = FbNode::table();
+        item->add(0, FbNode::string("item")).add<uint8_t>(1, 1);
+        addType(*item, column.type);
+        f->add(5, FbNode::tables({item}));
+
+        std::string shape = "{\"shape\":" + vector2string(column.shape) + "}";
+        f->add(6, FbNode::tables({keyValue("ARROW:extension:name", "arrow.fixed_shape_tensor"),
+                                  keyValue("ARROW:extension:metadata", shape)}));
+        return f;
+    }
+
+    static FbNode::Ptr message(uint8_t header_type, const FbNode::Ptr& header, int64_t body_length) {
+        auto msg = FbNode::table();
+        msg->add<int16_t>(0, metadata_version).add<uint8_t>(1, header_type).add(2, header)
+            .add<int64_t>(3, body_length);
+        return msg;
+    }
+
+    void writeAll(std::vector<iovec>& iov) {
+        if (file_) {
+            for (auto& v : iov) file_->write(v.iov_base, v.iov_len);
+            return;
+        }
+
+        std::size_t i = 0;
+        while (i < iov.size()) {
+            int n = static_cast<int>(std::min<std::size_t>(iov.size() - i, IOV_MAX));
+            ssize_t written = ::writev(fd_, &iov[i], n);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(std::string("Failed to write the Arrow stream: ") + strerror(errno));
+            }
+            // skip what has been written
+            auto left = static_cast<std::size_t>(written);
+            while (i < iov.size() && left >= iov[i].iov_len) left -= iov[i++].iov_len;
+            if (left > 0) {
+                iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + left;
+                iov[i].iov_len -= left;
+            }
+        }
+    }
+
+    /*
+     * Append an encapsulated message to iov. The metadata is kept alive
+     * by the caller.
+     */
+    static void encapsulate(std::vector<iovec>& iov, std::string& metadata) {
+        metadata.insert(0, 8, '\0');
+        metadata.resize(padded(metadata.size()), '\0');
+        auto prefix_size = static_cast<int32_t>(metadata.size() - 8);
+        uint32_t marker = continuation;
+        memcpy(&metadata[0], &marker, sizeof marker);
+        memcpy(&metadata[4], &prefix_size, 4);
+        iov.push_back({&metadata[0], metadata.size()});
+    }
+
+    // whether a column can be written as a column of the schema
+    static bool matches(const ArrowColumn& column, const ArrowColumn& schema) {
+        if (column.name != schema.name || column.shape != schema.shape) return false;
+        if (column.type == schema.type) return true;
+        if (!(column.type == ArrowType{'i', 64} && schema.type == ArrowType{'u', 64}) || !column.shape.empty())
+            return false;
+        int64_t value;
+        memcpy(&value, column.values(), sizeof value);
+        return value >= 0;
+    }
+
+    void writeSchema(const std::vector<ArrowColumn>& columns) {
+        std::vector<FbNode::Ptr> fields;
+        for (auto& c : columns) fields.push_back(field(c));
+        auto schema = FbNode::table();
+        schema->add(1, FbNode::tables(fields));
+
+        std::string metadata = message(header_schema, schema, 0)->finish();
+        std::vector<iovec> iov;
+        encapsulate(iov, metadata);
+        writeAll(iov);
+
+        for (auto& c : columns) {
+            ArrowColumn s;
+            s.name = c.name;
+            s.type = c.type;
+            s.shape = c.shape;
+            schema_.push_back(std::move(s));
+        }
+    }
+
+public:
+    /*
+     * Write to an opened file descriptor, which is closed by the writer if
+     * own_fd is true.
+     */
+    explicit ArrowStreamWriter(int fd, bool own_fd = false): fd_(fd), own_fd_(own_fd) {}
+
+    /*
+     * Write to a file in the background. The file is not closed by the
+     * writer.
+     */
+    explicit ArrowStreamWriter(AsyncFileWriter& file): file_(&file) {}
+
+    ArrowStreamWriter(const ArrowStreamWriter&) = delete;
+    ArrowStreamWriter& operator=(const ArrowStreamWriter&) = delete;
+
+    ~ArrowStreamWriter() {
+        try { close(); } catch (...) {}
+    }
+
+    /*
+     * Open a file, a named pipe (created if it does not exist) or a POSIX
+     * shared memory object (e.g. "/trains", readable at /dev/shm/trains).
+     *
+     * Opening a pipe waits for a reader.
+     *
+     * Exceptions:
+     * std::runtime_error if the file cannot be opened
+     */
+    static int openFile(const std::string& path) {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+        return fd;
+    }
+
+    static int openPipe(const std::string& path) {
+        if (::mkfifo(path.c_str(), 0644) < 0 && errno != EEXIST)
+            throw std::runtime_error("Failed to create " + path + ": " + strerror(errno));
+        int fd = ::open(path.c_str(), O_WRONLY);
+        if (fd < 0) throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+        return fd;
+    }
+
+    static int openSharedMemory(const std::string& name) {
+        int fd = ::shm_open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) throw std::runtime_error("Failed to open " + name + ": " + strerror(errno));
+        return fd;
+    }
+
+    /*
+     * Write a record batch with a single row. The schema is written first
+     * if this is the first batch.
+     *
+     * Exceptions:
+     * std::runtime_error if the columns do not match the schema, e.g. an
+     * integer above INT64_MAX in an int64 column, or writing fails
+     */
+    void write(const std::vector<ArrowColumn>& columns) {
+        if (schema_.empty()) {
+            writeSchema(columns);
+        } else {
+            bool match = columns.size() == schema_.size();
+            for (std::size_t i = 0; match && i < columns.size(); ++i)
+                match = matches(columns[i], schema_[i]);
+            if (!match) throw std::runtime_error("The structure of the train changed, "
+                                                 "a new stream is required!");
+        }
+
+        static const char zeros[8] = {0};
+
+        std::vector<int64_t> nodes; // (length, null count) pairs
+        std::vector<int64_t> buffers; // (offset, length) pairs
+        std::vector<iovec> body;
+        std::vector<int32_t> offsets; // offsets of the utf8 columns
+        offsets.reserve(2 * columns.size());
+        int64_t body_length = 0;
+
+        auto addBuffer = [&](const void* ptr, std::size_t len) {
+            buffers.push_back(body_length);
+            buffers.push_back(static_cast<int64_t>(len));
+            if (len == 0) return;
+            body.push_back({const_cast<void*>(ptr), len});
+            std::size_t pad = padded(len) - len;
+            if (pad) body.push_back({const_cast<char*>(zeros), pad});
+            body_length += static_cast<int64_t>(padded(len));
+        };
+
+        for (auto& c : columns) {
+            nodes.push_back(1);
+            nodes.push_back(0);
+            addBuffer(nullptr, 0); // no validity bitmap
+            if (!c.shape.empty()) {
+                std::size_t n = 1;
+                for (auto s : c.shape) n *= s;
+                nodes.push_back(static_cast<int64_t>(n));
+                nodes.push_back(0);
+                addBuffer(nullptr, 0);
+            } else if (c.type.kind == 's') {
+                offsets.push_back(0);
+                offsets.push_back(static_cast<int32_t>(c.nbytes()));
+                addBuffer(&offsets[offsets.size() - 2], 2 * sizeof(int32_t));
+            }
+            addBuffer(c.values(), c.nbytes());
+        }
+
+        // FieldNode and Buffer are structs of two longs
+        auto batch = FbNode::table();
+        batch->add<int64_t>(0, 1)
+            .add(1, FbNode::vector(nodes, 8, 2))
+            .add(2, FbNode::vector(buffers, 8, 2));
+
+        std::string metadata = message(header_record_batch, batch, body_length)->finish();
+        std::vector<iovec> iov;
+        encapsulate(iov, metadata);
+        iov.insert(iov.end(), body.begin(), body.end());
+        writeAll(iov);
+    }
+
+    /*
+     * Write a train.
+     */
+    void write(std::map<std::string, kb_data>& data_pkg) {
+        write(toArrowColumns(data_pkg));
+    }
+
+    /*
+     * Write the end-of-stream marker and close the file descriptor if owned.
+     */
+    void close() {
+        if (closed_) return;
+        closed_ = true;
+
+        uint32_t eos[2] = {static_cast<uint32_t>(continuation), 0};
+        std::vector<iovec> iov = {{eos, sizeof eos}};
+        writeAll(iov);
+        if (own_fd_) ::close(fd_);
+    }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_CPP_KB_ARROW_HPP
@@ -0,0 +1,525 @@
+/*
+    Karabo bridge asynchronous file writer.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_CPP_KB_ASYNC_WRITER_HPP
+#define KARABO_BRIDGE_CPP_KB_ASYNC_WRITER_HPP
+
+#include "kb_queue.hpp"
+
+#include <zmq.hpp>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#ifdef KARABO_BRIDGE_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <stdexcept>
+
+
+namespace karabo_bridge {
+
+#ifdef KARABO_BRIDGE_HAVE_IO_URING
+
+/*
+ * A minimal io_uring submission and completion queue pair, driven by the
+ * raw system calls.
+ */
+class IoUring {
+    int fd_ = -1;
+    unsigned entries_ = 0;
+
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_mask_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    io_uring_sqe* sqes_ = nullptr;
+    unsigned sq_local_tail_ = 0;
+    unsigned to_submit_ = 0;
+
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned* cq_mask_ = nullptr;
+    io_uring_cqe* cqes_ = nullptr;
+
+    void* sq_ring_ = MAP_FAILED;
+    std::size_t sq_ring_size_ = 0;
+    void* cq_ring_ = MAP_FAILED;
+    std::size_t cq_ring_size_ = 0;
+    std::size_t sqes_size_ = 0;
+
+public:
+    IoUring() = default;
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    ~IoUring() { close(); }
+
+    /*
+     * Set up the rings. Return false if io_uring is not available, e.g. on
+     * old kernels or in restricted containers.
+     */
+    bool init(unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof params);
+        fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd_ < 0) return false;
+        entries_ = params.sq_entries;
+
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+
+        sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd_, IORING_OFF_SQ_RING);
+        cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd_, IORING_OFF_CQ_RING);
+        void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd_, IORING_OFF_SQES);
+        if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes == MAP_FAILED) {
+            if (sqes != MAP_FAILED) munmap(sqes, sqes_size_);
+            close();
+            return false;
+        }
+
+        auto sq = static_cast<char*>(sq_ring_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
+        sq_local_tail_ = *sq_tail_;
+
+        auto cq = static_cast<char*>(cq_ring_);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    void close() {
+        if (sqes_) munmap(sqes_, sqes_size_);
+        if (cq_ring_ != MAP_FAILED) munmap(cq_ring_, cq_ring_size_);
+        if (sq_ring_ != MAP_FAILED) munmap(sq_ring_, sq_ring_size_);
+        if (fd_ >= 0) ::close(fd_);
+        sqes_ = nullptr;
+        cq_ring_ = sq_ring_ = MAP_FAILED;
+        fd_ = -1;
+    }
+
+    bool registerBuffers(const std::vector<iovec>& iov) {
+        return syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS,
+                       iov.data(), static_cast<unsigned>(iov.size())) == 0;
+    }
+
+    /*
+     * Return a cleared submission entry, or nullptr if the queue is full.
+     */
+    io_uring_sqe* sqe() {
+        unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (sq_local_tail_ - head >= entries_) return nullptr;
+        unsigned index = sq_local_tail_ & *sq_mask_;
+        io_uring_sqe* entry = &sqes_[index];
+        memset(entry, 0, sizeof *entry);
+        sq_array_[index] = index;
+        ++sq_local_tail_;
+        ++to_submit_;
+        return entry;
+    }
+
+    /*
+     * Submit the prepared entries and optionally wait for completions.
+     */
+    int submit(unsigned wait_nr = 0) {
+        __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+        int ret;
+        do {
+            ret = static_cast<int>(syscall(__NR_io_uring_enter, fd_, to_submit_, wait_nr,
+                                           wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+        } while (ret < 0 && errno == EINTR);
+        if (ret >= 0) to_submit_ -= std::min<unsigned>(to_submit_, static_cast<unsigned>(ret));
+        return ret;
+    }
+
+    /*
+     * Pop a completion. Return false if there is none.
+     */
+    bool cqe(io_uring_cqe& entry) {
+        unsigned head = *cq_head_;
+        if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) return false;
+        entry = cqes_[head & *cq_mask_];
+        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+};
+
+#endif // KARABO_BRIDGE_HAVE_IO_URING
+
+/*
+ * Append-only file writer which writes in the background.
+ *
+ * The data is gathered in a fixed pool of aligned buffers which are
+ * written with O_DIRECT, bypassing the page cache, through io_uring (with
+ * the buffers registered) when it is available and by a pool of threads
+ * calling pwrite otherwise. Writing only waits when all the buffers are in
+ * flight, i.e. when the disk cannot keep up.
+ *
+ * Frames whose data is aligned to the block size, and which start at an
+ * aligned position in the file (see align()), are written straight from
+ * the message without being copied. The frames received from zmq are not
+ * aligned, and are copied.
+ */
+class AsyncFileWriter {
+public:
+    static const std::size_t alignment = 4096;
+
+private:
+    struct Slot {
+        char* buffer = nullptr; // staging buffer, nullptr for a frame slot
+        zmq::message_t frame; // frame written without copying
+        iovec iov;
+        uint64_t offset = 0;
+        bool busy = false;
+    };
+
+    int fd_ = -1;
+    bool direct_ = false;
+    std::size_t buffer_size_;
+    std::size_t n_buffers_;
+    std::vector<Slot> slots_; // staging slots followed by frame slots
+
+    int current_ = -1; // staging slot being filled
+    std::size_t fill_ = 0;
+    uint64_t file_offset_ = 0; // file offset of the current staging buffer
+    std::size_t inflight_ = 0;
+    std::string error_;
+    bool closed_ = false;
+
+#ifdef KARABO_BRIDGE_HAVE_IO_URING
+    IoUring ring_;
+#endif
+    bool uring_ = false;
+    bool registered_ = false;
+
+    std::vector<std::thread> workers_;
+    BoundedQueue<int> jobs_;
+    BoundedQueue<std::pair<int, ssize_t>> done_;
+
+    void workLoop() {
+        int index;
+        while (jobs_.pop(index)) {
+            Slot& slot = slots_[index];
+            auto ptr = static_cast<const char*>(slot.iov.iov_base);
+            std::size_t left = slot.iov.iov_len;
+            uint64_t offset = slot.offset;
+            ssize_t result = 0;
+            while (left > 0) {
+                ssize_t n = ::pwrite(fd_, ptr, left, static_cast<off_t>(offset));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    result = n < 0 ? -errno : -EIO;
+                    break;
+                }
+                ptr += n;
+                offset += n;
+                left -= n;
+                result += n;
+            }
+            done_.push(std::make_pair(index, result));
+        }
+    }
+
+    void submit(int index) {
+        Slot& slot = slots_[index];
+        slot.busy = true;
+        ++inflight_;
+
+#ifdef KARABO_BRIDGE_HAVE_IO_URING
+        if (uring_) {
+            io_uring_sqe* sqe;
+            while ((sqe = ring_.sqe()) == nullptr) reap(true);
+            sqe->fd = fd_;
+            sqe->off = slot.offset;
+            sqe->user_data = static_cast<uint64_t>(index);
+            if (slot.buffer && registered_) {
+                sqe->opcode = IORING_OP_WRITE_FIXED;
+                sqe->addr = reinterpret_cast<uint64_t>(slot.iov.iov_base);
+                sqe->len = static_cast<uint32_t>(slot.iov.iov_len);
+                sqe->buf_index = static_cast<uint16_t>(index);
+            } else {
+                sqe->opcode = IORING_OP_WRITEV;
+                sqe->addr = reinterpret_cast<uint64_t>(&slot.iov);
+                sqe->len = 1;
+            }
+            if (ring_.submit() < 0)
+                throw std::runtime_error(std::string("io_uring submission failed: ") + strerror(errno));
+            return;
+        }
+#endif
+        jobs_.push(int(index));
+    }
+
+    void complete(int index, ssize_t result) {
+        Slot& slot = slots_[index];
+        --inflight_;
+        if (result > 0 && static_cast<std::size_t>(result) < slot.iov.iov_len) {
+            // io_uring may write less than asked, e.g. when interrupted: write the rest
+            slot.iov.iov_base = static_cast<char*>(slot.iov.iov_base) + result;
+            slot.iov.iov_len -= result;
+            slot.offset += result;
+            submit(index);
+            return;
+        }
+
+        if (result < 0)
+            error_ = std::string("Asynchronous write failed: ") + strerror(static_cast<int>(-result));
+        else if (static_cast<std::size_t>(result) != slot.iov.iov_len)
+            error_ = "Asynchronous write was short!";
+        slot.busy = false;
+        slot.frame = zmq::message_t();
+    }
+
+    /*
+     * Handle the finished writes, waiting for one if requested.
+     */
+    void reap(bool wait) {
+#ifdef KARABO_BRIDGE_HAVE_IO_URING
+        if (uring_) {
+            io_uring_cqe entry;
+            bool found = false;
+            while (ring_.cqe(entry)) {
+                complete(static_cast<int>(entry.user_data), entry.res);
+                found = true;
+            }
+            if (found || !wait || inflight_ == 0) return;
+            if (ring_.submit(1) < 0)
+                throw std::runtime_error(std::string("io_uring wait failed: ") + strerror(errno));
+            while (ring_.cqe(entry)) complete(static_cast<int>(entry.user_data), entry.res);
+            return;
+        }
+#endif
+        std::pair<int, ssize_t> result;
+        if (wait && inflight_ > 0 && done_.pop(result)) complete(result.first, result.second);
+        while (done_.try_pop(result)) complete(result.first, result.second);
+    }
+
+    int acquire(bool staging) {
+        std::size_t begin = staging ? 0 : n_buffers_;
+        while (true) {
+            for (std::size_t i = begin; i < begin + n_buffers_; ++i)
+                if (!slots_[i].busy) return static_cast<int>(i);
+            reap(true);
+        }
+    }
+
+    void checkError() {
+        if (!error_.empty()) {
+            std::string error(error_);
+            error_.clear();
+            throw std::runtime_error(error);
+        }
+    }
+
+    /*
+     * Submit the current staging buffer, padded with zeros to the block size.
+     */
+    void flushStaging() {
+        if (current_ < 0 || fill_ == 0) return;
+        Slot& slot = slots_[current_];
+        std::size_t len = (fill_ + alignment - 1) / alignment * alignment;
+        memset(slot.buffer + fill_, 0, len - fill_);
+        slot.iov.iov_base = slot.buffer;
+        slot.iov.iov_len = len;
+        slot.offset = file_offset_;
+        file_offset_ += len;
+        submit(current_);
+        current_ = -1;
+        fill_ = 0;
+    }
+
+public:
+    /*
+     * Create or truncate a file.
+     *
+     * n_buffers: number of staging buffers (and of frames in flight)
+     * buffer_size: size of a staging buffer, rounded up to the block size
+     * direct: open with O_DIRECT if the file system supports it
+     * use_io_uring: write through io_uring if the kernel supports it,
+     *               otherwise through a pool of threads calling pwrite
+     *
+     * Exceptions:
+     * std::runtime_error if the file cannot be opened or the buffers allocated
+     */
+    explicit AsyncFileWriter(const std::string& path, std::size_t n_buffers = 8,
+                             std::size_t buffer_size = 4 << 20, bool direct = true, bool use_io_uring = true):
+        buffer_size_((std::max(buffer_size, std::size_t(alignment)) + alignment - 1) / alignment * alignment),
+        n_buffers_(std::max<std::size_t>(n_buffers, 1)),
+        slots_(2 * n_buffers_),
+        jobs_(2 * n_buffers_),
+        done_(2 * n_buffers_) {
+
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+        if (direct) {
+            fd_ = ::open(path.c_str(), flags | O_DIRECT, 0644);
+            direct_ = fd_ >= 0;
+        }
+        // e.g. tmpfs does not support O_DIRECT
+        if (fd_ < 0) fd_ = ::open(path.c_str(), flags, 0644);
+        if (fd_ < 0) throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+
+        std::vector<iovec> iov;
+        for (std::size_t i = 0; i < n_buffers_; ++i) {
+            void* buffer = nullptr;
+            if (posix_memalign(&buffer, alignment, buffer_size_) != 0) {
+                for (auto& slot : slots_) free(slot.buffer);
+                ::close(fd_);
+                throw std::runtime_error("Failed to allocate the staging buffers!");
+            }
+            slots_[i].buffer = static_cast<char*>(buffer);
+            iov.push_back({buffer, buffer_size_});
+        }
+
+#ifdef KARABO_BRIDGE_HAVE_IO_URING
+        if (use_io_uring) uring_ = ring_.init(static_cast<unsigned>(2 * n_buffers_));
+        // registering may fail because of RLIMIT_MEMLOCK
+        if (uring_) registered_ = ring_.registerBuffers(iov);
+#else
+        (void)use_io_uring;
+#endif
+        if (!uring_) {
+            for (std::size_t i = 0; i < n_buffers_; ++i)
+                workers_.emplace_back(&AsyncFileWriter::workLoop, this);
+        }
+    }
+
+    AsyncFileWriter(const AsyncFileWriter&) = delete;
+    AsyncFileWriter& operator=(const AsyncFileWriter&) = delete;
+
+    ~AsyncFileWriter() {
+        try { close(); } catch (...) {}
+        for (std::size_t i = 0; i < n_buffers_; ++i) free(slots_[i].buffer);
+    }
+
+    /*
+     * Append data by copying it into the staging buffers.
+     *
+     * Exceptions:
+     * std::runtime_error if a previous write failed
+     */
+    void write(const void* data, std::size_t size) {
+        checkError();
+        auto ptr = static_cast<const char*>(data);
+        while (size > 0) {
+            if (current_ < 0) current_ = acquire(true);
+            std::size_t n = std::min(size, buffer_size_ - fill_);
+            memcpy(slots_[current_].buffer + fill_, ptr, n);
+            fill_ += n;
+            ptr += n;
+            size -= n;
+            if (fill_ == buffer_size_) flushStaging();
+        }
+        reap(false);
+    }
+
+    /*
+     * Append a frame. The aligned part of the frame is written without
+     * copying if the frame starts at an aligned position in the file (see
+     * offset()). The rest is copied.
+     *
+     * Exceptions:
+     * std::runtime_error if a previous write failed
+     */
+    void write(zmq::message_t&& frame) {
+        checkError();
+        auto ptr = static_cast<const char*>(frame.data());
+        std::size_t aligned = frame.size() / alignment * alignment;
+        if (aligned == 0 || offset() % alignment != 0 ||
+                reinterpret_cast<uintptr_t>(ptr) % alignment != 0) {
+            write(ptr, frame.size());
+            return;
+        }
+
+        // the staging buffer is aligned here, i.e. it is written as it is
+        flushStaging();
+
+        int index = acquire(false);
+        Slot& slot = slots_[index];
+        slot.iov.iov_base = const_cast<char*>(ptr);
+        slot.iov.iov_len = aligned;
+        slot.offset = file_offset_;
+        file_offset_ += aligned;
+        std::size_t tail = frame.size() - aligned;
+        slot.frame = std::move(frame);
+        // the frame is released once written: copy the tail before
+        if (tail > 0) write(ptr + aligned, tail);
+        submit(index);
+    }
+
+    /*
+     * Write zeros up to the next aligned position.
+     */
+    void align() {
+        static const char zeros[alignment] = {0};
+        std::size_t pad = (alignment - offset() % alignment) % alignment;
+        if (pad > 0) write(zeros, pad);
+    }
+
+    // number of bytes appended so far
+    uint64_t offset() const { return file_offset_ + fill_; }
+
+    // whether the file is written with O_DIRECT
+    bool direct() const { return direct_; }
+
+    // whether the writes go through io_uring rather than the thread pool
+    bool usesIoUring() const { return uring_; }
+
+    /*
+     * Wait for all the writes and close the file.
+     *
+     * Exceptions:
+     * std::runtime_error if a write failed
+     */
+    void close() {
+        if (closed_) return;
+        closed_ = true;
+
+        uint64_t size = offset();
+        try {
+            flushStaging();
+            while (inflight_ > 0) reap(true);
+        } catch (std::exception& e) {
+            if (error_.empty()) error_ = e.what();
+        }
+
+        jobs_.close();
+        for (auto& t : workers_) t.join();
+
+        // remove the padding of the last block
+        if (::ftruncate(fd_, static_cast<off_t>(size)) < 0 && error_.empty())
+            error_ = std::string("Failed to truncate: ") + strerror(errno);
+        ::close(fd_);
+        checkError();
+    }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_CPP_KB_ASYNC_WRITER_HPP
@@ -0,0 +1,202 @@
+/*
+    Karabo bridge batch stacker.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_CPP_KB_BATCH_HPP
+#define KARABO_BRIDGE_CPP_KB_BATCH_HPP
+
+#include "kb_client.hpp"
+
+#include <stdlib.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+
+namespace karabo_bridge {
+
+/*
+ * Stack the frames of consecutive trains into batches of shape
+ * (batch_size, *frame_shape), e.g. for the inference of a neural network.
+ *
+ * The frames are converted to T while they are copied into one of two
+ * preallocated and aligned buffers, so that a batch is filled while the
+ * previous one is consumed. A single producer calls add() and a single
+ * consumer calls acquire() and release(), typically in different threads.
+ */
+template <typename T>
+class BatchStacker {
+public:
+    struct Batch {
+        const T* data = nullptr; // (size, *frame_shape)
+        std::size_t size = 0; // number of frames
+        std::vector<uint64_t> train_ids; // train ID of every frame
+        std::vector<unsigned int> pulses; // index of every frame in its train
+    };
+
+    static const std::size_t alignment = 64;
+
+private:
+    struct Buffer {
+        std::unique_ptr<T, decltype(&free)> data;
+        Batch batch;
+        bool in_use; // ready or being consumed
+
+        Buffer(): data(nullptr, &free), in_use(false) {}
+    };
+
+    std::size_t batch_size_;
+    std::vector<unsigned int> frame_shape_;
+    std::size_t frame_size_; // number of elements of a frame
+
+    Buffer buffers_[2];
+    std::size_t filling_ = 0; // buffer filled by the producer
+    std::size_t consuming_ = 0; // buffer acquired by the consumer
+    std::deque<std::size_t> ready_;
+    bool closed_ = false;
+
+    std::mutex mutex_;
+    std::condition_variable ready_cv_;
+    std::condition_variable free_cv_;
+
+    // hand the filled buffer to the consumer and wait for the other one
+    void publish() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        buffers_[filling_].in_use = true;
+        ready_.push_back(filling_);
+        ready_cv_.notify_one();
+
+        filling_ = 1 - filling_;
+        free_cv_.wait(lock, [this] { return !buffers_[filling_].in_use; });
+        Batch& batch = buffers_[filling_].batch;
+        batch.size = 0;
+        batch.train_ids.clear();
+        batch.pulses.clear();
+    }
+
+public:
+    /*
+     * batch_size: number of frames in a batch
+     * frame_shape: shape of a frame, e.g. (ss, fs)
+     *
+     * Exceptions:
+     * std::bad_alloc if the buffers cannot be allocated
+     */
+    BatchStacker(std::size_t batch_size, const std::vector<unsigned int>& frame_shape):
+        batch_size_(std::max<std::size_t>(batch_size, 1)),
+        frame_shape_(frame_shape),
+        frame_size_(1) {
+        for (auto v : frame_shape_) frame_size_ *= v;
+
+        std::size_t bytes = batch_size_ * frame_size_ * sizeof(T);
+        bytes = (bytes + alignment - 1) / alignment * alignment;
+        for (auto& buffer : buffers_) {
+            void* ptr;
+            if (posix_memalign(&ptr, alignment, std::max<std::size_t>(bytes, alignment)) != 0)
+                throw std::bad_alloc();
+            buffer.data.reset(static_cast<T*>(ptr));
+            buffer.batch.data = buffer.data.get();
+            buffer.batch.train_ids.reserve(batch_size_);
+            buffer.batch.pulses.reserve(batch_size_);
+        }
+    }
+
+    BatchStacker(const BatchStacker&) = delete;
+    BatchStacker& operator=(const BatchStacker&) = delete;
+
+    /*
+     * Add the frames of a train, i.e. the given pulses along the first axis
+     * of the array, or all of them if pulses is empty. An array of the
+     * frame shape is a single frame.
+     *
+     * Wait for the consumer if both buffers are full.
+     *
+     * Exceptions:
+     * std::invalid_argument if the shape does not match or the data type is
+     * unknown
+     * std::out_of_range if a pulse is out of the array
+     */
+    void add(const Array& array, uint64_t train_id,
+             const std::vector<unsigned int>& pulses = std::vector<unsigned int>()) {
+        auto shape = array.shape();
+        bool single = shape == frame_shape_;
+        if (!single && (shape.size() != frame_shape_.size() + 1 ||
+                        !std::equal(frame_shape_.begin(), frame_shape_.end(), shape.begin() + 1)))
+            throw std::invalid_argument("The shape of the array does not match " + vector2string(frame_shape_));
+
+        std::size_t n_frames = single ? 1 : shape[0];
+        std::size_t n = pulses.empty() ? n_frames : pulses.size();
+        std::size_t frame_bytes = frame_size_ * dtype_size(array.dtype());
+        auto src = static_cast<const char*>(array.data());
+        for (std::size_t i = 0; i < n; ++i) {
+            unsigned int pulse = pulses.empty() ? static_cast<unsigned int>(i) : pulses[i];
+            if (pulse >= n_frames) throw std::out_of_range("Pulse out of range");
+
+            Batch& batch = buffers_[filling_].batch;
+            Array frame(const_cast<char*>(src) + pulse * frame_bytes, frame_shape_, array.dtype());
+            frame.convert_to(buffers_[filling_].data.get() + batch.size * frame_size_);
+            batch.train_ids.push_back(train_id);
+            batch.pulses.push_back(pulse);
+            if (++batch.size == batch_size_) publish();
+        }
+    }
+
+    /*
+     * Hand the partly filled batch to the consumer.
+     */
+    void flush() {
+        if (buffers_[filling_].batch.size > 0) publish();
+    }
+
+    /*
+     * Flush and tell the consumer that no batch follows.
+     */
+    void close() {
+        flush();
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        ready_cv_.notify_all();
+    }
+
+    /*
+     * Wait for the next batch, which is valid until release().
+     *
+     * Return nullptr if the stacker is closed and all batches were consumed.
+     */
+    const Batch* acquire() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_cv_.wait(lock, [this] { return closed_ || !ready_.empty(); });
+        if (ready_.empty()) return nullptr;
+        consuming_ = ready_.front();
+        ready_.pop_front();
+        return &buffers_[consuming_].batch;
+    }
+
+    /*
+     * Give the acquired batch back to the producer.
+     */
+    void release() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        buffers_[consuming_].in_use = false;
+        free_cv_.notify_one();
+    }
+
+    std::size_t batchSize() const { return batch_size_; }
+
+    const std::vector<unsigned int>& frameShape() const { return frame_shape_; }
+};
+
+template <typename T>
+const std::size_t BatchStacker<T>::alignment;
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_CPP_KB_BATCH_HPP
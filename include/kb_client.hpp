@@ -16,7 +16,11 @@
 #include <zmq.hpp>
 #include <msgpack.hpp>
 
+#include "kb_dispatch.hpp"
+#include "kb_memory.hpp"
+
 #include <string>
+#include <cstring>
 #include <stack>
 #include <array>
 #include <deque>
@@ -26,13 +30,26 @@
 #include <exception>
 #include <limits>
 #include <type_traits>
+#include <algorithm>
+#include <chrono>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 
 namespace karabo_bridge {
 
 using MsgObjectMap = std::map<std::string, msgpack::object>;
 
-using MultipartMsg = std::deque<zmq::message_t>;
+// the frames of a message, allocated from the default resource of the thread
+using MultipartMsg = std::deque<zmq::message_t, PolymorphicAllocator<zmq::message_t>>;
+
+// data indexed by path, allocated from the default resource of the thread
+template <typename T>
+using PathMap = std::map<std::string, T, std::less<std::string>,
+                         PolymorphicAllocator<std::pair<const std::string, T>>>;
 
 // map msgpack object types to strings
 std::map<msgpack::type::object_type, std::string> msgpack_type_map = {
@@ -66,6 +83,179 @@ bool check_type_by_string(const std::string& type_string) {
     return (type_string == "double" && std::is_same<T, double>::value);
 }
 
+/*
+ * Return the size in bytes of a single element of the given data type.
+ *
+ * Both the python (e.g. "uint16", "float32") and the c++ (e.g. "uint16_t",
+ * "float") type strings are accepted.
+ *
+ * Exceptions:
+ * std::invalid_argument if the data type is unknown
+ */
+std::size_t dtype_size(const std::string& type_string) {
+    std::string dtype(type_string);
+    if (dtype.size() > 2 && dtype.compare(dtype.size() - 2, 2, "_t") == 0)
+        dtype.erase(dtype.size() - 2);
+
+    if (dtype == "uint8" || dtype == "int8" || dtype == "bool") return 1;
+    if (dtype == "uint16" || dtype == "int16" || dtype == "float16") return 2;
+    if (dtype == "uint32" || dtype == "int32" || dtype == "float32" || dtype == "float") return 4;
+    if (dtype == "uint64" || dtype == "int64" || dtype == "float64" || dtype == "double") return 8;
+    throw std::invalid_argument("Unknown data type: " + type_string);
+}
+
+/*
+ * Call func with a null pointer to the c++ type of the given data type,
+ * i.e. func(static_cast<T*>(nullptr)).
+ *
+ * Exceptions:
+ * std::invalid_argument if the data type is unknown or has no c++ type
+ */
+template <typename Func>
+void dispatch_dtype(const std::string& type_string, Func&& func) {
+    std::string dtype(type_string);
+    if (dtype.size() > 2 && dtype.compare(dtype.size() - 2, 2, "_t") == 0)
+        dtype.erase(dtype.size() - 2);
+
+    if (dtype == "uint8" || dtype == "bool") func(static_cast<uint8_t*>(nullptr));
+    else if (dtype == "int8") func(static_cast<int8_t*>(nullptr));
+    else if (dtype == "uint16") func(static_cast<uint16_t*>(nullptr));
+    else if (dtype == "int16") func(static_cast<int16_t*>(nullptr));
+    else if (dtype == "uint32") func(static_cast<uint32_t*>(nullptr));
+    else if (dtype == "int32") func(static_cast<int32_t*>(nullptr));
+    else if (dtype == "uint64") func(static_cast<uint64_t*>(nullptr));
+    else if (dtype == "int64") func(static_cast<int64_t*>(nullptr));
+    else if (dtype == "float" || dtype == "float32") func(static_cast<float*>(nullptr));
+    else if (dtype == "double" || dtype == "float64") func(static_cast<double*>(nullptr));
+    else throw std::invalid_argument("Unsupported data type: " + type_string);
+}
+
+/*
+ * Convert a contiguous row.
+ */
+template <typename S, typename D>
+void convertRow(const S* src, D* dst, std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i) dst[i] = static_cast<D>(src[i]);
+}
+
+inline void convertRow(const uint16_t* src, float* dst, std::size_t n) {
+    kernels().convert_u16_f32(src, dst, n);
+}
+
+/*
+ * Copy a C-contiguous array of S into dst as D, with the given strides in
+ * bytes. The rows along the last axis are copied with memcpy when neither
+ * a conversion nor a stride is needed, and converted by the vectorized
+ * kernels when only a conversion is.
+ */
+template <typename S, typename D>
+void copy_strided(const S* src, const std::vector<unsigned int>& shape,
+                  char* dst, const std::vector<std::ptrdiff_t>& strides) {
+    std::size_t ndim = shape.size();
+    if (ndim == 0) {
+        D v = static_cast<D>(*src);
+        std::memcpy(dst, &v, sizeof(D));
+        return;
+    }
+
+    std::size_t n_rows = 1;
+    for (std::size_t k = 0; k + 1 < ndim; ++k) n_rows *= shape[k];
+    std::size_t row_size = shape[ndim - 1];
+    std::ptrdiff_t step = strides[ndim - 1];
+    bool dense = step == static_cast<std::ptrdiff_t>(sizeof(D));
+    bool contiguous = std::is_same<S, D>::value && dense;
+
+    std::vector<unsigned int> index(ndim - 1, 0);
+    char* row = dst;
+    for (std::size_t r = 0; r < n_rows; ++r, src += row_size) {
+        if (contiguous) {
+            std::memcpy(row, src, row_size * sizeof(D));
+        } else if (dense && reinterpret_cast<uintptr_t>(row) % alignof(D) == 0) {
+            convertRow(src, reinterpret_cast<D*>(row), row_size);
+        } else {
+            for (std::size_t i = 0; i < row_size; ++i) {
+                D v = static_cast<D>(src[i]);
+                std::memcpy(row + i * step, &v, sizeof(D));
+            }
+        }
+
+        // move to the next row
+        for (std::size_t k = ndim - 1; k-- > 0;) {
+            row += strides[k];
+            if (++index[k] < shape[k]) break;
+            row -= strides[k] * static_cast<std::ptrdiff_t>(shape[k]);
+            index[k] = 0;
+        }
+    }
+}
+
+/*
+ * Data wanted from a single source.
+ *
+ * The pulse selection is applied along the first axis of 1D arrays and of
+ * arrays with more than two dimensions, e.g. (pulses, modules, ss, fs). The
+ * region of interest is applied to the last two axes of arrays with at least
+ * two dimensions. Both are only honoured by servers which understand the
+ * extended request (see Client::setSelection).
+ */
+struct SourceSelection {
+    std::vector<std::string> paths; // empty: all paths
+    // indices along the pulse axis, not pulse IDs (e.g. "image.pulseId"); the
+    // indices past the end are ignored. Empty: all pulses
+    std::vector<unsigned int> pulses;
+    std::array<unsigned int, 4> roi; // (y, x, height, width), zero size: the whole frame
+
+    SourceSelection(): roi() {}
+
+    bool hasPath(const std::string& path) const {
+        return paths.empty() || std::find(paths.begin(), paths.end(), path) != paths.end();
+    }
+
+    bool hasRoi() const { return roi[2] > 0 && roi[3] > 0; }
+};
+
+/*
+ * Data wanted from a server, indexed by source. An empty selection means
+ * everything.
+ */
+using Selection = std::map<std::string, SourceSelection>;
+
+/*
+ * Pack an extended request which carries the selection and, for a server
+ * with the "batch" extension, the number of trains wanted.
+ *
+ * The request is a msgpack map {"request": "next", "sources": {source:
+ * {"paths": [...], "pulses": [...], "roi": [y, x, height, width]}},
+ * "count": n} while a plain request is the 4 bytes "next". "count" is only
+ * sent if n > 1.
+ */
+msgpack::sbuffer packRequest(const Selection& selection, std::size_t count = 1) {
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> packer(&buffer);
+
+    packer.pack_map(count > 1 ? 3 : 2);
+    packer.pack(std::string("request"));
+    packer.pack(std::string("next"));
+    if (count > 1) {
+        packer.pack(std::string("count"));
+        packer.pack(static_cast<uint64_t>(count));
+    }
+    packer.pack(std::string("sources"));
+    packer.pack_map(selection.size());
+    for (auto& src : selection) {
+        packer.pack(src.first);
+        packer.pack_map(3);
+        packer.pack(std::string("paths"));
+        packer.pack(src.second.paths);
+        packer.pack(std::string("pulses"));
+        packer.pack(src.second.pulses);
+        packer.pack(std::string("roi"));
+        packer.pack(std::vector<unsigned int>(src.second.roi.begin(), src.second.roi.end()));
+    }
+
+    return buffer;
+}
+
 /*
  * A container hold a msgpack::object for deferred unpack.
  */
@@ -94,34 +284,134 @@ public:
     std::string dtype() const { return msgpack_type_map.at(value_.type); }
 };
 
+/*
+ * Convert a vector to a formatted string
+ */
+template <typename T>
+std::string vector2string(const std::vector<T>& vec) {
+    std::stringstream ss;
+    ss << "[";
+    for (std::size_t i=0; i<vec.size(); ++i) {
+        ss << vec[i];
+        if (i != vec.size() - 1) ss << ", ";
+    }
+    ss << "]";
+    return ss.str();
+}
+
 /*
  * A container held a pointer to the data chunk and other useful information.
  */
 class Array {
-    void* ptr_; // pointer to the data chunk
+    void* ptr_ = nullptr; // pointer to the data chunk
     std::vector<unsigned int> shape_; // shape of the array
     std::string dtype_; // data type
+    std::size_t size_ = 0; // number of elements
+    std::size_t nbytes_ = 0; // size of the data chunk in bytes, 0 if unknown
 
-    std::size_t size() const {
-        auto max_size = std::numeric_limits<unsigned long long>::max();
+    /*
+     * Compute the number of elements and bytes once. Return false if the
+     * data type is unknown.
+     *
+     * Exceptions:
+     * std::overflow_error if the size overflows
+     */
+    bool computeSize() {
+        auto max_size = std::numeric_limits<std::size_t>::max();
 
-        std::size_t size = 1;
+        size_ = 1;
         for (auto v : shape_) {
-            if (max_size/size < v)
+            if (size_ != 0 && max_size/size_ < v)
                 throw std::overflow_error("Unmanageable array size!");
-            size *= v;
+            size_ *= v;
         }
 
-        return size;
+        std::size_t itemsize;
+        try {
+            itemsize = dtype_size(dtype_);
+        } catch (std::invalid_argument&) {
+            return false;
+        }
+        if (max_size/itemsize < size_) throw std::overflow_error("Unmanageable array size!");
+        nbytes_ = size_ * itemsize;
+        return true;
+    }
+
+    // check T in the debug builds
+    template<typename T>
+    void checkType() const {
+#ifndef NDEBUG
+        if (!check_type_by_string<T>(dtype_)) throw std::bad_cast();
+#endif
+    }
+
+    // C-contiguous strides in bytes
+    std::vector<std::ptrdiff_t> contiguous(std::size_t itemsize) const {
+        std::vector<std::ptrdiff_t> strides(shape_.size());
+        std::ptrdiff_t stride = static_cast<std::ptrdiff_t>(itemsize);
+        for (std::size_t k = shape_.size(); k-- > 0;) {
+            strides[k] = stride;
+            stride *= shape_[k];
+        }
+        return strides;
     }
+
+    // copy from the data type of the array
+    template<typename D>
+    struct ConvertFrom {
+        const void* src;
+        const std::vector<unsigned int>& shape;
+        char* dst;
+        std::vector<std::ptrdiff_t> strides;
+
+        template<typename S>
+        void operator()(S*) const { copy_strided<S, D>(static_cast<const S*>(src), shape, dst, strides); }
+    };
+
+    // copy to a data type given at run time
+    struct ConvertTo {
+        const Array& array;
+        void* dst;
+        const std::vector<std::ptrdiff_t>& strides;
+
+        template<typename D>
+        void operator()(D*) const { array.convert_to(static_cast<D*>(dst), strides); }
+    };
+
 public:
     Array() = default;
 
-    // shape and dtype should be moved into the constructor
+    /*
+     * The data chunk must hold the whole array.
+     *
+     * Exceptions:
+     * std::overflow_error if the size overflows
+     */
     Array(void* ptr, const std::vector<unsigned int>& shape, const std::string& dtype):
         ptr_(ptr),
         shape_(shape),
-        dtype_(dtype) {}
+        dtype_(dtype) {
+        computeSize();
+    }
+
+    /*
+     * Check the size of the data chunk against the shape and the data type,
+     * e.g. of a received array, so that the accessors need not.
+     *
+     * Exceptions:
+     * std::overflow_error if the size overflows
+     * std::runtime_error if the data chunk does not match the shape and the
+     * data type
+     */
+    Array(void* ptr, const std::vector<unsigned int>& shape, const std::string& dtype, std::size_t nbytes):
+        ptr_(ptr),
+        shape_(shape),
+        dtype_(dtype) {
+        if (computeSize() && nbytes_ != nbytes)
+            throw std::runtime_error("The array of " + dtype + " " + vector2string(shape) + " has " +
+                                     std::to_string(nbytes) + " bytes");
+        nbytes_ = nbytes;
+    }
 
     /*
      * Convert the data held in msg:message_t object to std::vector<T>.
@@ -134,12 +424,83 @@ public:
         if (!check_type_by_string<T>(dtype_)) throw std::bad_cast();
 
         auto ptr = reinterpret_cast<const T*>(ptr_);
-        return std::vector<T>(ptr, ptr + size());
+        return std::vector<T>(ptr, ptr + size_);
+    }
+
+    /*
+     * Return a pointer to the elements without copying them.
+     *
+     * The data type is only checked in the debug builds.
+     *
+     * Exceptions:
+     * std::bad_cast if the types do not match (debug builds)
+     */
+    template<typename T>
+    const T* view() const {
+        checkType<T>();
+        return static_cast<const T*>(ptr_);
+    }
+
+    /*
+     * Return the i-th element of the flattened array.
+     *
+     * The data type and the index are only checked in the debug builds.
+     *
+     * Exceptions:
+     * std::bad_cast if the types do not match (debug builds)
+     * std::out_of_range if the index is out of range (debug builds)
+     */
+    template<typename T>
+    const T& at(std::size_t i) const {
+        checkType<T>();
+#ifndef NDEBUG
+        if (i >= size_) throw std::out_of_range("Index out of range: " + std::to_string(i));
+#endif
+        return static_cast<const T*>(ptr_)[i];
+    }
+
+    /*
+     * Copy the array into a buffer owned by the caller, converting it to
+     * T on the way.
+     *
+     * strides: strides of dst in bytes along every axis, e.g. to write into
+     * padded rows or a part of a larger array. The default is C-contiguous.
+     *
+     * Exceptions:
+     * std::invalid_argument if the data type of the array is unsupported or
+     * the number of strides does not match the shape
+     */
+    template<typename T>
+    void convert_to(T* dst, const std::vector<std::ptrdiff_t>& strides = std::vector<std::ptrdiff_t>()) const {
+        if (!strides.empty() && strides.size() != shape_.size())
+            throw std::invalid_argument("The strides do not match the shape of the array");
+        dispatch_dtype(dtype_, ConvertFrom<T>{ptr_, shape_, reinterpret_cast<char*>(dst),
+                                              strides.empty() ? contiguous(sizeof(T)) : strides});
+    }
+
+    /*
+     * Copy the array into a buffer owned by the caller, converting it to
+     * the given data type (default: the data type of the array).
+     *
+     * See convert_to.
+     */
+    void copy_to(void* dst, const std::vector<std::ptrdiff_t>& strides = std::vector<std::ptrdiff_t>(),
+                 const std::string& dtype = "") const {
+        dispatch_dtype(dtype.empty() ? dtype_ : dtype, ConvertTo{*this, dst, strides});
     }
 
     std::vector<unsigned int> shape() const { return shape_; }
 
     std::string dtype() const { return dtype_; }
+
+    // pointer to the data chunk, which is owned by the kb_data
+    const void* data() const { return ptr_; }
+
+    // number of elements
+    std::size_t size() const { return size_; }
+
+    // size of the data chunk in bytes
+    std::size_t nbytes() const { return nbytes_; }
 };
 
 } // karabo_bridge
@@ -294,8 +655,9 @@ private:
  */
 class kb_data {
 
-    std::vector<zmq::message_t> mpmsg_; // maintain the lifetime of data
+    std::vector<zmq::message_t, PolymorphicAllocator<zmq::message_t>> mpmsg_; // maintain the lifetime of data
     msgpack::object_handle handle_; // maintain the lifetime of data
+    std::size_t msgpack_frame_ = std::numeric_limits<std::size_t>::max(); // index in mpmsg_
 
 public:
     kb_data() = default;
@@ -306,8 +668,11 @@ public:
     kb_data(kb_data&&) = default;
     kb_data& operator=(kb_data&&) = default;
 
-    std::map<std::string, Object> msgpack_data;
-    std::map<std::string, Array> array;
+    PathMap<Object> msgpack_data;
+    PathMap<Array> array;
+
+    // false if the change-only delivery found no change in msgpack_data (see ChangeFilter)
+    bool changed = true;
 
     Object& operator[](const std::string& key) {
         return msgpack_data.at(key);
@@ -326,8 +691,75 @@ public:
     void append_handle(msgpack::object_handle&& oh) {
         handle_ = std::move(oh);
     }
+
+    // the next message appended is the msgpack data frame
+    void mark_msgpack_frame() {
+        msgpack_frame_ = mpmsg_.size();
+    }
+
+    // the msgpack data frame, nullptr if there is none
+    const zmq::message_t* msgpack_frame() const {
+        return msgpack_frame_ < mpmsg_.size() ? &mpmsg_[msgpack_frame_] : nullptr;
+    }
 };
 
+/*
+ * Return the train ID of a data package.
+ *
+ * It is taken from "metadata.timestamp.tid" (or "header.trainId") of the
+ * first source which carries it.
+ *
+ * Exceptions:
+ * std::out_of_range if no source carries a train ID
+ */
+uint64_t trainId(std::map<std::string, kb_data>& data_pkg) {
+    for (auto& data : data_pkg) {
+        auto it = data.second.msgpack_data.find("metadata.timestamp.tid");
+        if (it == data.second.msgpack_data.end())
+            it = data.second.msgpack_data.find("header.trainId");
+        if (it != data.second.msgpack_data.end()) return it->second.as<uint64_t>();
+    }
+    throw std::out_of_range("No train ID found!");
+}
+
+/*
+ * Append the frames of a multipart message to another one. The frames are
+ * shared rather than copied.
+ */
+void shareMultipartMsg(const MultipartMsg& src, MultipartMsg& dst) {
+    for (auto& frame : src) {
+        dst.emplace_back();
+        dst.back().copy(&frame);
+    }
+}
+
+/*
+ * Return the train ID of a multipart message without decoding the arrays.
+ *
+ * Exceptions:
+ * std::out_of_range if no source carries a train ID
+ */
+uint64_t trainId(const MultipartMsg& mpmsg) {
+    for (auto it = mpmsg.begin(); it != mpmsg.end() && std::next(it) != mpmsg.end(); std::advance(it, 2)) {
+        msgpack::object_handle oh_header;
+        msgpack::unpack(oh_header, static_cast<const char*>(it->data()), it->size());
+        auto header_unpacked = oh_header.get().as<MsgObjectMap>();
+        if (header_unpacked.at("content").as<std::string>() != "msgpack") continue;
+
+        auto data = std::next(it);
+        msgpack::object_handle oh_data;
+        msgpack::unpack(oh_data, static_cast<const char*>(data->data()), data->size());
+        const msgpack::object& map = oh_data.get();
+        if (map.type != msgpack::type::object_type::MAP) continue;
+        for (uint32_t i = 0; i < map.via.map.size; ++i) {
+            auto key = map.via.map.ptr[i].key.as<std::string>();
+            if (key == "metadata.timestamp.tid" || key == "header.trainId")
+                return map.via.map.ptr[i].val.as<uint64_t>();
+        }
+    }
+    throw std::out_of_range("No train ID found!");
+}
+
 /*
  * Parse a single message packed by msgpack using "visitor".
  */
@@ -356,18 +788,732 @@ std::string parseMultipartMsg(const MultipartMsg& mpmsg, bool boundary=true) {
 }
 
 /*
- * Convert a vector to a formatted string
+ * The unpacked header of a (header, data) pair.
  */
-template <typename T>
-std::string vector2string(const std::vector<T>& vec) {
-    std::stringstream ss;
-    ss << "[";
-    for (std::size_t i=0; i<vec.size(); ++i) {
-        ss << vec[i];
-        if (i != vec.size() - 1) ss << ", ";
+struct UnpackedHeader {
+    msgpack::object_handle handle;
+    MsgObjectMap fields;
+};
+
+/*
+ * Unpack the headers of the (header, data) pairs of a multipart message.
+ *
+ * Exceptions:
+ * std::runtime_error if the message does not contain (header, data) pairs
+ */
+std::vector<UnpackedHeader> unpackHeaders(const MultipartMsg& mpmsg) {
+    if (mpmsg.size() % 2)
+        throw std::runtime_error("The multipart message is expected to "
+                                 "contain (header, data) pairs!");
+
+    std::vector<UnpackedHeader> headers(mpmsg.size() / 2);
+    for (std::size_t i = 0; i < headers.size(); ++i) {
+        const zmq::message_t& header = mpmsg[2 * i];
+        msgpack::unpack(headers[i].handle, static_cast<const char*>(header.data()), header.size());
+        headers[i].fields = headers[i].handle.get().as<MsgObjectMap>();
     }
-    ss << "]";
-    return ss.str();
+    return headers;
+}
+
+/*
+ * Decode a multipart message into data indexed by source.
+ *
+ * Sources and paths which are not in the selection are dropped without
+ * being unpacked. An empty selection keeps everything.
+ *
+ * headers are the unpacked headers of the message, e.g. from
+ * DuplicateFilter::apply, or empty to unpack them here.
+ *
+ * Exceptions:
+ * std::runtime_error if unknown "content" is found
+ */
+std::map<std::string, kb_data> decodeMultipartMsg(MultipartMsg& mpmsg,
+                                                  std::vector<UnpackedHeader>& headers,
+                                                  const Selection& selection = Selection()) {
+    std::map<std::string, kb_data> data_pkg;
+
+    if (mpmsg.empty()) return data_pkg;
+    if (headers.size() != mpmsg.size() / 2 || mpmsg.size() % 2) headers = unpackHeaders(mpmsg);
+
+    kb_data kbdt;
+    std::string source;
+    bool is_initialized = false;
+    bool decoded = false; // whether kbdt holds anything, e.g. only arrays
+    auto it = mpmsg.begin();
+    while(it != mpmsg.end()) {
+        // the header must contain "source" and "content"
+        const MsgObjectMap& header_unpacked = headers[std::distance(mpmsg.begin(), it) / 2].fields;
+
+        auto content = header_unpacked.at("content").as<std::string>();
+
+        const SourceSelection* src_selection = nullptr;
+        if (!selection.empty()) {
+            auto sit = selection.find(header_unpacked.at("source").as<std::string>());
+            if (sit == selection.end()) {
+                std::advance(it, 2);
+                continue;
+            }
+            src_selection = &sit->second;
+        }
+
+        // the next message is the content (data)
+        if (content == "msgpack") {
+            if (!is_initialized)
+                is_initialized = true;
+            else
+                data_pkg.insert(std::make_pair(source, std::move(kbdt)));
+
+            kbdt.append_msg(std::move(*it));
+            kbdt.mark_msgpack_frame();
+            std::advance(it, 1);
+
+            msgpack::object_handle oh_data;
+            msgpack::unpack(oh_data, static_cast<const char*>(it->data()), it->size());
+            auto data_unpacked = oh_data.get().as<MsgObjectMap>();
+
+            for (auto &dt : data_unpacked) {
+                if (src_selection && !src_selection->hasPath(dt.first)) continue;
+                kbdt.msgpack_data.insert(std::make_pair(dt.first, dt.second.as<Object>()));
+            }
+
+            kbdt.append_handle(std::move(oh_data));
+
+        } else if ((content == "array" || content == "ImageData")) {
+            auto path = header_unpacked.at("path").as<std::string>();
+            if (src_selection && !src_selection->hasPath(path)) {
+                std::advance(it, 2);
+                continue;
+            }
+
+            kbdt.append_msg(std::move(*it));
+            std::advance(it, 1);
+
+            auto shape = header_unpacked.at("shape").as<std::vector<unsigned int>>();
+            auto dtype = header_unpacked.at("dtype").as<std::string>();
+            // convert the python type to the corresponding c++ type
+            if (dtype.find("int") != std::string::npos) dtype.append("_t");
+
+            kbdt.array.insert(std::make_pair(path, Array(it->data(), shape, dtype, it->size())));
+        } else {
+            throw std::runtime_error("Unknown data content: " + content);
+        }
+
+        source = header_unpacked.at("source").as<std::string>();
+
+        kbdt.append_msg(std::move(*it));
+        std::advance(it, 1);
+        decoded = true;
+    }
+
+    if (decoded) data_pkg.insert(std::make_pair(source, std::move(kbdt)));
+
+    return data_pkg;
+}
+
+std::map<std::string, kb_data> decodeMultipartMsg(MultipartMsg& mpmsg,
+                                                  const Selection& selection = Selection()) {
+    std::vector<UnpackedHeader> headers;
+    return decodeMultipartMsg(mpmsg, headers, selection);
+}
+
+/*
+ * Return the FNV-1a hash of a msgpack object, continuing from h.
+ */
+uint64_t hashObject(const msgpack::object& obj, uint64_t h = 14695981039346656037ULL) {
+    auto mix = [&h](const void* data, std::size_t size) {
+        auto bytes = static_cast<const unsigned char*>(data);
+        for (std::size_t i = 0; i < size; ++i) {
+            h ^= bytes[i];
+            h *= 1099511628211ULL;
+        }
+    };
+
+    auto type = static_cast<unsigned char>(obj.type);
+    mix(&type, 1);
+    switch (obj.type) {
+        case msgpack::type::object_type::BOOLEAN:
+            mix(&obj.via.boolean, sizeof(obj.via.boolean));
+            break;
+        case msgpack::type::object_type::POSITIVE_INTEGER:
+            mix(&obj.via.u64, sizeof(obj.via.u64));
+            break;
+        case msgpack::type::object_type::NEGATIVE_INTEGER:
+            mix(&obj.via.i64, sizeof(obj.via.i64));
+            break;
+        case msgpack::type::object_type::FLOAT32:
+        case msgpack::type::object_type::FLOAT64:
+            mix(&obj.via.f64, sizeof(obj.via.f64));
+            break;
+        case msgpack::type::object_type::STR:
+            mix(obj.via.str.ptr, obj.via.str.size);
+            break;
+        case msgpack::type::object_type::BIN:
+            mix(obj.via.bin.ptr, obj.via.bin.size);
+            break;
+        case msgpack::type::object_type::EXT:
+            mix(obj.via.ext.ptr, obj.via.ext.size + 1); // including the type
+            break;
+        case msgpack::type::object_type::ARRAY:
+            mix(&obj.via.array.size, sizeof(obj.via.array.size));
+            for (uint32_t i = 0; i < obj.via.array.size; ++i) h = hashObject(obj.via.array.ptr[i], h);
+            break;
+        case msgpack::type::object_type::MAP:
+            mix(&obj.via.map.size, sizeof(obj.via.map.size));
+            for (uint32_t i = 0; i < obj.via.map.size; ++i) {
+                h = hashObject(obj.via.map.ptr[i].key, h);
+                h = hashObject(obj.via.map.ptr[i].val, h);
+            }
+            break;
+        default:
+            break;
+    }
+    return h;
+}
+
+/*
+ * Visitor which parses a msgpack object without unpacking it, keeping the
+ * last string visited.
+ */
+struct skip_visitor {
+    const char* str = nullptr;
+    uint32_t str_size = 0;
+
+    bool visit_nil() { return true; }
+    bool visit_boolean(bool) { return true; }
+    bool visit_positive_integer(uint64_t) { return true; }
+    bool visit_negative_integer(int64_t) { return true; }
+    bool visit_float32(float) { return true; }
+    bool visit_float64(double) { return true; }
+    bool visit_str(const char* v, uint32_t size) {
+        str = v;
+        str_size = size;
+        return true;
+    }
+    bool visit_bin(const char*, uint32_t) { return true; }
+    bool visit_ext(const char*, uint32_t) { return true; }
+    bool start_array(uint32_t) { return true; }
+    bool start_array_item() { return true; }
+    bool end_array_item() { return true; }
+    bool end_array() { return true; }
+    bool start_map(uint32_t) { return true; }
+    bool start_map_key() { return true; }
+    bool end_map_key() { return true; }
+    bool start_map_value() { return true; }
+    bool end_map_value() { return true; }
+    bool end_map() { return true; }
+    void parse_error(size_t, size_t) {}
+    void insufficient_bytes(size_t, size_t) {}
+    bool referenced() const { return false; }
+    void set_referenced(bool) {}
+};
+
+struct ChangeStats {
+    std::size_t sources = 0; // msgpack data compared
+    std::size_t identical = 0; // identical to the previous train but for the ignored keys
+    std::size_t hashed = 0; // compared key by key
+    std::size_t unchanged = 0; // sources without any change
+    std::size_t dropped_keys = 0; // unchanged keys removed
+};
+
+/*
+ * Change-only delivery of the msgpack data of slow-control sources, which
+ * resend the same values every train.
+ *
+ * The msgpack data frame of a source is compared with the one of the
+ * previous train: if the bytes are identical but for the values of the
+ * ignored keys, which must keep their offsets and lengths, nothing changed.
+ * Otherwise, the values are hashed key by key and compared with the hashes
+ * of the previous train. The unchanged keys are removed from msgpack_data and
+ * kb_data::changed is false if no key changed, appeared or disappeared.
+ *
+ * The keys starting with one of the ignored prefixes, by default the
+ * metadata (train ID and timestamps), are always delivered and do not
+ * count as changes. Arrays are not compared. A change may be missed if two
+ * values have the same 64-bit hash.
+ */
+class ChangeFilter {
+    struct Previous {
+        zmq::message_t frame; // shares the buffer of the previous frame
+        std::vector<std::pair<std::string, uint64_t>> hashes; // sorted by key
+        std::vector<std::pair<std::size_t, std::size_t>> ignored; // byte ranges of the ignored values in frame
+        bool masked = false; // whether frame is a map whose ignored values were found
+    };
+
+    std::vector<std::string> ignored_;
+    std::map<std::string, Previous> previous_; // by source
+    ChangeStats stats_;
+
+    bool isIgnored(const std::string& key) const {
+        for (auto& prefix : ignored_) {
+            if (key.compare(0, prefix.size(), prefix) == 0) return true;
+        }
+        return false;
+    }
+
+    // find the byte ranges of the values of the ignored keys at the top level
+    // of a msgpack map, return false if the frame is not a map
+    bool findIgnored(const zmq::message_t& frame, std::vector<std::pair<std::size_t, std::size_t>>& ranges) const {
+        ranges.clear();
+        auto data = static_cast<const char*>(frame.data());
+        std::size_t size = frame.size();
+        auto byte = [data](std::size_t i) { return static_cast<uint32_t>(static_cast<unsigned char>(data[i])); };
+
+        uint32_t n_keys;
+        std::size_t off;
+        if (size >= 1 && (byte(0) & 0xf0) == 0x80) {
+            n_keys = byte(0) & 0x0f;
+            off = 1;
+        } else if (size >= 3 && byte(0) == 0xde) {
+            n_keys = byte(1) << 8 | byte(2);
+            off = 3;
+        } else if (size >= 5 && byte(0) == 0xdf) {
+            n_keys = byte(1) << 24 | byte(2) << 16 | byte(3) << 8 | byte(4);
+            off = 5;
+        } else {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < n_keys; ++i) {
+            skip_visitor key;
+            if (!msgpack::parse(data, size, off, key)) return false;
+            std::size_t begin = off;
+            skip_visitor value;
+            if (!msgpack::parse(data, size, off, value)) return false;
+            if (key.str && isIgnored(std::string(key.str, key.str_size))) ranges.emplace_back(begin, off);
+        }
+        return true;
+    }
+
+    // whether a frame has the bytes of the previous one but for the ignored
+    // values, which must have the same lengths for the rest to line up
+    static bool sameBytes(const zmq::message_t& frame, const Previous& prev) {
+        if (!prev.masked || frame.size() != prev.frame.size()) return false;
+        auto data = static_cast<const char*>(frame.data());
+        auto prev_data = static_cast<const char*>(prev.frame.data());
+        std::size_t pos = 0;
+        for (auto& range : prev.ignored) {
+            if (std::memcmp(data + pos, prev_data + pos, range.first - pos) != 0) return false;
+            pos = range.first;
+            skip_visitor value;
+            if (!msgpack::parse(data, frame.size(), pos, value) || pos != range.second) return false;
+        }
+        return std::memcmp(data + pos, prev_data + pos, frame.size() - pos) == 0;
+    }
+
+    void dropUnchanged(kb_data& data) {
+        for (auto it = data.msgpack_data.begin(); it != data.msgpack_data.end();) {
+            if (isIgnored(it->first)) {
+                ++it;
+            } else {
+                it = data.msgpack_data.erase(it);
+                ++stats_.dropped_keys;
+            }
+        }
+    }
+
+    // compare the keys with the previous hashes, both sorted, and drop the unchanged ones
+    bool compareKeys(kb_data& data, Previous& prev) {
+        std::vector<std::pair<std::string, uint64_t>> hashes;
+        hashes.reserve(data.msgpack_data.size());
+        bool changed = false;
+        auto old = prev.hashes.cbegin();
+        for (auto it = data.msgpack_data.begin(); it != data.msgpack_data.end();) {
+            if (isIgnored(it->first)) {
+                ++it;
+                continue;
+            }
+            uint64_t h = hashObject(it->second.get());
+            hashes.emplace_back(it->first, h);
+
+            while (old != prev.hashes.cend() && old->first < it->first) {
+                changed = true; // disappeared
+                ++old;
+            }
+            if (old != prev.hashes.cend() && old->first == it->first && old->second == h) {
+                ++old;
+                it = data.msgpack_data.erase(it);
+                ++stats_.dropped_keys;
+            } else {
+                changed = true;
+                ++it;
+            }
+        }
+        if (old != prev.hashes.cend()) changed = true;
+
+        prev.hashes = std::move(hashes);
+        return changed;
+    }
+
+public:
+    /*
+     * sources: the slow-control sources to filter, the others are delivered
+     * unchanged.
+     */
+    explicit ChangeFilter(const std::vector<std::string>& sources = std::vector<std::string>(),
+                          const std::vector<std::string>& ignored_prefixes = {"metadata."})
+        : ignored_(ignored_prefixes) {
+        for (auto& src : sources) previous_[src];
+    }
+
+    /*
+     * Remove the unchanged keys of the filtered sources of a train and set
+     * their kb_data::changed flag. Return the number of filtered sources
+     * which changed.
+     */
+    std::size_t apply(std::map<std::string, kb_data>& data_pkg) {
+        std::size_t n_changed = 0;
+        for (auto& p : previous_) {
+            auto it = data_pkg.find(p.first);
+            if (it == data_pkg.end()) continue;
+            kb_data& data = it->second;
+            const zmq::message_t* frame = data.msgpack_frame();
+            if (frame == nullptr) continue;
+            Previous& prev = p.second;
+
+            ++stats_.sources;
+            bool first = prev.frame.size() == 0;
+            if (!first && sameBytes(*frame, prev)) {
+                ++stats_.identical;
+                dropUnchanged(data);
+                data.changed = false;
+            } else {
+                ++stats_.hashed;
+                data.changed = compareKeys(data, prev) || first;
+                prev.frame.copy(frame);
+                prev.masked = findIgnored(prev.frame, prev.ignored);
+            }
+
+            if (data.changed) ++n_changed;
+            else ++stats_.unchanged;
+        }
+        return n_changed;
+    }
+
+    // forget the previous trains, e.g. after reconnecting
+    void reset() {
+        for (auto& p : previous_) {
+            p.second.frame = zmq::message_t();
+            p.second.hashes.clear();
+            p.second.ignored.clear();
+            p.second.masked = false;
+        }
+    }
+
+    bool empty() const { return previous_.empty(); }
+
+    const ChangeStats& stats() const { return stats_; }
+};
+
+/*
+ * Return a 64-bit hash of bytes, continuing from h. Eight bytes are mixed
+ * at a time.
+ */
+uint64_t hashBytes(const void* data, std::size_t size, uint64_t h = 14695981039346656037ULL) {
+    auto bytes = static_cast<const unsigned char*>(data);
+    auto mix = [&h](uint64_t word) {
+        h ^= word;
+        h *= 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 32;
+    };
+
+    std::size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        mix(word);
+    }
+    uint64_t tail = 0;
+    if (i < size) memcpy(&tail, bytes + i, size - i);
+    mix(tail);
+    mix(size);
+    return h;
+}
+
+/*
+ * Visitor which looks for the train ID at the top level of a msgpack map
+ * and stops there, without unpacking anything.
+ */
+struct train_id_visitor {
+    uint64_t train_id = 0;
+    bool found = false;
+
+    unsigned int depth = 0;
+    bool in_key = false;
+    bool is_tid = false; // the current top-level key is the train ID
+
+    bool visit_nil() { return true; }
+    bool visit_boolean(bool) { return true; }
+    bool visit_positive_integer(uint64_t v) {
+        if (depth != 1 || !is_tid) return true;
+        train_id = v;
+        found = true;
+        return false;
+    }
+    bool visit_negative_integer(int64_t) { return true; }
+    bool visit_float32(float) { return true; }
+    bool visit_float64(double) { return true; }
+    bool visit_str(const char* v, uint32_t size) {
+        if (depth == 1 && in_key) {
+            std::string key(v, size);
+            is_tid = key == "metadata.timestamp.tid" || key == "header.trainId";
+        }
+        return true;
+    }
+    bool visit_bin(const char*, uint32_t) { return true; }
+    bool visit_ext(const char*, uint32_t) { return true; }
+    bool start_array(uint32_t) { ++depth; return true; }
+    bool start_array_item() { return true; }
+    bool end_array_item() { return true; }
+    bool end_array() { --depth; return true; }
+    bool start_map(uint32_t) { ++depth; return true; }
+    bool start_map_key() {
+        if (depth == 1) {
+            in_key = true;
+            is_tid = false;
+        }
+        return true;
+    }
+    bool end_map_key() {
+        if (depth == 1) in_key = false;
+        return true;
+    }
+    bool start_map_value() { return true; }
+    bool end_map_value() { return true; }
+    bool end_map() { --depth; return true; }
+    void parse_error(size_t, size_t) {}
+    void insufficient_bytes(size_t, size_t) {}
+    bool referenced() const { return false; }
+    void set_referenced(bool) {}
+};
+
+struct DuplicateStats {
+    std::size_t sources = 0; // sources with a train ID checked
+    std::size_t duplicates = 0; // sources suppressed
+    std::size_t trains = 0; // trains whose sources were all suppressed
+    std::size_t bytes = 0; // bytes of the suppressed sources
+};
+
+/*
+ * Suppress the sources of a train which were already received, e.g. when a
+ * bridge without new data or a relay resends a train, before decoding them.
+ *
+ * A source is a duplicate if its train ID and the hash of its frames match
+ * one of its last window trains. The train ID is read from the msgpack data
+ * without unpacking it. Frames larger than max_hash_bytes are hashed on
+ * their size and their first and last max_hash_bytes / 2 bytes, which
+ * keeps the cost of detector arrays low. Sources without a train ID are
+ * never suppressed.
+ */
+class DuplicateFilter {
+    struct Seen {
+        uint64_t train_id;
+        uint64_t hash;
+    };
+
+    std::size_t window_;
+    std::size_t max_hash_bytes_;
+    std::map<std::string, std::deque<Seen>> seen_; // by source, the most recent last
+    DuplicateStats stats_;
+
+    uint64_t hashFrame(const zmq::message_t& frame, uint64_t h) const {
+        auto data = static_cast<const char*>(frame.data());
+        if (frame.size() <= max_hash_bytes_) return hashBytes(data, frame.size(), h);
+
+        std::size_t half = max_hash_bytes_ / 2;
+        h = hashBytes(data, half, h);
+        h = hashBytes(data + frame.size() - half, half, h);
+        uint64_t size = frame.size();
+        return hashBytes(&size, sizeof(size), h);
+    }
+
+    // whether the frames [first, last) of a source repeat one of its last trains
+    bool isDuplicate(const std::string& source, MultipartMsg::iterator first, MultipartMsg::iterator last) {
+        auto msgpack_data = std::next(first);
+        train_id_visitor visitor;
+        msgpack::parse(static_cast<const char*>(msgpack_data->data()), msgpack_data->size(), visitor);
+        if (!visitor.found) return false;
+
+        uint64_t h = hashBytes(source.data(), source.size());
+        for (auto it = first; it != last; ++it) h = hashFrame(*it, h);
+
+        ++stats_.sources;
+        std::deque<Seen>& seen = seen_[source];
+        for (auto& s : seen) {
+            if (s.train_id == visitor.train_id && s.hash == h) return true;
+        }
+        seen.push_back(Seen{visitor.train_id, h});
+        if (seen.size() > window_) seen.pop_front();
+        return false;
+    }
+
+public:
+    /*
+     * window: number of trains remembered per source, 0 disables the filter.
+     */
+    explicit DuplicateFilter(std::size_t window = 16, std::size_t max_hash_bytes = 1 << 16)
+        : window_(window), max_hash_bytes_(max_hash_bytes) {}
+
+    /*
+     * Remove the duplicated sources from a train. Return the number of
+     * sources removed; the train is left empty if they all were.
+     *
+     * headers are the unpacked headers of the train, unpacked here if
+     * empty, and are kept in step with the frames left, so that
+     * decodeMultipartMsg does not unpack them again.
+     *
+     * Exceptions:
+     * std::runtime_error if the train does not contain (header, data) pairs
+     */
+    std::size_t apply(MultipartMsg& mpmsg, std::vector<UnpackedHeader>& headers) {
+        if (window_ == 0 || mpmsg.empty()) return 0;
+        if (headers.size() != mpmsg.size() / 2 || mpmsg.size() % 2) headers = unpackHeaders(mpmsg);
+
+        // a source starts with its msgpack data, followed by its arrays
+        struct Source {
+            std::string name;
+            MultipartMsg::iterator first;
+            MultipartMsg::iterator last;
+        };
+        std::vector<Source> sources;
+        for (std::size_t i = 0; i < headers.size(); ++i) {
+            const MsgObjectMap& header = headers[i].fields;
+            if (header.at("content").as<std::string>() == "msgpack") {
+                auto it = mpmsg.begin() + 2 * i;
+                if (!sources.empty()) sources.back().last = it;
+                sources.push_back(Source{header.at("source").as<std::string>(), it, mpmsg.end()});
+            }
+        }
+
+        std::vector<std::pair<MultipartMsg::iterator, MultipartMsg::iterator>> duplicates;
+        for (auto& src : sources) {
+            if (isDuplicate(src.name, src.first, src.last)) duplicates.emplace_back(src.first, src.last);
+        }
+        if (duplicates.empty()) return 0;
+
+        stats_.duplicates += duplicates.size();
+        if (duplicates.size() == sources.size()) ++stats_.trains;
+
+        MultipartMsg kept(mpmsg.get_allocator());
+        std::vector<UnpackedHeader> kept_headers;
+        auto dup = duplicates.begin();
+        for (auto it = mpmsg.begin(); it != mpmsg.end(); ++it) {
+            if (dup != duplicates.end() && it == dup->second) ++dup;
+            if (dup != duplicates.end() && it >= dup->first) {
+                stats_.bytes += it->size();
+                continue;
+            }
+            std::size_t i = static_cast<std::size_t>(std::distance(mpmsg.begin(), it));
+            if (i % 2 == 0) kept_headers.push_back(std::move(headers[i / 2]));
+            kept.emplace_back(std::move(*it));
+        }
+        mpmsg.swap(kept);
+        headers.swap(kept_headers);
+        return duplicates.size();
+    }
+
+    std::size_t apply(MultipartMsg& mpmsg) {
+        std::vector<UnpackedHeader> headers;
+        return apply(mpmsg, headers);
+    }
+
+    // forget the trains received, e.g. after reconnecting
+    void reset() { seen_.clear(); }
+
+    bool enabled() const { return window_ > 0; }
+
+    const DuplicateStats& stats() const { return stats_; }
+};
+
+/*
+ * Return a request for the next train, or the next count trains: an
+ * extended request if the server understands it, otherwise a plain "next".
+ */
+zmq::message_t makeRequest(const Selection& selection, bool extended, std::size_t count = 1) {
+    if (extended && (!selection.empty() || count > 1)) {
+        auto buffer = packRequest(selection, count);
+        return zmq::message_t(buffer.data(), buffer.size());
+    }
+
+    zmq::message_t request(4);
+    memcpy(request.data(), "next", request.size());
+    return request;
+}
+
+/*
+ * Return the extensions advertised in the first header of a reply.
+ */
+std::vector<std::string> serverExtensions(const zmq::message_t& header) {
+    msgpack::object_handle oh;
+    msgpack::unpack(oh, static_cast<const char*>(header.data()), header.size());
+    auto header_unpacked = oh.get().as<MsgObjectMap>();
+
+    auto it = header_unpacked.find("kb_extensions");
+    if (it == header_unpacked.end()) return std::vector<std::string>();
+    return it->second.as<std::vector<std::string>>();
+}
+
+/*
+ * Split the reply to a request for several trains.
+ *
+ * A batch reply starts with a msgpack map {"content": "batch", "frames":
+ * [n_0, n_1, ...]} followed by the frames of every train. Any other reply
+ * is a single train. The frames are moved out of the reply.
+ *
+ * Exceptions:
+ * std::runtime_error if the batch header does not match the frames
+ */
+std::deque<MultipartMsg> splitBatch(MultipartMsg& reply) {
+    std::deque<MultipartMsg> trains;
+    if (reply.empty()) return trains;
+
+    msgpack::object_handle oh;
+    msgpack::unpack(oh, static_cast<const char*>(reply.front().data()), reply.front().size());
+    if (oh.get().type == msgpack::type::object_type::MAP) {
+        auto header = oh.get().as<MsgObjectMap>();
+        auto it = header.find("content");
+        if (it != header.end() && it->second.as<std::string>() == "batch") {
+            auto frames = header.at("frames").as<std::vector<std::size_t>>();
+            std::size_t total = 0;
+            for (auto n : frames) total += n;
+            if (total != reply.size() - 1)
+                throw std::runtime_error("The batch header does not match the number of frames!");
+
+            auto frame = std::next(reply.begin());
+            for (auto n : frames) {
+                trains.emplace_back();
+                for (std::size_t i = 0; i < n; ++i, ++frame) trains.back().push_back(std::move(*frame));
+            }
+            return trains;
+        }
+    }
+
+    trains.push_back(std::move(reply));
+    return trains;
+}
+
+/*
+ * Pin the calling thread to a CPU core.
+ *
+ * Exceptions:
+ * std::runtime_error if it fails or is not supported
+ */
+void pinThread(int cpu) {
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+        throw std::runtime_error("Failed to pin the thread to CPU " + std::to_string(cpu));
+#else
+    throw std::runtime_error("Pinning threads is not supported on this platform");
+#endif
+}
+
+// hint to the CPU that the thread is spinning
+void cpuRelax() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_ia32_pause();
+#endif
 }
 
 /*
@@ -377,24 +1523,128 @@ class Client {
     zmq::context_t ctx_;
     zmq::socket_t socket_;
 
+    Selection selection_;
+    bool probed_ = false; // whether the server capabilities are known
+    bool extended_ = false; // whether the server understands extended requests
+    bool batched_ = false; // whether the server replies with several trains
+    MemoryResource* resource_ = nullptr; // nullptr: the default resource of the thread
+
+    bool spin_ = false; // whether to spin while waiting for a reply
+    int cpu_ = -1; // core of the receiving thread, -1 if not pinned
+    bool pinned_ = false;
+    int busy_poll_us_ = 0;
+
+    std::vector<std::string> connected_; // endpoints of the socket
+    std::vector<std::string> endpoints_; // primary and standby endpoints
+    std::size_t active_ = 0; // index in endpoints_
+    int timeout_ms_ = -1; // -1: wait forever
+    int heartbeat_ms_ = 0;
+    std::size_t failovers_ = 0;
+    bool pending_ = false; // whether a request is waiting for its reply (see tryNextMultipartMsg)
+    std::chrono::steady_clock::time_point sent_; // when the pending request was sent
+
+    ChangeFilter changes_; // no source: every key is delivered
+    DuplicateFilter duplicates_{0}; // disabled
+
+    void configureSocket() {
+        if (busy_poll_us_ > 0) {
+#ifdef ZMQ_BUSY_POLL
+            socket_.setsockopt(ZMQ_BUSY_POLL, &busy_poll_us_, sizeof(busy_poll_us_));
+#endif
+        }
+        if (timeout_ms_ < 0) return;
+
+        // the request in flight is abandoned when the socket is replaced
+        int linger = 0;
+        socket_.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+        socket_.setsockopt(ZMQ_RCVTIMEO, &timeout_ms_, sizeof(timeout_ms_));
+#ifdef ZMQ_HEARTBEAT_IVL
+        if (heartbeat_ms_ > 0) {
+            socket_.setsockopt(ZMQ_HEARTBEAT_IVL, &heartbeat_ms_, sizeof(heartbeat_ms_));
+            socket_.setsockopt(ZMQ_HEARTBEAT_TIMEOUT, &timeout_ms_, sizeof(timeout_ms_));
+            socket_.setsockopt(ZMQ_HEARTBEAT_TTL, &timeout_ms_, sizeof(timeout_ms_));
+        }
+#endif
+    }
+
+    /*
+     * Replace the socket, whose REQ state machine waits for a reply which
+     * did not come, by a new one connected to the next endpoint.
+     */
+    void failover() {
+        if (!endpoints_.empty()) {
+            auto it = std::find(connected_.begin(), connected_.end(), endpoints_[active_]);
+            if (it != connected_.end()) connected_.erase(it);
+            active_ = (active_ + 1) % endpoints_.size();
+            connected_.push_back(endpoints_[active_]);
+            std::cout << "Failing over to server: " << endpoints_[active_] << std::endl;
+        }
+
+        socket_ = zmq::socket_t(ctx_, ZMQ_REQ);
+        configureSocket();
+        for (auto& endpoint : connected_) socket_.connect(endpoint.c_str());
+        pending_ = false;
+        // the capabilities of the next server are unknown
+        probed_ = false;
+        extended_ = false;
+        batched_ = false;
+        ++failovers_;
+    }
+
     /*
-     * Send a "next" request to server.
+     * Send a request for count trains and return the reply, failing over
+     * until a server replies within the timeout.
+     *
+     * An extended request carrying the selection is only sent to servers
+     * which advertise it. Otherwise, it is a plain "next". If a request
+     * is pending, its reply is returned instead.
      */
-    void sendRequest() {
-        zmq::message_t request(4);
-        memcpy(request.data(), "next", request.size());
-        socket_.send(request);
+    MultipartMsg requestReply(std::size_t count = 1) {
+        while (true) {
+            if (!pending_) socket_.send(makeRequest(selection_, extended_, count));
+            pending_ = false;
+            MultipartMsg mpmsg = receiveMultipartMsg();
+            if (!mpmsg.empty()) return mpmsg;
+            failover();
+        }
     }
 
     /*
-     * Receive a multipart message from the server.
+     * Look for the extensions advertised in the first header of a reply.
+     */
+    void probeServer(const zmq::message_t& header) {
+        probed_ = true;
+        auto extensions = serverExtensions(header);
+        extended_ = std::find(extensions.begin(), extensions.end(), "selection") != extensions.end();
+        batched_ = std::find(extensions.begin(), extensions.end(), "batch") != extensions.end();
+    }
+
+    void pinOnce() {
+        if (cpu_ >= 0 && !pinned_) {
+            pinThread(cpu_);
+            pinned_ = true;
+        }
+    }
+
+    /*
+     * Receive a multipart message from the server. It is empty if nothing
+     * arrived within the timeout.
      */
     MultipartMsg receiveMultipartMsg() {
         int64_t more;  // multipart checker
         MultipartMsg mpmsg;
         while (true) {
             zmq::message_t msg;
-            socket_.recv(&msg);
+            // the frames of a message arrive together, so only the first one is waited for
+            if (spin_ && mpmsg.empty()) {
+                auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms_);
+                while (!socket_.recv(&msg, ZMQ_DONTWAIT)) {
+                    if (timeout_ms_ >= 0 && std::chrono::steady_clock::now() > deadline) return mpmsg;
+                    cpuRelax();
+                }
+            } else if (!socket_.recv(&msg)) {
+                return mpmsg;
+            }
             mpmsg.emplace_back(std::move(msg));
             std::size_t more_size = sizeof(int64_t);
             socket_.getsockopt(ZMQ_RCVMORE, &more, &more_size);
@@ -409,8 +1659,140 @@ public:
     void connect(const std::string& endpoint) {
         std::cout << "Connecting to server: " << endpoint << std::endl;
         socket_.connect(endpoint.c_str());
+        connected_.push_back(endpoint);
+        probed_ = false;
+        extended_ = false;
+        batched_ = false;
+        changes_.reset();
+        duplicates_.reset();
+    }
+
+    /*
+     * Connect to a primary server and fail over to the standby servers, in
+     * turn, when the server does not reply within the timeout, e.g. when a
+     * bridge is restarted. The request is then sent again to the next
+     * server, so that a train is returned at most timeout_ms after a server
+     * stalled, as long as the next one is up.
+     *
+     * Sets a timeout of 1 s if none was set (see setFailoverTimeout).
+     */
+    void connect(const std::string& primary, const std::vector<std::string>& standby) {
+        if (timeout_ms_ < 0) setFailoverTimeout(1000);
+        endpoints_.clear();
+        endpoints_.push_back(primary);
+        endpoints_.insert(endpoints_.end(), standby.begin(), standby.end());
+        active_ = 0;
+        connect(primary);
+    }
+
+    /*
+     * Give up waiting for a reply after timeout_ms, and send the request
+     * again on a new socket, to the next standby server if any (see
+     * connect(primary, standby)). Without standby servers, the same servers
+     * are reconnected. Must be called before connect().
+     *
+     * heartbeat_ms: if > 0, ZMTP heartbeats are exchanged at this interval
+     * so that a dead connection is dropped within timeout_ms even between
+     * requests, if libzmq supports them (4.2 or later).
+     *
+     * Exceptions:
+     * std::invalid_argument if timeout_ms is not positive
+     */
+    void setFailoverTimeout(int timeout_ms, int heartbeat_ms = 0) {
+        if (timeout_ms <= 0) throw std::invalid_argument("The timeout must be positive!");
+        timeout_ms_ = timeout_ms;
+        heartbeat_ms_ = heartbeat_ms;
+        configureSocket();
+    }
+
+    // number of times the socket was replaced after a timeout
+    std::size_t failovers() const { return failovers_; }
+
+    // the primary or standby server in use, empty without standby servers
+    std::string endpoint() const { return endpoints_.empty() ? std::string() : endpoints_[active_]; }
+
+    /*
+     * Only receive the selected sources and paths.
+     *
+     * Servers which understand the extended request (e.g. karabo_bridge::Server)
+     * only serialize and send the selected data, including the pulse and ROI
+     * selection. With a plain "next" server, the whole train is transferred
+     * and the unselected sources and paths are dropped by the client.
+     */
+    void setSelection(const Selection& selection) { selection_ = selection; }
+
+    const Selection& selection() const { return selection_; }
+
+    /*
+     * Allocate the containers of the received trains from the given
+     * resource, e.g. a MonotonicBufferResource which is released after
+     * every train: the deque of frames of a MultipartMsg and the nodes of
+     * the path maps of the decoded data. The resource must outlive the
+     * trains.
+     *
+     * The payloads of the frames are allocated by libzmq, and the keys and
+     * the shapes by std::allocator.
+     *
+     * A train handed to another thread, e.g. by SelectiveRecorder::push or
+     * through the channels between the stages of a Pipeline, is freed in
+     * that thread. This is a data race with a resource which is not
+     * thread-safe, such as PoolResource.
+     */
+    void setMemoryResource(MemoryResource* resource) { resource_ = resource; }
+
+    MemoryResource* memoryResource() const { return resource_ ? resource_ : getDefaultResource(); }
+
+    /*
+     * Wait for the replies by spinning on the socket instead of sleeping in
+     * the kernel, which saves the wake-up latency at the cost of a busy core,
+     * e.g. for feedback loops.
+     *
+     * cpu: if >= 0, the thread which calls next() is pinned to this core at
+     * the next call, preferably a core isolated from the scheduler.
+     * busy_poll_us: if > 0, the kernel busy polls the network device for up
+     * to busy_poll_us microseconds (SO_BUSY_POLL) on the TCP connections of
+     * the following calls of connect(). It needs a libzmq which supports
+     * ZMQ_BUSY_POLL and, for a value above net.core.busy_read, CAP_NET_ADMIN.
+     *
+     * Exceptions:
+     * std::runtime_error if busy polling is not supported by libzmq
+     */
+    void setSpinning(bool spin, int cpu = -1, int busy_poll_us = 0) {
+        if (busy_poll_us > 0) {
+#ifdef ZMQ_BUSY_POLL
+            socket_.setsockopt(ZMQ_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us));
+#else
+            throw std::runtime_error("ZMQ_BUSY_POLL is not supported by this libzmq");
+#endif
+        }
+        busy_poll_us_ = busy_poll_us;
+        spin_ = spin;
+        cpu_ = cpu;
+        pinned_ = false;
     }
 
+    bool spinning() const { return spin_; }
+
+    /*
+     * Only deliver the keys of the msgpack data of the given slow-control
+     * sources which changed since the previous train (see ChangeFilter).
+     * kb_data::changed is false if nothing changed, so that the source can
+     * be skipped. An empty list delivers every key again.
+     */
+    void setChangeOnly(const std::vector<std::string>& sources) { changes_ = ChangeFilter(sources); }
+
+    const ChangeStats& changeStats() const { return changes_.stats(); }
+
+    /*
+     * Suppress the sources which repeat one of their last window trains
+     * before decoding them (see DuplicateFilter), e.g. to keep accumulators
+     * right when a relay replays trains. next() and nextBatch() skip the
+     * trains whose sources are all duplicates. 0 disables it.
+     */
+    void setDuplicateWindow(std::size_t window) { duplicates_ = DuplicateFilter(window); }
+
+    const DuplicateStats& duplicateStats() const { return duplicates_.stats(); }
+
     /*
      * Request and return the next data from the server.
      *
@@ -418,71 +1800,111 @@ public:
      * std::runtime_error if unknown "content" is found
      */
     std::map<std::string, kb_data> next() {
-        std::map<std::string, kb_data> data_pkg;
-
-        sendRequest();
-        MultipartMsg mpmsg = receiveMultipartMsg();
-        if (mpmsg.empty()) return data_pkg;
-        if (mpmsg.size() % 2)
-            throw std::runtime_error("The multipart message is expected to "
-                                     "contain (header, data) pairs!");
-
-        kb_data kbdt;
-        std::string source;
-        bool is_initialized = false;
-        auto it = mpmsg.begin();
-        while(it != mpmsg.end()) {
-            // the header must contain "source" and "content"
-            msgpack::object_handle oh_header;
-            msgpack::unpack(oh_header, static_cast<const char*>(it->data()), it->size());
-            auto header_unpacked = oh_header.get().as<MsgObjectMap>();
-
-            auto content = header_unpacked.at("content").as<std::string>();
-
-            // the next message is the content (data)
-            if (content == "msgpack") {
-                if (!is_initialized)
-                    is_initialized = true;
-                else
-                    data_pkg.insert(std::make_pair(source, std::move(kbdt)));
-
-                kbdt.append_msg(std::move(*it));
-                std::advance(it, 1);
-
-                msgpack::object_handle oh_data;
-                msgpack::unpack(oh_data, static_cast<const char*>(it->data()), it->size());
-                auto data_unpacked = oh_data.get().as<MsgObjectMap>();
-
-                for (auto &dt : data_unpacked)
-                    kbdt.msgpack_data.insert(std::make_pair(dt.first, dt.second.as<Object>()));
-
-                kbdt.append_handle(std::move(oh_data));
-
-            } else if ((content == "array" || content == "ImageData")) {
-                kbdt.append_msg(std::move(*it));
-                std::advance(it, 1);
-
-                auto shape = header_unpacked.at("shape").as<std::vector<unsigned int>>();
-                auto dtype = header_unpacked.at("dtype").as<std::string>();
-                // convert the python type to the corresponding c++ type
-                if (dtype.find("int") != std::string::npos) dtype.append("_t");
-
-                kbdt.array.insert(std::make_pair(
-                    header_unpacked.at("path").as<std::string>(),
-                    Array(it->data(), shape, dtype)));
-            } else {
-                throw std::runtime_error("Unknown data content: " + content);
-            }
+        ScopedResource scope(memoryResource());
+        while (true) {
+            MultipartMsg mpmsg = nextMultipartMsg();
+            std::vector<UnpackedHeader> headers;
+            if (duplicates_.apply(mpmsg, headers) > 0 && mpmsg.empty()) continue;
+            auto data_pkg = decodeMultipartMsg(mpmsg, headers, selection_);
+            if (!changes_.empty()) changes_.apply(data_pkg);
+            return data_pkg;
+        }
+    }
 
-            source = header_unpacked.at("source").as<std::string>();
+    /*
+     * Request and return the next multipart message without decoding it,
+     * e.g. to relay it.
+     */
+    MultipartMsg nextMultipartMsg() {
+        pinOnce();
+        ScopedResource scope(memoryResource());
+        MultipartMsg mpmsg = requestReply();
+        if (!probed_) probeServer(mpmsg.front());
+        return mpmsg;
+    }
 
-            kbdt.append_msg(std::move(*it));
-            std::advance(it, 1);
+    /*
+     * Like nextMultipartMsg(), but give up after timeout_ms, e.g. to check
+     * a stop flag in between. Return false if no train arrived in time.
+     *
+     * The request is left pending and the next call, or the next request
+     * of any kind, receives its reply. The failover timeout still counts
+     * from the time it was sent (see setFailoverTimeout).
+     */
+    bool tryNextMultipartMsg(MultipartMsg& mpmsg, int timeout_ms) {
+        pinOnce();
+        ScopedResource scope(memoryResource());
+        if (!pending_) {
+            socket_.send(makeRequest(selection_, extended_, 1));
+            pending_ = true;
+            sent_ = std::chrono::steady_clock::now();
+        }
+
+        zmq::pollitem_t item = {static_cast<void*>(socket_), 0, ZMQ_POLLIN, 0};
+        zmq::poll(&item, 1, timeout_ms);
+        if (!(item.revents & ZMQ_POLLIN)) {
+            if (timeout_ms_ >= 0 &&
+                    std::chrono::steady_clock::now() - sent_ > std::chrono::milliseconds(timeout_ms_))
+                failover();
+            return false;
+        }
+
+        pending_ = false;
+        MultipartMsg reply = receiveMultipartMsg();
+        if (reply.empty()) {
+            failover();
+            return false;
         }
+        if (!probed_) probeServer(reply.front());
+        mpmsg = std::move(reply);
+        return true;
+    }
 
-        data_pkg.insert(std::make_pair(source, std::move(kbdt)));
+    /*
+     * Request and return the next n trains without decoding them.
+     *
+     * A server with the "batch" extension sends them in one reply, which
+     * saves the round trips, e.g. to replay a run over a slow link. Other
+     * servers are sent one request per train. Fewer trains are returned if
+     * the server runs out of them, i.e. replies with an empty batch.
+     *
+     * Exceptions:
+     * std::runtime_error if a batch reply is malformed
+     */
+    std::deque<MultipartMsg> nextMultipartMsgs(std::size_t n) {
+        pinOnce();
+        ScopedResource scope(memoryResource());
+        std::deque<MultipartMsg> trains;
+        while (trains.size() < n) {
+            // a pending request is for one train, but may still get a batch
+            std::size_t count = batched_ && !pending_ ? n - trains.size() : 1;
+            MultipartMsg reply = requestReply(count);
+            auto batch = splitBatch(reply);
+            if (batch.empty()) break;
+            if (!probed_) probeServer(batch.front().front());
+            for (auto& train : batch) trains.push_back(std::move(train));
+        }
+        return trains;
+    }
 
-        return data_pkg;
+    /*
+     * Request and return the next n trains (see nextMultipartMsgs), less
+     * the trains whose sources are all duplicates (see setDuplicateWindow).
+     *
+     * Exceptions:
+     * std::runtime_error if unknown "content" is found or a batch reply is
+     * malformed
+     */
+    std::vector<std::map<std::string, kb_data>> nextBatch(std::size_t n) {
+        ScopedResource scope(memoryResource());
+        std::vector<std::map<std::string, kb_data>> data_pkgs;
+        for (auto& train : nextMultipartMsgs(n)) {
+            std::vector<UnpackedHeader> headers;
+            if (duplicates_.apply(train, headers) > 0 && train.empty()) continue;
+            data_pkgs.push_back(decodeMultipartMsg(train, headers, selection_));
+            if (!changes_.empty()) changes_.apply(data_pkgs.back());
+        }
+        return data_pkgs;
     }
 
     /*
@@ -491,8 +1913,7 @@ public:
      * Note:: this member function consumes data!!!
      */
     std::string showMsg() {
-        sendRequest();
-        auto mpmsg = receiveMultipartMsg();
+        auto mpmsg = nextMultipartMsg();
         return parseMultipartMsg(mpmsg);
     }
 
@@ -0,0 +1,532 @@
+/*
+    Karabo bridge thread-safe client.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_CPP_KB_CONCURRENT_CLIENT_HPP
+#define KARABO_BRIDGE_CPP_KB_CONCURRENT_CLIENT_HPP
+
+#include "kb_client.hpp"
+#include "kb_queue.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+
+namespace karabo_bridge {
+
+struct PrefetchStats {
+    std::size_t prefetch; // requests allowed in flight
+    std::size_t min_prefetch;
+    std::size_t max_prefetch;
+    std::size_t max_bytes; // memory cap, 0 if none
+    double network_time; // average time from a request to its reply in seconds
+    double consumer_time; // average time between two trains taken by the consumers in seconds
+    std::size_t train_bytes; // average size of a train
+    std::size_t waits; // calls of next() which waited for a train
+    std::size_t increases; // times the prefetch depth was increased
+    std::size_t decreases; // times the prefetch depth was decreased
+    std::size_t capped; // times the prefetch depth was limited by the memory cap
+};
+
+/*
+ * Return the prefetch depth to move towards from stats.prefetch: one more
+ * request if the consumers waited, otherwise enough requests to cover the
+ * network time at the pace of the consumers, plus one. The target stays
+ * within the bounds and, with a memory cap, within the memory left by the
+ * `held` trains not taken yet, but never below min_prefetch. capped is set
+ * if the memory cap lowered the target.
+ */
+std::size_t prefetchTarget(const PrefetchStats& stats, bool consumers_waited, std::size_t held, bool& capped) {
+    std::size_t target = stats.prefetch;
+    if (consumers_waited) {
+        target = stats.prefetch + 1;
+    } else if (stats.consumer_time > 0) {
+        target = static_cast<std::size_t>(std::ceil(stats.network_time / stats.consumer_time)) + 1;
+    }
+    target = std::min(std::max(target, stats.min_prefetch), stats.max_prefetch);
+
+    capped = false;
+    if (stats.max_bytes > 0 && stats.train_bytes > 0) {
+        std::size_t cap = stats.max_bytes / stats.train_bytes;
+        cap = std::max(cap > held ? cap - held : 0, stats.min_prefetch);
+        if (target > cap) {
+            target = cap;
+            capped = true;
+        }
+    }
+    return target;
+}
+
+/*
+ * A client which can be shared by several threads.
+ *
+ * A receiver thread owns a DEALER socket, keeps up to `prefetch` requests
+ * in flight and queues the replies. Every call of next() from any thread
+ * returns a different train, and the trains are decoded by the calling
+ * threads.
+ *
+ * If ordered, the trains are handed out in train ID order: the receiver
+ * holds back up to `prefetch` trains to reorder them, and drops the trains
+ * which arrive after a newer one was handed out. The trains must carry a
+ * train ID in this case. The trains held back are queued when the client
+ * is closed.
+ *
+ * The number of requests in flight can adapt to the load (see
+ * setPrefetchBounds): it grows while the consumers wait for trains and
+ * shrinks to what covers the network time at the pace of the consumers,
+ * so that slow consumers get fresh trains.
+ */
+class ConcurrentClient {
+    zmq::context_t ctx_;
+    std::size_t prefetch_;
+    bool ordered_;
+
+    std::vector<std::string> endpoints_; // not connected yet
+    std::vector<std::string> failover_endpoints_; // primary and standby, not connected yet
+    std::shared_ptr<const Selection> selection_;
+    std::size_t min_prefetch_;
+    std::size_t max_prefetch_;
+    std::size_t max_bytes_;
+    int timeout_ms_ = -1; // -1: wait forever
+    int heartbeat_ms_ = 0;
+    std::mutex mutex_; // endpoints, selection_, the prefetch bounds and the timeout
+
+    PrefetchStats stats_;
+    std::chrono::steady_clock::time_point last_pop_;
+    bool popped_ = false;
+    bool consumers_waited_ = false; // since the last decision
+    mutable std::mutex stats_mutex_;
+
+    BoundedQueue<MultipartMsg> trains_;
+    std::map<uint64_t, MultipartMsg> reorder_;
+    uint64_t last_ = 0; // last train ID handed out in order
+    bool blocked_ = false; // whether the receiver waited for the consumers
+
+    std::thread receiver_;
+    std::atomic<bool> stop_;
+    std::atomic<std::size_t> received_;
+    std::atomic<std::size_t> late_;
+    std::atomic<std::size_t> dropped_;
+    std::atomic<std::size_t> failovers_;
+    WorkerError error_;
+
+    const int poll_timeout_ = 100; // ms
+
+    // queue a train, waiting for the consumers unless the client is closed
+    void enqueue(MultipartMsg&& train) {
+        if (trains_.try_push(std::move(train))) return;
+        blocked_ = true;
+        while (!stop_) {
+            if (trains_.push_for(std::move(train), std::chrono::milliseconds(poll_timeout_))) return;
+        }
+        ++dropped_;
+    }
+
+    void deliver(MultipartMsg&& train) {
+        if (!ordered_) {
+            enqueue(std::move(train));
+            return;
+        }
+
+        uint64_t tid = trainId(train);
+        if (tid <= last_) {
+            ++late_;
+            return;
+        }
+        reorder_[tid] = std::move(train);
+        while (reorder_.size() > prefetch_) flush();
+    }
+
+    // hand out the oldest train held back
+    void flush() {
+        auto it = reorder_.begin();
+        last_ = it->first;
+        MultipartMsg train = std::move(it->second);
+        reorder_.erase(it);
+        enqueue(std::move(train));
+    }
+
+    static double seconds(std::chrono::steady_clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::duration<double>>(d).count();
+    }
+
+    // exponential moving average
+    static double average(double avg, double sample) {
+        return avg > 0 ? avg + 0.2 * (sample - avg) : sample;
+    }
+
+    // called by the consumers
+    void recordPop(bool waited) {
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        if (waited) {
+            ++stats_.waits;
+            consumers_waited_ = true;
+        } else if (popped_) {
+            stats_.consumer_time = average(stats_.consumer_time, seconds(now - last_pop_));
+        }
+        last_pop_ = now;
+        popped_ = true;
+    }
+
+    /*
+     * Move the prefetch depth one step towards the target (see
+     * prefetchTarget). network_time is negative if it could not be measured.
+     */
+    void adapt(double network_time, std::size_t train_bytes,
+               std::size_t min_prefetch, std::size_t max_prefetch, std::size_t max_bytes) {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        if (network_time >= 0) stats_.network_time = average(stats_.network_time, network_time);
+        stats_.train_bytes = static_cast<std::size_t>(average(stats_.train_bytes, train_bytes));
+        stats_.min_prefetch = min_prefetch;
+        stats_.max_prefetch = max_prefetch;
+        stats_.max_bytes = max_bytes;
+
+        stats_.prefetch = prefetch_;
+        bool capped = false;
+        std::size_t target = prefetchTarget(stats_, consumers_waited_, trains_.size() + reorder_.size(), capped);
+        consumers_waited_ = false;
+        if (capped) ++stats_.capped;
+
+        if (target > prefetch_) {
+            ++prefetch_;
+            ++stats_.increases;
+        } else if (target < prefetch_) {
+            --prefetch_;
+            ++stats_.decreases;
+        }
+        stats_.prefetch = prefetch_;
+    }
+
+    static MultipartMsg receive(zmq::socket_t& socket) {
+        int64_t more;
+        MultipartMsg mpmsg;
+        while (true) {
+            zmq::message_t msg;
+            socket.recv(&msg);
+            mpmsg.emplace_back(std::move(msg));
+            std::size_t more_size = sizeof(int64_t);
+            socket.getsockopt(ZMQ_RCVMORE, &more, &more_size);
+            if (more == 0) break;
+        }
+        // empty delimiter of the REP socket
+        if (!mpmsg.empty() && mpmsg.front().size() == 0) mpmsg.erase(mpmsg.begin());
+        return mpmsg;
+    }
+
+    static zmq::socket_t makeSocket(zmq::context_t& ctx, int timeout_ms, int heartbeat_ms) {
+        zmq::socket_t socket(ctx, ZMQ_DEALER);
+        int linger = 0;
+        socket.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+#ifdef ZMQ_HEARTBEAT_IVL
+        if (timeout_ms > 0 && heartbeat_ms > 0) {
+            socket.setsockopt(ZMQ_HEARTBEAT_IVL, &heartbeat_ms, sizeof(heartbeat_ms));
+            socket.setsockopt(ZMQ_HEARTBEAT_TIMEOUT, &timeout_ms, sizeof(timeout_ms));
+            socket.setsockopt(ZMQ_HEARTBEAT_TTL, &timeout_ms, sizeof(timeout_ms));
+        }
+#else
+        (void)timeout_ms;
+        (void)heartbeat_ms;
+#endif
+        return socket;
+    }
+
+    void receiveLoop() {
+        try {
+            // created again before the first connection, with the heartbeats
+            zmq::socket_t socket = makeSocket(ctx_, -1, 0);
+
+            std::vector<std::string> connected;
+            std::vector<std::string> failover_endpoints;
+            std::size_t active = 0; // index in failover_endpoints
+            bool probed = false;
+            bool extended = false;
+            // time the requests in flight were sent, and whether their reply
+            // can still be timed
+            std::deque<std::pair<std::chrono::steady_clock::time_point, bool>> sent;
+            auto last_reply = std::chrono::steady_clock::now();
+            while (!stop_) {
+                std::shared_ptr<const Selection> selection;
+                std::size_t min_prefetch, max_prefetch, max_bytes;
+                int timeout_ms, heartbeat_ms;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    timeout_ms = timeout_ms_;
+                    heartbeat_ms = heartbeat_ms_;
+                    if (!failover_endpoints_.empty()) {
+                        failover_endpoints = std::move(failover_endpoints_);
+                        failover_endpoints_.clear();
+                        active = 0;
+                        endpoints_.push_back(failover_endpoints[active]);
+                    }
+                    if (!endpoints_.empty()) {
+                        if (connected.empty()) socket = makeSocket(ctx_, timeout_ms, heartbeat_ms);
+                        for (auto& endpoint : endpoints_) {
+                            socket.connect(endpoint.c_str());
+                            connected.push_back(endpoint);
+                        }
+                        endpoints_.clear();
+                    }
+                    selection = selection_;
+                    min_prefetch = min_prefetch_;
+                    max_prefetch = max_prefetch_;
+                    max_bytes = max_bytes_;
+                }
+                if (connected.empty()) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(poll_timeout_));
+                    continue;
+                }
+
+                while (sent.size() < prefetch_) {
+                    zmq::message_t delimiter;
+                    socket.send(delimiter, ZMQ_SNDMORE);
+                    socket.send(makeRequest(*selection, extended));
+                    sent.emplace_back(std::chrono::steady_clock::now(), true);
+                }
+
+                zmq::pollitem_t item = {static_cast<void*>(socket), 0, ZMQ_POLLIN, 0};
+                zmq::poll(&item, 1, poll_timeout_);
+                if (!(item.revents & ZMQ_POLLIN)) {
+                    auto now = std::chrono::steady_clock::now();
+                    if (timeout_ms < 0 || sent.empty() ||
+                        now - std::max(sent.front().first, last_reply) < std::chrono::milliseconds(timeout_ms))
+                        continue;
+
+                    // the servers stalled: abandon the requests in flight and
+                    // send them again to the next standby server, if any, on
+                    // a new socket, so that no late reply is taken for a new
+                    // request. The trains queued or held back for reordering
+                    // are kept.
+                    if (!failover_endpoints.empty()) {
+                        auto it = std::find(connected.begin(), connected.end(), failover_endpoints[active]);
+                        if (it != connected.end()) connected.erase(it);
+                        active = (active + 1) % failover_endpoints.size();
+                        connected.push_back(failover_endpoints[active]);
+                    }
+                    socket = makeSocket(ctx_, timeout_ms, heartbeat_ms);
+                    for (auto& endpoint : connected) socket.connect(endpoint.c_str());
+                    sent.clear();
+                    probed = false;
+                    extended = false;
+                    last_reply = now;
+                    ++failovers_;
+                    continue;
+                }
+
+                MultipartMsg train = receive(socket);
+                // the replies of several servers may not come in the order
+                // of the requests, the oldest one is a fair estimate
+                if (sent.empty()) continue;
+                double network_time = -1;
+                if (sent.front().second) network_time = seconds(std::chrono::steady_clock::now() - sent.front().first);
+                sent.pop_front();
+                if (train.empty()) continue;
+
+                std::size_t train_bytes = 0;
+                for (auto& msg : train) train_bytes += msg.size();
+                adapt(network_time, train_bytes, min_prefetch, max_prefetch, max_bytes);
+
+                if (!probed) {
+                    auto extensions = serverExtensions(train.front());
+                    extended = std::find(extensions.begin(), extensions.end(), "selection") != extensions.end();
+                    probed = true;
+                }
+                ++received_;
+                deliver(std::move(train));
+                last_reply = std::chrono::steady_clock::now();
+                if (blocked_) {
+                    // the replies waited for the receiver rather than the network
+                    for (auto& request : sent) request.second = false;
+                    blocked_ = false;
+                }
+            }
+
+            while (!reorder_.empty()) flush();
+        } catch (...) {
+            error_.capture();
+        }
+        trains_.close();
+    }
+
+public:
+    /*
+     * prefetch: maximum number of requests in flight
+     * queue_capacity: maximum number of trains waiting for a consumer
+     * ordered: whether the trains are handed out in train ID order
+     */
+    explicit ConcurrentClient(std::size_t prefetch = 2, std::size_t queue_capacity = 4,
+                              bool ordered = false):
+        ctx_(1),
+        prefetch_(std::max<std::size_t>(prefetch, 1)),
+        ordered_(ordered),
+        selection_(std::make_shared<Selection>()),
+        min_prefetch_(prefetch_),
+        max_prefetch_(prefetch_),
+        max_bytes_(0),
+        stats_(),
+        trains_(queue_capacity),
+        stop_(false),
+        received_(0),
+        late_(0),
+        dropped_(0),
+        failovers_(0) {
+        stats_.prefetch = stats_.min_prefetch = stats_.max_prefetch = prefetch_;
+        receiver_ = std::thread(&ConcurrentClient::receiveLoop, this);
+    }
+
+    ConcurrentClient(const ConcurrentClient&) = delete;
+    ConcurrentClient& operator=(const ConcurrentClient&) = delete;
+
+    ~ConcurrentClient() { close(); }
+
+    /*
+     * Connect to a server. Requests are spread over all the servers.
+     */
+    void connect(const std::string& endpoint) {
+        std::cout << "Connecting to server: " << endpoint << std::endl;
+        std::lock_guard<std::mutex> lock(mutex_);
+        endpoints_.push_back(endpoint);
+    }
+
+    /*
+     * Connect to a primary server and fail over to the standby servers, in
+     * turn, when no reply comes within the timeout (see
+     * setFailoverTimeout, 1 s if none was set). The requests in flight are
+     * then sent again to the next server.
+     */
+    void connect(const std::string& primary, const std::vector<std::string>& standby) {
+        std::cout << "Connecting to server: " << primary << std::endl;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (timeout_ms_ < 0) timeout_ms_ = 1000;
+        failover_endpoints_.clear();
+        failover_endpoints_.push_back(primary);
+        failover_endpoints_.insert(failover_endpoints_.end(), standby.begin(), standby.end());
+    }
+
+    /*
+     * Abandon the requests in flight when no reply came within timeout_ms,
+     * and send them again on a new socket, to the next standby server if
+     * any. Must be called before connect().
+     *
+     * heartbeat_ms: see Client::setFailoverTimeout.
+     *
+     * Exceptions:
+     * std::invalid_argument if timeout_ms is not positive
+     */
+    void setFailoverTimeout(int timeout_ms, int heartbeat_ms = 0) {
+        if (timeout_ms <= 0) throw std::invalid_argument("The timeout must be positive!");
+        std::lock_guard<std::mutex> lock(mutex_);
+        timeout_ms_ = timeout_ms;
+        heartbeat_ms_ = heartbeat_ms;
+    }
+
+    /*
+     * Only receive the selected sources and paths (see Client::setSelection).
+     * The requests already in flight are not affected.
+     */
+    void setSelection(const Selection& selection) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        selection_ = std::make_shared<Selection>(selection);
+    }
+
+    /*
+     * Let the number of requests in flight adapt between min_prefetch and
+     * max_prefetch. If max_bytes > 0, the trains in flight and waiting for
+     * a consumer are kept below max_bytes, but never below min_prefetch
+     * requests in flight.
+     *
+     * Exceptions:
+     * std::invalid_argument if min_prefetch is 0 or larger than max_prefetch
+     */
+    void setPrefetchBounds(std::size_t min_prefetch, std::size_t max_prefetch, std::size_t max_bytes = 0) {
+        if (min_prefetch == 0 || min_prefetch > max_prefetch)
+            throw std::invalid_argument("Invalid prefetch bounds: " + std::to_string(min_prefetch) +
+                                        ", " + std::to_string(max_prefetch));
+        std::lock_guard<std::mutex> lock(mutex_);
+        min_prefetch_ = min_prefetch;
+        max_prefetch_ = max_prefetch;
+        max_bytes_ = max_bytes;
+    }
+
+    /*
+     * Return the next train which no other thread received.
+     *
+     * Exceptions:
+     * std::runtime_error if the client is closed
+     * the error which stopped the receiver thread
+     */
+    MultipartMsg nextMultipartMsg() {
+        MultipartMsg mpmsg;
+        bool waited = !trains_.try_pop(mpmsg);
+        if (waited && !trains_.pop(mpmsg)) {
+            error_.rethrow();
+            throw std::runtime_error("The client is closed");
+        }
+        recordPop(waited);
+        return mpmsg;
+    }
+
+    /*
+     * Return the next train, decoded in the calling thread.
+     *
+     * Exceptions:
+     * std::runtime_error if the client is closed or unknown "content" is found
+     * the error which stopped the receiver thread
+     */
+    std::map<std::string, kb_data> next() {
+        MultipartMsg mpmsg = nextMultipartMsg();
+        std::shared_ptr<const Selection> selection;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            selection = selection_;
+        }
+        return decodeMultipartMsg(mpmsg, *selection);
+    }
+
+    /*
+     * Stop receiving. The trains already queued, and those held back for
+     * reordering which fit in the queue, can still be taken.
+     */
+    void close() {
+        stop_ = true;
+        if (receiver_.joinable()) receiver_.join();
+        trains_.close();
+    }
+
+    // number of trains received
+    std::size_t received() const { return received_; }
+
+    // number of trains dropped because they arrived out of order
+    std::size_t late() const { return late_; }
+
+    // number of trains dropped because the queue was full when the client was closed
+    std::size_t dropped() const { return dropped_; }
+
+    // number of times the requests in flight were abandoned after a timeout
+    std::size_t failovers() const { return failovers_; }
+
+    // number of trains waiting for a consumer
+    std::size_t queued() const { return trains_.size(); }
+
+    // measurements and decisions of the adaptive prefetch
+    PrefetchStats prefetchStats() const {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        return stats_;
+    }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_CPP_KB_CONCURRENT_CLIENT_HPP
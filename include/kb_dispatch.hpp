@@ -0,0 +1,452 @@
+/*
+    Karabo bridge array kernels with run-time CPU dispatch.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_CPP_KB_DISPATCH_HPP
+#define KARABO_BRIDGE_CPP_KB_DISPATCH_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KARABO_BRIDGE_DISPATCH_X86
+#define KARABO_BRIDGE_TARGET(isa) __attribute__((target(isa)))
+#define KARABO_BRIDGE_ALWAYS_INLINE inline __attribute__((always_inline))
+#if defined(__clang__) || __GNUC__ >= 5
+#define KARABO_BRIDGE_DISPATCH_AVX512
+// the intrinsics can be used in the functions with a target attribute
+#define KARABO_BRIDGE_DISPATCH_INTRINSICS
+#include <immintrin.h>
+#endif
+#else
+#define KARABO_BRIDGE_ALWAYS_INLINE inline
+#endif
+
+
+namespace karabo_bridge {
+
+/*
+ * Instruction set levels the kernels are compiled for.
+ */
+enum class Isa { generic, sse42, avx2, avx512 };
+
+const char* isaName(Isa isa) {
+    switch (isa) {
+        case Isa::sse42: return "sse4.2";
+        case Isa::avx2: return "avx2";
+        case Isa::avx512: return "avx512";
+        default: return "generic";
+    }
+}
+
+/*
+ * Exceptions:
+ * std::invalid_argument if the name is unknown
+ */
+Isa isaFromName(const std::string& name) {
+    if (name == "generic") return Isa::generic;
+    if (name == "sse4.2" || name == "sse42") return Isa::sse42;
+    if (name == "avx2") return Isa::avx2;
+    if (name == "avx512") return Isa::avx512;
+    throw std::invalid_argument("Unknown instruction set: " + name);
+}
+
+/*
+ * Whether the kernels were compiled for the instruction set and the CPU
+ * supports it.
+ */
+bool isaSupported(Isa isa) {
+    if (isa == Isa::generic) return true;
+#ifdef KARABO_BRIDGE_DISPATCH_X86
+    __builtin_cpu_init();
+    if (isa == Isa::sse42) return __builtin_cpu_supports("sse4.2");
+    if (isa == Isa::avx2) return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#ifdef KARABO_BRIDGE_DISPATCH_AVX512
+    if (isa == Isa::avx512) return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+#endif
+    return false;
+}
+
+// supported instruction sets, from the lowest to the highest
+std::vector<Isa> supportedIsas() {
+    std::vector<Isa> isas;
+    for (Isa isa : {Isa::generic, Isa::sse42, Isa::avx2, Isa::avx512}) {
+        if (isaSupported(isa)) isas.push_back(isa);
+    }
+    return isas;
+}
+
+/*
+ * Array kernels of one instruction set.
+ *
+ * Every variant of a kernel gives bit-exact results: the reductions
+ * accumulate in a fixed number of lanes which are combined in a fixed
+ * order, whatever the vector width.
+ *
+ * The variants are written with intrinsics, so that they are vectorized
+ * whatever the optimization level. The histogram is scalar in all of them,
+ * since its scattered increments do not vectorize. Compilers without the
+ * intrinsics in target functions (g++ < 5) compile the generic loops for
+ * every instruction set instead, which are only vectorized at -O3.
+ */
+struct Kernels {
+    Isa isa;
+
+    // dst[i] = src[i]
+    void (*convert_u16_f32)(const uint16_t* src, float* dst, std::size_t n);
+
+    // dst[i] = src[i] with the bytes swapped
+    void (*byteswap_u16)(const uint16_t* src, uint16_t* dst, std::size_t n);
+
+    // sum of the elements
+    double (*sum_f32)(const float* src, std::size_t n);
+
+    // mask[i] = src[i] > threshold, return the number of elements above
+    std::size_t (*threshold_f32)(const float* src, std::size_t n, float threshold, uint8_t* mask);
+
+    // bins[(src[i] - lower) >> shift] += 1 for the values in [lower, lower + n_bins << shift)
+    void (*histogram_u16)(const uint16_t* src, std::size_t n, uint16_t lower, unsigned int shift,
+                          uint32_t* bins, std::size_t n_bins);
+};
+
+namespace simd {
+
+const std::size_t lanes = 16; // accumulators of the reductions
+
+KARABO_BRIDGE_ALWAYS_INLINE void convertU16F32(const uint16_t* src, float* dst, std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i) dst[i] = static_cast<float>(src[i]);
+}
+
+KARABO_BRIDGE_ALWAYS_INLINE void byteswapU16(const uint16_t* src, uint16_t* dst, std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i) dst[i] = static_cast<uint16_t>((src[i] << 8) | (src[i] >> 8));
+}
+
+// add the last n < lanes elements to the lanes and combine them in a fixed order
+KARABO_BRIDGE_ALWAYS_INLINE double sumLanes(double* acc, const float* src, std::size_t n) {
+    for (std::size_t j = 0; j < n; ++j) acc[j] += src[j];
+
+    double sum = 0;
+    for (std::size_t j = 0; j < lanes; ++j) sum += acc[j];
+    return sum;
+}
+
+KARABO_BRIDGE_ALWAYS_INLINE double sumF32(const float* src, std::size_t n) {
+    double acc[lanes] = {};
+    std::size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        for (std::size_t j = 0; j < lanes; ++j) acc[j] += src[i + j];
+    }
+    return sumLanes(acc, src + i, n - i);
+}
+
+KARABO_BRIDGE_ALWAYS_INLINE std::size_t thresholdF32(const float* src, std::size_t n, float threshold,
+                                                     uint8_t* mask) {
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        mask[i] = src[i] > threshold;
+        count += mask[i];
+    }
+    return count;
+}
+
+KARABO_BRIDGE_ALWAYS_INLINE void histogramU16(const uint16_t* src, std::size_t n, uint16_t lower,
+                                              unsigned int shift, uint32_t* bins, std::size_t n_bins) {
+    for (std::size_t i = 0; i < n; ++i) {
+        if (src[i] < lower) continue;
+        std::size_t bin = static_cast<std::size_t>(src[i] - lower) >> shift;
+        if (bin < n_bins) ++bins[bin];
+    }
+}
+
+// the generic loops compiled for one instruction set
+#define KARABO_BRIDGE_KERNELS(NS, TARGET) \
+namespace NS { \
+TARGET void convert_u16_f32(const uint16_t* src, float* dst, std::size_t n) { convertU16F32(src, dst, n); } \
+TARGET void byteswap_u16(const uint16_t* src, uint16_t* dst, std::size_t n) { byteswapU16(src, dst, n); } \
+TARGET double sum_f32(const float* src, std::size_t n) { return sumF32(src, n); } \
+TARGET std::size_t threshold_f32(const float* src, std::size_t n, float threshold, uint8_t* mask) { \
+    return thresholdF32(src, n, threshold, mask); } \
+TARGET void histogram_u16(const uint16_t* src, std::size_t n, uint16_t lower, unsigned int shift, \
+                          uint32_t* bins, std::size_t n_bins) { \
+    histogramU16(src, n, lower, shift, bins, n_bins); } \
+}
+
+KARABO_BRIDGE_KERNELS(generic, )
+#if defined(KARABO_BRIDGE_DISPATCH_X86) && !defined(KARABO_BRIDGE_DISPATCH_INTRINSICS)
+KARABO_BRIDGE_KERNELS(sse42, KARABO_BRIDGE_TARGET("sse4.2"))
+KARABO_BRIDGE_KERNELS(avx2, KARABO_BRIDGE_TARGET("avx2,fma"))
+#endif
+
+#undef KARABO_BRIDGE_KERNELS
+
+#ifdef KARABO_BRIDGE_DISPATCH_INTRINSICS
+
+namespace sse42 {
+
+KARABO_BRIDGE_TARGET("sse4.2")
+void convert_u16_f32(const uint16_t* src, float* dst, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(_mm_cvtepu16_epi32(v)));
+        _mm_storeu_ps(dst + i + 4, _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_srli_si128(v, 8))));
+    }
+    convertU16F32(src + i, dst + i, n - i);
+}
+
+KARABO_BRIDGE_TARGET("sse4.2")
+void byteswap_u16(const uint16_t* src, uint16_t* dst, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+    byteswapU16(src + i, dst + i, n - i);
+}
+
+KARABO_BRIDGE_TARGET("sse4.2")
+double sum_f32(const float* src, std::size_t n) {
+    // lanes 2k and 2k + 1 in acc[k]
+    __m128d acc[lanes / 2];
+    for (auto& a : acc) a = _mm_setzero_pd();
+    std::size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        for (std::size_t k = 0; k < lanes / 4; ++k) {
+            __m128 v = _mm_loadu_ps(src + i + 4 * k);
+            acc[2 * k] = _mm_add_pd(acc[2 * k], _mm_cvtps_pd(v));
+            acc[2 * k + 1] = _mm_add_pd(acc[2 * k + 1], _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+        }
+    }
+    double sums[lanes];
+    for (std::size_t k = 0; k < lanes / 2; ++k) _mm_storeu_pd(sums + 2 * k, acc[k]);
+    return sumLanes(sums, src + i, n - i);
+}
+
+KARABO_BRIDGE_TARGET("sse4.2")
+std::size_t threshold_f32(const float* src, std::size_t n, float threshold, uint8_t* mask) {
+    const __m128 t = _mm_set1_ps(threshold);
+    const __m128i one = _mm_set1_epi8(1);
+    std::size_t count = 0;
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_packs_epi32(_mm_castps_si128(_mm_cmpgt_ps(_mm_loadu_ps(src + i), t)),
+                                    _mm_castps_si128(_mm_cmpgt_ps(_mm_loadu_ps(src + i + 4), t)));
+        __m128i b = _mm_packs_epi32(_mm_castps_si128(_mm_cmpgt_ps(_mm_loadu_ps(src + i + 8), t)),
+                                    _mm_castps_si128(_mm_cmpgt_ps(_mm_loadu_ps(src + i + 12), t)));
+        __m128i m = _mm_packs_epi16(a, b); // 0xff above the threshold
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(mask + i), _mm_and_si128(m, one));
+        count += static_cast<std::size_t>(__builtin_popcount(_mm_movemask_epi8(m)));
+    }
+    return count + thresholdF32(src + i, n - i, threshold, mask + i);
+}
+
+KARABO_BRIDGE_TARGET("sse4.2")
+void histogram_u16(const uint16_t* src, std::size_t n, uint16_t lower, unsigned int shift,
+                   uint32_t* bins, std::size_t n_bins) {
+    histogramU16(src, n, lower, shift, bins, n_bins);
+}
+
+} // sse42
+
+namespace avx2 {
+
+KARABO_BRIDGE_TARGET("avx2,fma")
+void convert_u16_f32(const uint16_t* src, float* dst, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(v)));
+    }
+    convertU16F32(src + i, dst + i, n - i);
+}
+
+KARABO_BRIDGE_TARGET("avx2,fma")
+void byteswap_u16(const uint16_t* src, uint16_t* dst, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                            _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8)));
+    }
+    byteswapU16(src + i, dst + i, n - i);
+}
+
+KARABO_BRIDGE_TARGET("avx2,fma")
+double sum_f32(const float* src, std::size_t n) {
+    // lanes 4k to 4k + 3 in acc[k]
+    __m256d acc[lanes / 4];
+    for (auto& a : acc) a = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        for (std::size_t k = 0; k < lanes / 4; ++k)
+            acc[k] = _mm256_add_pd(acc[k], _mm256_cvtps_pd(_mm_loadu_ps(src + i + 4 * k)));
+    }
+    double sums[lanes];
+    for (std::size_t k = 0; k < lanes / 4; ++k) _mm256_storeu_pd(sums + 4 * k, acc[k]);
+    return sumLanes(sums, src + i, n - i);
+}
+
+KARABO_BRIDGE_TARGET("avx2,fma")
+std::size_t threshold_f32(const float* src, std::size_t n, float threshold, uint8_t* mask) {
+    const __m256 t = _mm256_set1_ps(threshold);
+    const __m128i one = _mm_set1_epi8(1);
+    std::size_t count = 0;
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(src + i), t, _CMP_GT_OQ));
+        __m256i b = _mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(src + i + 8), t, _CMP_GT_OQ));
+        // the packs work within the 128-bit halves: 0-3, 8-11, 4-7, 12-15
+        __m256i ab = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+        __m128i m = _mm_packs_epi16(_mm256_castsi256_si128(ab), _mm256_extracti128_si256(ab, 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(mask + i), _mm_and_si128(m, one));
+        count += static_cast<std::size_t>(__builtin_popcount(_mm_movemask_epi8(m)));
+    }
+    return count + thresholdF32(src + i, n - i, threshold, mask + i);
+}
+
+KARABO_BRIDGE_TARGET("avx2,fma")
+void histogram_u16(const uint16_t* src, std::size_t n, uint16_t lower, unsigned int shift,
+                   uint32_t* bins, std::size_t n_bins) {
+    histogramU16(src, n, lower, shift, bins, n_bins);
+}
+
+} // avx2
+
+// the zero-masked conversions, since the unmasked ones trigger a false
+// -Wmaybe-uninitialized in the headers of g++ 12
+namespace avx512 {
+
+const __mmask16 all = 0xFFFF;
+
+KARABO_BRIDGE_TARGET("avx512f,avx512bw")
+void convert_u16_f32(const uint16_t* src, float* dst, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        _mm512_storeu_ps(dst + i, _mm512_maskz_cvtepi32_ps(all, _mm512_maskz_cvtepu16_epi32(all, v)));
+    }
+    convertU16F32(src + i, dst + i, n - i);
+}
+
+KARABO_BRIDGE_TARGET("avx512f,avx512bw")
+void byteswap_u16(const uint16_t* src, uint16_t* dst, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512i v = _mm512_loadu_si512(src + i);
+        _mm512_storeu_si512(dst + i, _mm512_or_si512(_mm512_slli_epi16(v, 8), _mm512_srli_epi16(v, 8)));
+    }
+    byteswapU16(src + i, dst + i, n - i);
+}
+
+KARABO_BRIDGE_TARGET("avx512f,avx512bw")
+double sum_f32(const float* src, std::size_t n) {
+    // lanes 8k to 8k + 7 in acc[k]
+    __m512d acc[lanes / 8];
+    for (auto& a : acc) a = _mm512_setzero_pd();
+    std::size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        for (std::size_t k = 0; k < lanes / 8; ++k)
+            acc[k] = _mm512_add_pd(acc[k], _mm512_maskz_cvtps_pd(0xFF, _mm256_loadu_ps(src + i + 8 * k)));
+    }
+    double sums[lanes];
+    for (std::size_t k = 0; k < lanes / 8; ++k) _mm512_storeu_pd(sums + 8 * k, acc[k]);
+    return sumLanes(sums, src + i, n - i);
+}
+
+KARABO_BRIDGE_TARGET("avx512f,avx512bw")
+std::size_t threshold_f32(const float* src, std::size_t n, float threshold, uint8_t* mask) {
+    const __m512 t = _mm512_set1_ps(threshold);
+    std::size_t count = 0;
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __mmask16 m = _mm512_cmp_ps_mask(_mm512_loadu_ps(src + i), t, _CMP_GT_OQ);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(mask + i),
+                         _mm512_maskz_cvtepi32_epi8(all, _mm512_maskz_set1_epi32(m, 1)));
+        count += static_cast<std::size_t>(__builtin_popcount(m));
+    }
+    return count + thresholdF32(src + i, n - i, threshold, mask + i);
+}
+
+KARABO_BRIDGE_TARGET("avx512f,avx512bw")
+void histogram_u16(const uint16_t* src, std::size_t n, uint16_t lower, unsigned int shift,
+                   uint32_t* bins, std::size_t n_bins) {
+    histogramU16(src, n, lower, shift, bins, n_bins);
+}
+
+} // avx512
+
+#endif
+
+} // simd
+
+/*
+ * Return the kernels of an instruction set, which must be supported.
+ *
+ * Exceptions:
+ * std::invalid_argument if the instruction set is not supported
+ */
+const Kernels& kernelsFor(Isa isa) {
+#define KARABO_BRIDGE_KERNEL_TABLE(NS) \
+    {Isa::NS, simd::NS::convert_u16_f32, simd::NS::byteswap_u16, simd::NS::sum_f32, \
+     simd::NS::threshold_f32, simd::NS::histogram_u16}
+
+    static const Kernels generic = KARABO_BRIDGE_KERNEL_TABLE(generic);
+    if (!isaSupported(isa)) throw std::invalid_argument(std::string("Unsupported instruction set: ") + isaName(isa));
+#ifdef KARABO_BRIDGE_DISPATCH_X86
+    static const Kernels sse42 = KARABO_BRIDGE_KERNEL_TABLE(sse42);
+    static const Kernels avx2 = KARABO_BRIDGE_KERNEL_TABLE(avx2);
+    if (isa == Isa::sse42) return sse42;
+    if (isa == Isa::avx2) return avx2;
+#ifdef KARABO_BRIDGE_DISPATCH_AVX512
+    static const Kernels avx512 = KARABO_BRIDGE_KERNEL_TABLE(avx512);
+    if (isa == Isa::avx512) return avx512;
+#endif
+#endif
+    return generic;
+
+#undef KARABO_BRIDGE_KERNEL_TABLE
+}
+
+/*
+ * Return the instruction set used by default: the highest one supported,
+ * or the one named by the environment variable KARABO_BRIDGE_ISA (e.g. to
+ * compare them) if the CPU supports it. An unknown name is reported on
+ * stderr and ignored.
+ */
+Isa selectIsa() {
+    Isa best = supportedIsas().back();
+    const char* name = std::getenv("KARABO_BRIDGE_ISA");
+    if (name == nullptr || *name == '\0') return best;
+
+    try {
+        Isa isa = isaFromName(name);
+        return isaSupported(isa) ? isa : best;
+    } catch (std::invalid_argument& e) {
+        std::cerr << e.what() << ", using " << isaName(best) << std::endl;
+        return best;
+    }
+}
+
+/*
+ * Return the kernels selected at the first call.
+ */
+const Kernels& kernels() {
+    static const Kernels& selected = kernelsFor(selectIsa());
+    return selected;
+}
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_CPP_KB_DISPATCH_HPP
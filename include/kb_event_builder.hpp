@@ -0,0 +1,312 @@
+/*
+    Karabo bridge train matcher and pulse event builder.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_CPP_KB_EVENT_BUILDER_HPP
+#define KARABO_BRIDGE_CPP_KB_EVENT_BUILDER_HPP
+
+#include "kb_client.hpp"
+
+#include <algorithm>
+#include <limits>
+
+
+namespace karabo_bridge {
+
+/*
+ * Join the data received from several clients into complete trains.
+ *
+ * The data of a train are kept until all the expected sources have
+ * arrived. Trains older than the last complete one, and the oldest trains
+ * when more than max_pending are incomplete, are dropped.
+ */
+class TrainMatcher {
+    std::vector<std::string> sources_;
+    std::size_t max_pending_;
+    std::map<uint64_t, std::map<std::string, kb_data>> pending_;
+    uint64_t last_ = 0; // last complete train
+    std::size_t dropped_ = 0;
+
+    bool complete(const std::map<std::string, kb_data>& data_pkg) const {
+        for (auto& src : sources_) {
+            if (data_pkg.find(src) == data_pkg.end()) return false;
+        }
+        return true;
+    }
+
+public:
+    explicit TrainMatcher(const std::vector<std::string>& sources, std::size_t max_pending = 10):
+        sources_(sources), max_pending_(std::max<std::size_t>(max_pending, 1)) {}
+
+    /*
+     * Add the data of one or several sources.
+     *
+     * Return true if the train is complete, in which case its data are
+     * moved into matched.
+     *
+     * Exceptions:
+     * std::out_of_range if the data have no train ID
+     */
+    bool add(std::map<std::string, kb_data>&& data_pkg, std::map<std::string, kb_data>& matched) {
+        uint64_t tid = trainId(data_pkg);
+        if (tid <= last_) {
+            ++dropped_;
+            return false;
+        }
+
+        auto& train = pending_[tid];
+        for (auto& src : data_pkg) train[src.first] = std::move(src.second);
+        if (!complete(train)) {
+            if (pending_.size() > max_pending_) {
+                pending_.erase(pending_.begin());
+                ++dropped_;
+            }
+            return false;
+        }
+
+        matched = std::move(train);
+        // the older trains can no longer be complete
+        auto it = pending_.find(tid);
+        dropped_ += std::distance(pending_.begin(), it);
+        pending_.erase(pending_.begin(), std::next(it));
+        last_ = tid;
+        return true;
+    }
+
+    // number of incomplete trains dropped
+    std::size_t dropped() const { return dropped_; }
+
+    // number of incomplete trains kept
+    std::size_t pending() const { return pending_.size(); }
+};
+
+/*
+ * A source of an event: the array at path, whose first axis is indexed by
+ * the pulse IDs at pulse_id_path. If the source has no pulse IDs, the whole
+ * array belongs to every event of the train.
+ */
+struct EventSource {
+    std::string source;
+    std::string path = "image.data";
+    std::string pulse_id_path = "image.pulseId";
+    bool required = true; // whether the events without this source are missing
+
+    EventSource(const std::string& source_, const std::string& path_ = "image.data",
+                const std::string& pulse_id_path_ = "image.pulseId", bool required_ = true):
+        source(source_), path(path_), pulse_id_path(pulse_id_path_), required(required_) {}
+};
+
+/*
+ * What to do with a pulse which a required source does not have.
+ */
+enum class MissingPulse {
+    drop, // no event is built for the pulse
+    keep // the event is built and the frame of the source is nullptr
+};
+
+/*
+ * The pulse-aligned events of a train.
+ *
+ * The frames point into the arrays of the train, which must outlive the
+ * events.
+ */
+class Events {
+    struct Layout {
+        const char* data; // nullptr if the source is missing
+        std::vector<unsigned int> frame_shape;
+        std::string dtype;
+        std::size_t frame_bytes;
+        bool broadcast; // the whole array belongs to every event
+    };
+
+    uint64_t train_id_ = 0;
+    std::vector<Layout> layouts_;
+    std::vector<uint64_t> pulse_ids_;
+    std::vector<int64_t> frames_; // frame index per event and source, -1 if missing
+
+    friend class EventBuilder;
+
+public:
+    // number of events
+    std::size_t size() const { return pulse_ids_.size(); }
+
+    uint64_t trainId() const { return train_id_; }
+
+    uint64_t pulseId(std::size_t event) const { return pulse_ids_[event]; }
+
+    /*
+     * Return the frame of a source in an event, or nullptr if the source
+     * does not have the pulse. Sources are numbered as given to the
+     * EventBuilder.
+     */
+    const void* frame(std::size_t event, std::size_t source) const {
+        int64_t index = frames_[event * layouts_.size() + source];
+        if (index < 0) return nullptr;
+        const Layout& layout = layouts_[source];
+        return layout.data + static_cast<std::size_t>(index) * layout.frame_bytes;
+    }
+
+    // index of the frame along the pulse axis of the array, -1 if missing
+    int64_t frameIndex(std::size_t event, std::size_t source) const {
+        return frames_[event * layouts_.size() + source];
+    }
+
+    // shape of a frame of the source
+    const std::vector<unsigned int>& frameShape(std::size_t source) const {
+        return layouts_[source].frame_shape;
+    }
+
+    const std::string& dtype(std::size_t source) const { return layouts_[source].dtype; }
+};
+
+/*
+ * Read integer pulse IDs of any integer type.
+ *
+ * Exceptions:
+ * std::invalid_argument if the array is not an integer array
+ */
+void readPulseIds(const Array& array, std::vector<uint64_t>& pulse_ids) {
+    std::string dtype = array.dtype();
+    if (dtype.size() > 2 && dtype.compare(dtype.size() - 2, 2, "_t") == 0) dtype.erase(dtype.size() - 2);
+    bool is_signed = dtype.compare(0, 3, "int") == 0;
+    if (!is_signed && dtype.compare(0, 4, "uint") != 0)
+        throw std::invalid_argument("Pulse IDs must be integers: " + array.dtype());
+
+    std::size_t n = array.size();
+    pulse_ids.resize(n);
+    std::size_t itemsize = dtype_size(dtype);
+    const char* ptr = static_cast<const char*>(array.data());
+    for (std::size_t i = 0; i < n; ++i) {
+        const char* p = ptr + i * itemsize;
+        int64_t v;
+        if (itemsize == 1) v = is_signed ? *reinterpret_cast<const int8_t*>(p) : *reinterpret_cast<const uint8_t*>(p);
+        else if (itemsize == 2) v = is_signed ? *reinterpret_cast<const int16_t*>(p) : *reinterpret_cast<const uint16_t*>(p);
+        else if (itemsize == 4) v = is_signed ? *reinterpret_cast<const int32_t*>(p) : *reinterpret_cast<const uint32_t*>(p);
+        else v = *reinterpret_cast<const int64_t*>(p);
+        pulse_ids[i] = static_cast<uint64_t>(v);
+    }
+}
+
+/*
+ * Join the sources of a train on the pulse ID.
+ *
+ * The pulse IDs of every source are sorted once and the sources are
+ * merged, so that building the events of a train takes O(n log n) in the
+ * number of pulses. The buffers are reused from train to train.
+ */
+class EventBuilder {
+    struct SourceState {
+        std::vector<uint64_t> pulse_ids;
+        std::vector<uint32_t> order; // frame indices sorted by pulse ID
+        std::size_t cursor;
+        bool present;
+        bool broadcast;
+    };
+
+    std::vector<EventSource> sources_;
+    MissingPulse policy_;
+    std::vector<SourceState> states_;
+
+public:
+    EventBuilder(const std::vector<EventSource>& sources, MissingPulse policy = MissingPulse::drop):
+        sources_(sources), policy_(policy), states_(sources.size()) {}
+
+    /*
+     * Build the events of a train.
+     *
+     * Exceptions:
+     * std::out_of_range if the train has no train ID
+     * std::runtime_error if the number of pulse IDs of a source does not
+     * match its array
+     */
+    void build(std::map<std::string, kb_data>& data_pkg, Events& events) {
+        std::size_t n_sources = sources_.size();
+        events.train_id_ = trainId(data_pkg);
+        events.layouts_.resize(n_sources);
+        events.pulse_ids_.clear();
+        events.frames_.clear();
+
+        bool missing_required = false;
+        for (std::size_t s = 0; s < n_sources; ++s) {
+            const EventSource& src = sources_[s];
+            SourceState& state = states_[s];
+            Events::Layout& layout = events.layouts_[s];
+            state.cursor = 0;
+            state.present = false;
+            state.broadcast = false;
+            state.order.clear();
+            layout.data = nullptr;
+
+            auto it = data_pkg.find(src.source);
+            if (it == data_pkg.end() || it->second.array.find(src.path) == it->second.array.end()) {
+                if (src.required) missing_required = true;
+                continue;
+            }
+            Array& array = it->second.array[src.path];
+            auto shape = array.shape();
+
+            auto pit = it->second.array.find(src.pulse_id_path);
+            state.present = true;
+            state.broadcast = pit == it->second.array.end() || shape.empty();
+            layout.data = static_cast<const char*>(array.data());
+            layout.dtype = array.dtype();
+            layout.broadcast = state.broadcast;
+            layout.frame_shape.assign(state.broadcast ? shape.begin() : shape.begin() + 1, shape.end());
+            layout.frame_bytes = dtype_size(layout.dtype);
+            for (auto v : layout.frame_shape) layout.frame_bytes *= v;
+            if (state.broadcast) continue;
+
+            readPulseIds(pit->second, state.pulse_ids);
+            if (state.pulse_ids.size() != shape[0])
+                throw std::runtime_error("The pulse IDs of " + src.source + " do not match " + src.path);
+            state.order.resize(state.pulse_ids.size());
+            for (uint32_t i = 0; i < state.order.size(); ++i) state.order[i] = i;
+            const std::vector<uint64_t>& ids = state.pulse_ids;
+            std::stable_sort(state.order.begin(), state.order.end(),
+                             [&ids](uint32_t a, uint32_t b) { return ids[a] < ids[b]; });
+        }
+        if (missing_required && policy_ == MissingPulse::drop) return;
+
+        // merge the sorted pulse IDs
+        const uint64_t none = std::numeric_limits<uint64_t>::max();
+        while (true) {
+            uint64_t pid = none;
+            for (auto& state : states_) {
+                if (state.present && !state.broadcast && state.cursor < state.order.size())
+                    pid = std::min(pid, state.pulse_ids[state.order[state.cursor]]);
+            }
+            if (pid == none) break;
+
+            bool complete = true;
+            std::size_t first = events.frames_.size();
+            for (std::size_t s = 0; s < n_sources; ++s) {
+                SourceState& state = states_[s];
+                int64_t index = -1;
+                if (state.broadcast) {
+                    index = 0;
+                } else if (state.present && state.cursor < state.order.size() &&
+                           state.pulse_ids[state.order[state.cursor]] == pid) {
+                    index = state.order[state.cursor];
+                    // skip duplicated pulse IDs
+                    while (state.cursor < state.order.size() &&
+                           state.pulse_ids[state.order[state.cursor]] == pid) ++state.cursor;
+                }
+                if (index < 0 && sources_[s].required) complete = false;
+                events.frames_.push_back(index);
+            }
+
+            if (complete || policy_ == MissingPulse::keep) events.pulse_ids_.push_back(pid);
+            else events.frames_.resize(first);
+        }
+    }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_CPP_KB_EVENT_BUILDER_HPP
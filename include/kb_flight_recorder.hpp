@@ -0,0 +1,240 @@
+/*
+    Karabo bridge flight recorder.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_CPP_KB_FLIGHT_RECORDER_HPP
+#define KARABO_BRIDGE_CPP_KB_FLIGHT_RECORDER_HPP
+
+#include "kb_client.hpp"
+#include "kb_queue.hpp"
+#include "kb_recording.hpp"
+
+#include <signal.h>
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <thread>
+
+
+namespace karabo_bridge {
+
+// number of signals caught by the flight recorder handler
+volatile std::sig_atomic_t flight_recorder_signals = 0;
+
+void flightRecorderSignalHandler(int) { ++flight_recorder_signals; }
+
+/*
+ * Keep the last trains in memory and dump them into a recording when
+ * triggered.
+ *
+ * The ring holds the received frames themselves, which are released when
+ * the trains are evicted: at most max_trains trains, max_bytes bytes and
+ * max_seconds seconds are kept. The slots of the ring are allocated once.
+ *
+ * A dump is triggered by trigger(), by a signal (see triggerOnSignal()) or
+ * by a predicate evaluated on the decoded trains. The trains in the ring at
+ * that time are written into "<prefix>-<number of the dump>.kbr" by a
+ * background thread, while the ring keeps recording. The frames are shared
+ * with the dump rather than copied.
+ */
+class FlightRecorder {
+public:
+    using Predicate = std::function<bool(std::map<std::string, kb_data>&)>;
+
+private:
+    struct Slot {
+        MultipartMsg train;
+        std::chrono::steady_clock::time_point time;
+        std::size_t bytes = 0;
+    };
+
+    std::vector<Slot> slots_;
+    std::size_t head_ = 0; // oldest train
+    std::size_t count_ = 0;
+    std::size_t bytes_ = 0;
+    std::size_t max_bytes_;
+    std::chrono::duration<double> max_age_;
+
+    Predicate predicate_;
+    MultipartMsg scratch_; // frames shared with the predicate
+    std::atomic<bool> triggered_;
+    std::sig_atomic_t signals_seen_;
+
+    std::string prefix_;
+    BoundedQueue<std::pair<std::size_t, std::vector<MultipartMsg>>> dumps_; // (number, trains)
+    std::thread dumper_;
+    std::size_t n_dumps_ = 0;
+    std::atomic<std::size_t> dumped_;
+    std::atomic<std::size_t> dropped_;
+    WorkerError error_;
+    bool closed_ = false;
+
+    void evict() {
+        Slot& slot = slots_[head_];
+        bytes_ -= slot.bytes;
+        slot.train.clear(); // release the frames
+        slot.bytes = 0;
+        head_ = (head_ + 1) % slots_.size();
+        --count_;
+    }
+
+    void dumpLoop() {
+        std::pair<std::size_t, std::vector<MultipartMsg>> dump;
+        while (dumps_.pop(dump)) {
+            try {
+                RecordWriter writer(prefix_ + "-" + std::to_string(dump.first) + ".kbr");
+                for (auto& train : dump.second) writer.write(std::move(train));
+                writer.close();
+                ++dumped_;
+            } catch (...) {
+                error_.capture();
+                ++dropped_;
+            }
+            dump.second.clear(); // release the frames
+        }
+    }
+
+    void dump() {
+        std::vector<MultipartMsg> trains(count_);
+        for (std::size_t i = 0; i < count_; ++i)
+            shareMultipartMsg(slots_[(head_ + i) % slots_.size()].train, trains[i]);
+        if (!dumps_.try_push(std::make_pair(n_dumps_++, std::move(trains)))) ++dropped_;
+    }
+
+public:
+    /*
+     * prefix: path prefix of the dumped recordings
+     * max_trains: number of slots in the ring
+     * max_seconds: maximum age of the trains in the ring
+     * max_bytes: maximum size of the trains in the ring
+     * queue_capacity: maximum number of dumps waiting to be written
+     */
+    FlightRecorder(const std::string& prefix, std::size_t max_trains, double max_seconds = 1e9,
+                   std::size_t max_bytes = std::numeric_limits<std::size_t>::max(),
+                   std::size_t queue_capacity = 2):
+        slots_(std::max<std::size_t>(max_trains, 1)),
+        max_bytes_(max_bytes),
+        max_age_(max_seconds),
+        triggered_(false),
+        signals_seen_(flight_recorder_signals),
+        prefix_(prefix),
+        dumps_(queue_capacity),
+        dumped_(0),
+        dropped_(0) {
+        dumper_ = std::thread(&FlightRecorder::dumpLoop, this);
+    }
+
+    FlightRecorder(const FlightRecorder&) = delete;
+    FlightRecorder& operator=(const FlightRecorder&) = delete;
+
+    ~FlightRecorder() {
+        try { close(); } catch (...) {}
+    }
+
+    /*
+     * Trigger a dump when the process receives the signal, e.g. SIGUSR1.
+     * The dump starts with the next train pushed.
+     */
+    static void triggerOnSignal(int signum) {
+        struct sigaction action;
+        memset(&action, 0, sizeof action);
+        action.sa_handler = flightRecorderSignalHandler;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        sigaction(signum, &action, nullptr);
+    }
+
+    /*
+     * Trigger a dump when the predicate returns true for a train. The
+     * predicate is called by push() on the decoded train.
+     */
+    void setTrigger(Predicate predicate) { predicate_ = std::move(predicate); }
+
+    /*
+     * Dump the ring with the next train pushed. It can be called from any
+     * thread.
+     */
+    void trigger() { triggered_ = true; }
+
+    /*
+     * Add a train to the ring, evicting the oldest trains if needed. A
+     * triggered dump includes this train.
+     *
+     * Exceptions:
+     * the error which happened while writing a previous dump
+     */
+    void push(MultipartMsg&& train) {
+        error_.rethrow();
+
+        auto now = std::chrono::steady_clock::now();
+        std::size_t bytes = 0;
+        for (auto& frame : train) bytes += frame.size();
+
+        while (count_ > 0 && (count_ == slots_.size() || bytes_ + bytes > max_bytes_ ||
+                              now - slots_[head_].time > max_age_)) evict();
+
+        if (predicate_) {
+            scratch_.clear();
+            shareMultipartMsg(train, scratch_);
+            auto data_pkg = decodeMultipartMsg(scratch_);
+            if (predicate_(data_pkg)) triggered_ = true;
+        }
+
+        Slot& slot = slots_[(head_ + count_) % slots_.size()];
+        slot.train = std::move(train); // moves the frames if the allocators differ
+        slot.time = now;
+        slot.bytes = bytes;
+        bytes_ += bytes;
+        ++count_;
+
+        std::sig_atomic_t signals = flight_recorder_signals;
+        if (signals != signals_seen_) {
+            signals_seen_ = signals;
+            triggered_ = true;
+        }
+
+        if (triggered_.exchange(false)) dump();
+    }
+
+    /*
+     * Write the queued dumps and stop.
+     *
+     * Exceptions:
+     * the error which happened while writing a dump
+     */
+    void close() {
+        if (closed_) return;
+        closed_ = true;
+
+        dumps_.close();
+        dumper_.join();
+        error_.rethrow();
+    }
+
+    // number of trains in the ring
+    std::size_t size() const { return count_; }
+
+    // size of the trains in the ring
+    std::size_t bytes() const { return bytes_; }
+
+    // number of dumps written
+    std::size_t dumped() const { return dumped_; }
+
+    // number of dumps dropped because the queue was full or writing failed
+    std::size_t dropped() const { return dropped_; }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_CPP_KB_FLIGHT_RECORDER_HPP
@@ -0,0 +1,633 @@
+/*
+    Karabo bridge HDF5 writer.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_CPP_KB_HDF5_WRITER_HPP
+#define KARABO_BRIDGE_CPP_KB_HDF5_WRITER_HPP
+
+#include "kb_client.hpp"
+#include "kb_queue.hpp"
+
+#include <hdf5.h>
+#if !H5_VERSION_GE(1, 10, 3)
+#include <hdf5_hl.h>
+#endif
+#include <zlib.h>
+
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <limits>
+
+
+namespace karabo_bridge {
+
+/*
+ * Map a c++ or python data type string to the native HDF5 type.
+ *
+ * Exceptions:
+ * std::invalid_argument if the data type is unknown
+ */
+hid_t h5_native_type(const std::string& type_string) {
+    std::string dtype(type_string);
+    if (dtype.size() > 2 && dtype.compare(dtype.size() - 2, 2, "_t") == 0)
+        dtype.erase(dtype.size() - 2);
+
+    if (dtype == "uint8" || dtype == "bool") return H5T_NATIVE_UINT8;
+    if (dtype == "int8") return H5T_NATIVE_INT8;
+    if (dtype == "uint16") return H5T_NATIVE_UINT16;
+    if (dtype == "int16") return H5T_NATIVE_INT16;
+    if (dtype == "uint32") return H5T_NATIVE_UINT32;
+    if (dtype == "int32") return H5T_NATIVE_INT32;
+    if (dtype == "uint64") return H5T_NATIVE_UINT64;
+    if (dtype == "int64") return H5T_NATIVE_INT64;
+    if (dtype == "float32" || dtype == "float") return H5T_NATIVE_FLOAT;
+    if (dtype == "float64" || dtype == "double") return H5T_NATIVE_DOUBLE;
+    throw std::invalid_argument("Unknown data type: " + type_string);
+}
+
+/*
+ * Write trains into an HDF5 file with the European XFEL layout:
+ *
+ *     INDEX/trainId
+ *     INDEX/<source>/<group>/first, count sources which carry arrays
+ *     INDEX/<source>/first, count         sources which carry only msgpack data
+ *     INSTRUMENT/<source>/<path>
+ *     CONTROL/<source>/<path>/value
+ *
+ * where the dots in the path are replaced by "/" and the group of a path
+ * is its first part, e.g. "image" for "image.data".
+ *
+ * Arrays with one or more than two dimensions are pulse-resolved: their
+ * first axis is concatenated over trains and the index of their group
+ * tells which entries belong to which train. 2D arrays (e.g. camera
+ * images) get one entry per train, like the scalars in the msgpack data.
+ * Other msgpack data (strings, containers) is not written. The entries of
+ * a group which are missing in a train, e.g. a scalar of another type or
+ * absent, are left to the fill value of the dataset: NaN for floating
+ * point numbers and 0 otherwise.
+ *
+ * A train is written completely or not at all: if writing it fails, the
+ * datasets are truncated back to the previous train and the ones it
+ * created are removed. If even that fails, the remaining trains are
+ * dropped.
+ *
+ * Images are chunked by frame and module, i.e. a chunk is one (ss, fs)
+ * plane. The chunks of a train are deflated in parallel by a pool of
+ * threads and written directly into the file, bypassing the HDF5 filter
+ * pipeline.
+ *
+ * Trains are handed over to a writer thread through a bounded write-behind
+ * queue, so that write() never waits for the disk.
+ */
+class Hdf5Writer {
+
+    struct Dataset {
+        hid_t id;
+        hid_t type;
+        std::size_t itemsize;
+        std::vector<hsize_t> dims; // current dimensions
+        bool direct; // whether it is written by chunks
+        std::string index; // key of the index of its group, empty for the index itself
+        hsize_t committed; // entries of the trains written completely
+        bool created; // whether the train being written created it
+    };
+
+    struct Chunk {
+        Dataset* dataset;
+        std::vector<hsize_t> offset;
+        const char* data;
+        std::size_t size;
+        std::vector<Bytef> compressed;
+        uLongf compressed_size;
+        uint32_t filter_mask; // bit 0 set: the deflate filter was skipped
+    };
+
+    struct GroupIndex {
+        Dataset* first;
+        Dataset* count;
+        uint64_t next; // first entry of the next train
+        uint64_t committed; // next after the last train written completely
+        bool created; // whether the train being written created it
+    };
+
+    hid_t file_;
+    hid_t lcpl_; // link creation property which creates the intermediate groups
+    int compression_level_;
+
+    std::map<std::string, Dataset> datasets_;
+    std::map<std::string, GroupIndex> indices_; // by <source>/<group> or <source>
+    hsize_t n_trains_ = 0;
+    bool poisoned_ = false; // whether a failed train could not be rolled back
+
+    BoundedQueue<std::map<std::string, kb_data>> trains_;
+    std::thread writer_;
+    std::atomic<std::size_t> written_;
+    std::atomic<std::size_t> dropped_;
+    WorkerError error_;
+
+    BoundedQueue<Chunk*> chunks_;
+    std::vector<std::thread> compressors_;
+    std::size_t pending_ = 0; // chunks being compressed
+    std::mutex pending_mutex_;
+    std::condition_variable pending_cv_;
+
+    bool closed_ = false;
+
+    static void check(herr_t status, const std::string& what) {
+        if (status < 0) throw std::runtime_error("HDF5 error: " + what);
+    }
+
+    static hid_t check_id(hid_t id, const std::string& what) {
+        if (id < 0) throw std::runtime_error("HDF5 error: " + what);
+        return id;
+    }
+
+    static std::string toH5Path(const std::string& path) {
+        std::string h5path(path);
+        std::replace(h5path.begin(), h5path.end(), '.', '/');
+        return h5path;
+    }
+
+    // key of the index of a path of a source
+    static std::string indexKey(const std::string& source, const std::string& path, bool instrument) {
+        if (!instrument) return source;
+        return source + "/" + path.substr(0, path.find('.'));
+    }
+
+    /*
+     * Create an extendible dataset whose first axis is unlimited.
+     */
+    Dataset& createDataset(const std::string& name, hid_t type, const std::vector<hsize_t>& entry_dims,
+                           const std::vector<hsize_t>& chunk, bool direct, const std::string& index = "") {
+        std::vector<hsize_t> dims(1, 0);
+        dims.insert(dims.end(), entry_dims.begin(), entry_dims.end());
+        std::vector<hsize_t> maxdims(dims);
+        maxdims[0] = H5S_UNLIMITED;
+
+        hid_t space = check_id(H5Screate_simple(static_cast<int>(dims.size()), dims.data(), maxdims.data()),
+                               "create dataspace of " + name);
+        hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+        check(H5Pset_chunk(dcpl, static_cast<int>(chunk.size()), chunk.data()), "set chunk of " + name);
+        if (compression_level_ > 0)
+            check(H5Pset_deflate(dcpl, static_cast<unsigned int>(compression_level_)), "set deflate of " + name);
+        if (H5Tget_class(type) == H5T_FLOAT) {
+            double nan = std::numeric_limits<double>::quiet_NaN();
+            check(H5Pset_fill_value(dcpl, H5T_NATIVE_DOUBLE, &nan), "set fill value of " + name);
+        }
+
+        hid_t id = H5Dcreate2(file_, name.c_str(), type, space, lcpl_, dcpl, H5P_DEFAULT);
+        H5Pclose(dcpl);
+        H5Sclose(space);
+        check_id(id, "create dataset " + name);
+
+        Dataset dataset;
+        dataset.id = id;
+        dataset.type = type;
+        dataset.itemsize = H5Tget_size(type);
+        dataset.dims = dims;
+        dataset.direct = direct;
+        dataset.index = index;
+        dataset.committed = 0;
+        dataset.created = true;
+        return datasets_.insert(std::make_pair(name, dataset)).first->second;
+    }
+
+    /*
+     * Append n entries to a dataset through the HDF5 filter pipeline, or
+     * n fill values if buf is null.
+     */
+    void appendEntries(Dataset& dataset, const void* buf, hsize_t n) {
+        std::vector<hsize_t> start(dataset.dims.size(), 0);
+        std::vector<hsize_t> count(dataset.dims);
+        start[0] = dataset.dims[0];
+        count[0] = n;
+        dataset.dims[0] += n;
+        check(H5Dset_extent(dataset.id, dataset.dims.data()), "extend dataset");
+        if (n == 0 || buf == nullptr) return;
+
+        hid_t fspace = H5Dget_space(dataset.id);
+        H5Sselect_hyperslab(fspace, H5S_SELECT_SET, start.data(), nullptr, count.data(), nullptr);
+        hid_t mspace = H5Screate_simple(static_cast<int>(count.size()), count.data(), nullptr);
+        herr_t status = H5Dwrite(dataset.id, dataset.type, mspace, fspace, H5P_DEFAULT, buf);
+        H5Sclose(mspace);
+        H5Sclose(fspace);
+        check(status, "write dataset");
+    }
+
+    /*
+     * Get the index of a group, which is created if it did not show up in
+     * the previous trains.
+     */
+    GroupIndex& groupIndex(const std::string& key) {
+        auto it = indices_.find(key);
+        if (it != indices_.end()) return it->second;
+
+        std::vector<hsize_t> chunk(1, 4096);
+        GroupIndex index;
+        index.first = &createDataset("INDEX/" + key + "/first", H5T_NATIVE_UINT64, {}, chunk, false);
+        index.count = &createDataset("INDEX/" + key + "/count", H5T_NATIVE_UINT64, {}, chunk, false);
+        index.next = 0;
+        index.committed = 0;
+        index.created = true;
+        std::vector<uint64_t> zeros(n_trains_, 0);
+        appendEntries(*index.first, zeros.data(), n_trains_);
+        appendEntries(*index.count, zeros.data(), n_trains_);
+        return indices_.insert(std::make_pair(key, index)).first->second;
+    }
+
+    /*
+     * Append a train to the index of a group.
+     */
+    void appendIndex(GroupIndex& index, uint64_t count) {
+        appendEntries(*index.first, &index.next, 1);
+        appendEntries(*index.count, &count, 1);
+        index.next += count;
+    }
+
+    /*
+     * Fill a dataset up to n entries, e.g. up to the entries of its group
+     * in the previous trains if it did not show up in them.
+     */
+    void pad(Dataset& dataset, hsize_t n) {
+        if (dataset.dims[0] < n) appendEntries(dataset, nullptr, n - dataset.dims[0]);
+    }
+
+    /*
+     * Append a msgpack scalar. Return false if it is not a scalar.
+     */
+    bool appendScalar(const std::string& name, Object& value, const std::string& key) {
+        auto type = value.get().type;
+        hid_t h5type;
+        if (type == msgpack::type::object_type::BOOLEAN) h5type = H5T_NATIVE_UINT8;
+        else if (type == msgpack::type::object_type::POSITIVE_INTEGER) h5type = H5T_NATIVE_UINT64;
+        else if (type == msgpack::type::object_type::NEGATIVE_INTEGER) h5type = H5T_NATIVE_INT64;
+        else if (type == msgpack::type::object_type::FLOAT32 ||
+                 type == msgpack::type::object_type::FLOAT64) h5type = H5T_NATIVE_DOUBLE;
+        else return false;
+
+        GroupIndex& index = groupIndex(key);
+        auto it = datasets_.find(name);
+        Dataset* dataset;
+        if (it == datasets_.end())
+            dataset = &createDataset(name, h5type, {}, std::vector<hsize_t>(1, 4096), false, key);
+        else
+            dataset = &it->second;
+        pad(*dataset, index.next);
+
+        // the type of the dataset is fixed by the first value
+        char buf[8];
+        try {
+            if (H5Tequal(dataset->type, H5T_NATIVE_UINT8) > 0) {
+                uint8_t v = value.as<bool>();
+                memcpy(buf, &v, sizeof v);
+            } else if (H5Tequal(dataset->type, H5T_NATIVE_UINT64) > 0) {
+                uint64_t v = value.as<uint64_t>();
+                memcpy(buf, &v, sizeof v);
+            } else if (H5Tequal(dataset->type, H5T_NATIVE_INT64) > 0) {
+                int64_t v = value.as<int64_t>();
+                memcpy(buf, &v, sizeof v);
+            } else {
+                double v = value.as<double>();
+                memcpy(buf, &v, sizeof v);
+            }
+        } catch (std::bad_cast&) {
+            // a value of another type is left to the fill value
+            return true;
+        }
+        appendEntries(*dataset, buf, 1);
+        return true;
+    }
+
+    /*
+     * Append an array and return the number of entries, i.e. the length of
+     * the first axis for pulse-resolved arrays or 1.
+     */
+    hsize_t appendArray(const std::string& name, const Array& array, const std::string& key,
+                        std::vector<Chunk>& chunks) {
+        auto shape = array.shape();
+        if (shape.empty()) return 0;
+
+        GroupIndex& index = groupIndex(key);
+        bool pulse_resolved = shape.size() != 2;
+        hsize_t n_entries = pulse_resolved ? shape[0] : 1;
+        std::vector<hsize_t> entry_dims(shape.begin() + (pulse_resolved ? 1 : 0), shape.end());
+
+        auto it = datasets_.find(name);
+        Dataset* dataset;
+        if (it == datasets_.end()) {
+            hid_t type = h5_native_type(array.dtype());
+            // one chunk per frame and module
+            bool direct = entry_dims.size() >= 2;
+            std::vector<hsize_t> chunk(entry_dims.size() + 1, 1);
+            if (direct) {
+                chunk[chunk.size() - 2] = entry_dims[entry_dims.size() - 2];
+                chunk[chunk.size() - 1] = entry_dims[entry_dims.size() - 1];
+            } else {
+                hsize_t entry_size = 1;
+                for (auto v : entry_dims) entry_size *= v;
+                chunk[0] = std::max<hsize_t>(1, 65536 / std::max<hsize_t>(1, entry_size));
+                for (std::size_t i = 0; i < entry_dims.size(); ++i) chunk[i + 1] = entry_dims[i];
+            }
+            dataset = &createDataset(name, type, entry_dims, chunk, direct, key);
+        } else {
+            dataset = &it->second;
+        }
+
+        if (entry_dims.size() + 1 != dataset->dims.size() ||
+                !std::equal(entry_dims.begin(), entry_dims.end(), dataset->dims.begin() + 1))
+            throw std::runtime_error("Shape of " + name + " changed!");
+        pad(*dataset, index.next);
+
+        if (!dataset->direct) {
+            appendEntries(*dataset, array.data(), n_entries);
+            return n_entries;
+        }
+
+        hsize_t start = dataset->dims[0];
+        dataset->dims[0] += n_entries;
+        check(H5Dset_extent(dataset->id, dataset->dims.data()), "extend " + name);
+
+        std::size_t ndim = dataset->dims.size();
+        std::size_t chunk_size = dataset->itemsize * dataset->dims[ndim - 2] * dataset->dims[ndim - 1];
+        std::size_t n_modules = 1;
+        for (std::size_t i = 1; i < ndim - 2; ++i) n_modules *= dataset->dims[i];
+
+        auto ptr = static_cast<const char*>(array.data());
+        for (hsize_t f = 0; f < n_entries; ++f) {
+            for (std::size_t m = 0; m < n_modules; ++m) {
+                Chunk chunk;
+                chunk.dataset = dataset;
+                chunk.offset.assign(ndim, 0);
+                chunk.offset[0] = start + f;
+                // unravel the module index
+                std::size_t rem = m;
+                for (std::size_t i = ndim - 3; i >= 1; --i) {
+                    chunk.offset[i] = rem % dataset->dims[i];
+                    rem /= dataset->dims[i];
+                }
+                chunk.data = ptr;
+                chunk.size = chunk_size;
+                chunk.compressed_size = 0;
+                chunk.filter_mask = 0;
+                chunks.push_back(std::move(chunk));
+                ptr += chunk_size;
+            }
+        }
+
+        return n_entries;
+    }
+
+    void compressChunk(Chunk& chunk) const {
+        if (compression_level_ <= 0) return;
+
+        chunk.compressed.resize(compressBound(chunk.size));
+        chunk.compressed_size = chunk.compressed.size();
+        int status = compress2(chunk.compressed.data(), &chunk.compressed_size,
+                               reinterpret_cast<const Bytef*>(chunk.data), chunk.size,
+                               compression_level_);
+        // store incompressible chunks as they are
+        if (status != Z_OK || chunk.compressed_size >= chunk.size) chunk.filter_mask = 1;
+    }
+
+    void compressLoop() {
+        Chunk* chunk;
+        while (chunks_.pop(chunk)) {
+            compressChunk(*chunk);
+            std::lock_guard<std::mutex> lock(pending_mutex_);
+            if (--pending_ == 0) pending_cv_.notify_all();
+        }
+    }
+
+    /*
+     * Compress the chunks in parallel and write them in order.
+     */
+    void writeChunks(std::vector<Chunk>& chunks) {
+        if (compression_level_ > 0) {
+            if (compressors_.empty()) {
+                for (auto& chunk : chunks) compressChunk(chunk);
+            } else {
+                {
+                    std::lock_guard<std::mutex> lock(pending_mutex_);
+                    pending_ += chunks.size();
+                }
+                for (auto& chunk : chunks) chunks_.push(&chunk);
+                std::unique_lock<std::mutex> lock(pending_mutex_);
+                pending_cv_.wait(lock, [this] { return pending_ == 0; });
+            }
+        }
+
+        for (auto& chunk : chunks) {
+            bool deflated = compression_level_ > 0 && chunk.filter_mask == 0;
+            const void* buf = deflated ? static_cast<const void*>(chunk.compressed.data()) : chunk.data;
+            std::size_t size = deflated ? chunk.compressed_size : chunk.size;
+#if H5_VERSION_GE(1, 10, 3)
+            check(H5Dwrite_chunk(chunk.dataset->id, H5P_DEFAULT, chunk.filter_mask,
+                                 chunk.offset.data(), size, buf), "write chunk");
+#else
+            check(H5DOwrite_chunk(chunk.dataset->id, H5P_DEFAULT, chunk.filter_mask,
+                                  chunk.offset.data(), size, buf), "write chunk");
+#endif
+        }
+    }
+
+    void writeTrain(std::map<std::string, kb_data>& data_pkg) {
+        uint64_t tid = trainId(data_pkg);
+
+        std::map<std::string, uint64_t> counts; // entries of the groups in this train
+        std::vector<Chunk> chunks;
+        for (auto& data : data_pkg) {
+            const std::string& source = data.first;
+            bool instrument = !data.second.array.empty();
+            std::string prefix = (instrument ? "INSTRUMENT/" : "CONTROL/") + source + "/";
+
+            for (auto& v : data.second.array) {
+                std::string key = indexKey(source, v.first, instrument);
+                hsize_t n = appendArray(prefix + toH5Path(v.first), v.second, key, chunks);
+                uint64_t& count = counts[key];
+                count = std::max<uint64_t>(count, n);
+            }
+
+            for (auto& v : data.second.msgpack_data) {
+                std::string key = indexKey(source, v.first, instrument);
+                std::string name = prefix + toH5Path(v.first) + (instrument ? "" : "/value");
+                if (appendScalar(name, v.second, key)) {
+                    uint64_t& count = counts[key];
+                    count = std::max<uint64_t>(count, 1);
+                }
+            }
+        }
+
+        writeChunks(chunks);
+
+        // including the groups which are missing in this train
+        for (auto& index : indices_) {
+            auto it = counts.find(index.first);
+            appendIndex(index.second, it != counts.end() ? it->second : 0);
+        }
+        for (auto& dataset : datasets_)
+            if (!dataset.second.index.empty()) pad(dataset.second, indices_.at(dataset.second.index).next);
+
+        auto it = datasets_.find("INDEX/trainId");
+        Dataset* dataset = it != datasets_.end() ? &it->second
+            : &createDataset("INDEX/trainId", H5T_NATIVE_UINT64, {}, std::vector<hsize_t>(1, 4096), false);
+        appendEntries(*dataset, &tid, 1);
+        ++n_trains_;
+
+        for (auto& d : datasets_) {
+            d.second.committed = d.second.dims[0];
+            d.second.created = false;
+        }
+        for (auto& index : indices_) {
+            index.second.committed = index.second.next;
+            index.second.created = false;
+        }
+    }
+
+    /*
+     * Undo a train which failed half way: truncate the datasets to the
+     * previous train and remove the ones the train created.
+     */
+    void rollback() {
+        for (auto it = indices_.begin(); it != indices_.end();) {
+            if (it->second.created) {
+                it = indices_.erase(it);
+            } else {
+                it->second.next = it->second.committed;
+                ++it;
+            }
+        }
+
+        for (auto it = datasets_.begin(); it != datasets_.end();) {
+            Dataset& dataset = it->second;
+            if (dataset.created) {
+                H5Dclose(dataset.id);
+                check(H5Ldelete(file_, it->first.c_str(), H5P_DEFAULT), "remove " + it->first);
+                it = datasets_.erase(it);
+            } else {
+                if (dataset.dims[0] != dataset.committed) {
+                    dataset.dims[0] = dataset.committed;
+                    check(H5Dset_extent(dataset.id, dataset.dims.data()), "truncate " + it->first);
+                }
+                ++it;
+            }
+        }
+    }
+
+    void writeLoop() {
+        std::map<std::string, kb_data> data_pkg;
+        while (trains_.pop(data_pkg)) {
+            if (poisoned_) {
+                ++dropped_;
+            } else {
+                try {
+                    writeTrain(data_pkg);
+                    ++written_;
+                } catch (...) {
+                    error_.capture();
+                    ++dropped_;
+                    try {
+                        rollback();
+                    } catch (...) {
+                        poisoned_ = true;
+                    }
+                }
+            }
+            data_pkg.clear(); // release the frames
+        }
+    }
+
+public:
+    /*
+     * Open a new file.
+     *
+     * compression_level: 0 (no compression) to 9
+     * n_threads: number of compressing threads, 0 to compress in the writer thread
+     * queue_capacity: maximum number of trains waiting to be written
+     *
+     * Exceptions:
+     * std::runtime_error if the file cannot be created
+     */
+    explicit Hdf5Writer(const std::string& filename, int compression_level = 1,
+                        std::size_t n_threads = std::thread::hardware_concurrency(),
+                        std::size_t queue_capacity = 16):
+        compression_level_(compression_level),
+        trains_(queue_capacity),
+        written_(0),
+        dropped_(0),
+        chunks_(4096) {
+
+        file_ = check_id(H5Fcreate(filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT),
+                         "create file " + filename);
+        lcpl_ = H5Pcreate(H5P_LINK_CREATE);
+        H5Pset_create_intermediate_group(lcpl_, 1);
+
+        for (std::size_t i = 0; i < n_threads; ++i)
+            compressors_.emplace_back(&Hdf5Writer::compressLoop, this);
+        writer_ = std::thread(&Hdf5Writer::writeLoop, this);
+    }
+
+    Hdf5Writer(const Hdf5Writer&) = delete;
+    Hdf5Writer& operator=(const Hdf5Writer&) = delete;
+
+    ~Hdf5Writer() {
+        try { close(); } catch (...) {}
+    }
+
+    /*
+     * Queue a train for writing without waiting for the disk.
+     *
+     * Return false if the write-behind queue is full, in which case the
+     * train is dropped.
+     *
+     * Exceptions:
+     * the error which happened while writing a previous train
+     */
+    bool write(std::map<std::string, kb_data>&& data_pkg) {
+        error_.rethrow();
+        if (trains_.try_push(std::move(data_pkg))) return true;
+        ++dropped_;
+        return false;
+    }
+
+    /*
+     * Write the queued trains and close the file.
+     *
+     * Exceptions:
+     * the error which happened while writing a previous train
+     */
+    void close() {
+        if (closed_) return;
+        closed_ = true;
+
+        trains_.close();
+        writer_.join();
+        chunks_.close();
+        for (auto& t : compressors_) t.join();
+
+        for (auto& dataset : datasets_) H5Dclose(dataset.second.id);
+        H5Pclose(lcpl_);
+        H5Fclose(file_);
+
+        error_.rethrow();
+    }
+
+    // number of trains written
+    std::size_t written() const { return written_; }
+
+    // number of trains dropped because the queue was full or writing failed
+    std::size_t dropped() const { return dropped_; }
+
+    // number of trains waiting to be written
+    std::size_t queued() const { return trains_.size(); }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_CPP_KB_HDF5_WRITER_HPP
@@ -0,0 +1,346 @@
+/*
+    Karabo bridge memory resources.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_CPP_KB_MEMORY_HPP
+#define KARABO_BRIDGE_CPP_KB_MEMORY_HPP
+
+#include <cstddef>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+namespace karabo_bridge {
+
+// alignment of the allocations when none is given
+const std::size_t max_alignment = alignof(long double);
+
+/*
+ * Source of memory for the containers of the client, after the
+ * std::pmr::memory_resource of C++17.
+ */
+class MemoryResource {
+protected:
+    virtual void* doAllocate(std::size_t bytes, std::size_t alignment) = 0;
+
+    virtual void doDeallocate(void* p, std::size_t bytes, std::size_t alignment) = 0;
+
+    virtual bool doIsEqual(const MemoryResource& other) const { return this == &other; }
+
+public:
+    virtual ~MemoryResource() = default;
+
+    void* allocate(std::size_t bytes, std::size_t alignment = max_alignment) {
+        return doAllocate(bytes, alignment);
+    }
+
+    void deallocate(void* p, std::size_t bytes, std::size_t alignment = max_alignment) {
+        doDeallocate(p, bytes, alignment);
+    }
+
+    // whether the memory allocated by one can be deallocated by the other
+    bool isEqual(const MemoryResource& other) const { return doIsEqual(other); }
+};
+
+/*
+ * The global operator new and delete.
+ */
+class NewDeleteResource : public MemoryResource {
+protected:
+    void* doAllocate(std::size_t bytes, std::size_t) override { return ::operator new(bytes); }
+
+    void doDeallocate(void* p, std::size_t, std::size_t) override { ::operator delete(p); }
+
+    bool doIsEqual(const MemoryResource& other) const override {
+        return dynamic_cast<const NewDeleteResource*>(&other) != nullptr;
+    }
+};
+
+MemoryResource* newDeleteResource() {
+    static NewDeleteResource resource;
+    return &resource;
+}
+
+// default resource of the calling thread
+MemoryResource*& defaultResourceRef() {
+    static thread_local MemoryResource* resource = nullptr;
+    return resource;
+}
+
+/*
+ * Return the resource used by the allocators constructed without one in
+ * the calling thread.
+ */
+MemoryResource* getDefaultResource() {
+    MemoryResource* resource = defaultResourceRef();
+    return resource ? resource : newDeleteResource();
+}
+
+/*
+ * Set the default resource of the calling thread and return the previous
+ * one. nullptr restores the global operator new and delete.
+ */
+MemoryResource* setDefaultResource(MemoryResource* resource) {
+    MemoryResource* previous = getDefaultResource();
+    defaultResourceRef() = resource;
+    return previous;
+}
+
+/*
+ * Use a resource as the default resource of the calling thread within a
+ * scope.
+ */
+class ScopedResource {
+    MemoryResource* previous_;
+
+public:
+    explicit ScopedResource(MemoryResource* resource): previous_(setDefaultResource(resource)) {}
+
+    ScopedResource(const ScopedResource&) = delete;
+    ScopedResource& operator=(const ScopedResource&) = delete;
+
+    ~ScopedResource() { setDefaultResource(previous_); }
+};
+
+/*
+ * Arena which hands out memory from growing chunks and frees it all at
+ * once, e.g. the containers of a train.
+ *
+ * deallocate() is a no-op. The memory is only given back by release() or
+ * by the destructor, so all the containers using it must be destroyed
+ * before. Not thread-safe.
+ */
+class MonotonicBufferResource : public MemoryResource {
+    MemoryResource* upstream_;
+    char* initial_; // buffer given by the user
+    std::size_t initial_size_;
+    std::size_t next_size_;
+
+    char* current_;
+    std::size_t space_;
+    std::vector<std::pair<void*, std::size_t>> chunks_; // allocated from upstream
+
+    void reset() {
+        current_ = initial_;
+        space_ = initial_size_;
+    }
+
+public:
+    explicit MonotonicBufferResource(std::size_t initial_size = 4096,
+                                     MemoryResource* upstream = getDefaultResource()):
+        upstream_(upstream), initial_(nullptr), initial_size_(0),
+        next_size_(std::max<std::size_t>(initial_size, 64)) {
+        reset();
+    }
+
+    MonotonicBufferResource(void* buffer, std::size_t size,
+                            MemoryResource* upstream = getDefaultResource()):
+        upstream_(upstream), initial_(static_cast<char*>(buffer)), initial_size_(size),
+        next_size_(std::max<std::size_t>(size, 64)) {
+        reset();
+    }
+
+    MonotonicBufferResource(const MonotonicBufferResource&) = delete;
+    MonotonicBufferResource& operator=(const MonotonicBufferResource&) = delete;
+
+protected:
+    void* doAllocate(std::size_t bytes, std::size_t alignment) override {
+        std::size_t padding = (alignment - reinterpret_cast<uintptr_t>(current_) % alignment) % alignment;
+        if (current_ == nullptr || padding + bytes > space_) {
+            std::size_t size = std::max(next_size_, bytes + alignment);
+            current_ = static_cast<char*>(upstream_->allocate(size));
+            space_ = size;
+            chunks_.emplace_back(current_, size);
+            next_size_ = size * 2;
+            padding = (alignment - reinterpret_cast<uintptr_t>(current_) % alignment) % alignment;
+        }
+        void* p = current_ + padding;
+        current_ += padding + bytes;
+        space_ -= padding + bytes;
+        return p;
+    }
+
+    void doDeallocate(void*, std::size_t, std::size_t) override {}
+
+public:
+    ~MonotonicBufferResource() override { release(); }
+
+    /*
+     * Free all the memory handed out. The chunks are given back to the
+     * upstream resource, and the memory of the initial buffer is reused.
+     */
+    void release() {
+        for (auto& chunk : chunks_) upstream_->deallocate(chunk.first, chunk.second);
+        chunks_.clear();
+        reset();
+    }
+
+    MemoryResource* upstream() const { return upstream_; }
+};
+
+/*
+ * Pool of fixed size blocks for the small allocations of node-based
+ * containers, e.g. to be set as the default resource of a worker thread.
+ * Larger allocations go to the upstream resource. Not thread-safe.
+ */
+class PoolResource : public MemoryResource {
+    static const std::size_t n_pools = 7; // blocks of 16, 32, ..., 1024 bytes
+    static const std::size_t min_block = 16;
+
+    struct Block { Block* next; };
+
+    MemoryResource* upstream_;
+    std::size_t chunk_size_;
+    Block* free_[n_pools];
+    std::vector<void*> chunks_;
+
+    static std::size_t poolIndex(std::size_t bytes) {
+        std::size_t index = 0;
+        std::size_t size = min_block;
+        while (size < bytes) {
+            size *= 2;
+            ++index;
+        }
+        return index;
+    }
+
+    void refill(std::size_t index) {
+        std::size_t block_size = min_block << index;
+        char* chunk = static_cast<char*>(upstream_->allocate(chunk_size_));
+        chunks_.push_back(chunk);
+        for (std::size_t offset = 0; offset + block_size <= chunk_size_; offset += block_size) {
+            Block* block = reinterpret_cast<Block*>(chunk + offset);
+            block->next = free_[index];
+            free_[index] = block;
+        }
+    }
+
+public:
+    explicit PoolResource(MemoryResource* upstream = getDefaultResource(), std::size_t chunk_size = 64 << 10):
+        upstream_(upstream), chunk_size_(std::max<std::size_t>(chunk_size, min_block << (n_pools - 1))) {
+        for (auto& f : free_) f = nullptr;
+    }
+
+    PoolResource(const PoolResource&) = delete;
+    PoolResource& operator=(const PoolResource&) = delete;
+
+protected:
+    void* doAllocate(std::size_t bytes, std::size_t alignment) override {
+        if (bytes > (min_block << (n_pools - 1)) || alignment > min_block)
+            return upstream_->allocate(bytes, alignment);
+
+        std::size_t index = poolIndex(bytes);
+        if (!free_[index]) refill(index);
+        Block* block = free_[index];
+        free_[index] = block->next;
+        return block;
+    }
+
+    void doDeallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+        if (bytes > (min_block << (n_pools - 1)) || alignment > min_block) {
+            upstream_->deallocate(p, bytes, alignment);
+            return;
+        }
+
+        std::size_t index = poolIndex(bytes);
+        Block* block = static_cast<Block*>(p);
+        block->next = free_[index];
+        free_[index] = block;
+    }
+
+public:
+    ~PoolResource() override { release(); }
+
+    // free all the blocks, whether they are in use or not
+    void release() {
+        for (auto chunk : chunks_) upstream_->deallocate(chunk, chunk_size_);
+        chunks_.clear();
+        for (auto& f : free_) f = nullptr;
+    }
+};
+
+/*
+ * Allocator which takes its memory from a MemoryResource, after the
+ * std::pmr::polymorphic_allocator of C++17.
+ *
+ * A default constructed allocator uses the default resource of the
+ * calling thread at the time of construction. Like std::pmr, the resource
+ * does not propagate on copy, move or swap of the containers.
+ */
+template <typename T>
+class PolymorphicAllocator {
+    MemoryResource* resource_;
+
+    template <typename U> friend class PolymorphicAllocator;
+
+public:
+    using value_type = T;
+    using pointer = T*;
+    using const_pointer = const T*;
+    using reference = T&;
+    using const_reference = const T&;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using propagate_on_container_copy_assignment = std::false_type;
+    using propagate_on_container_move_assignment = std::false_type;
+    using propagate_on_container_swap = std::false_type;
+
+    template <typename U>
+    struct rebind { using other = PolymorphicAllocator<U>; };
+
+    PolymorphicAllocator(): resource_(getDefaultResource()) {}
+
+    PolymorphicAllocator(MemoryResource* resource): resource_(resource) {}
+
+    template <typename U>
+    PolymorphicAllocator(const PolymorphicAllocator<U>& other): resource_(other.resource_) {}
+
+    T* allocate(std::size_t n) {
+        if (n > max_size()) throw std::bad_alloc();
+        return static_cast<T*>(resource_->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) { resource_->deallocate(p, n * sizeof(T), alignof(T)); }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args) { ::new(static_cast<void*>(p)) U(std::forward<Args>(args)...); }
+
+    template <typename U>
+    void destroy(U* p) { p->~U(); }
+
+    T* address(T& x) const { return &x; }
+
+    const T* address(const T& x) const { return &x; }
+
+    std::size_t max_size() const { return std::numeric_limits<std::size_t>::max() / sizeof(T); }
+
+    // containers copied from this one use the default resource
+    PolymorphicAllocator select_on_container_copy_construction() const { return PolymorphicAllocator(); }
+
+    MemoryResource* resource() const { return resource_; }
+};
+
+template <typename T, typename U>
+bool operator==(const PolymorphicAllocator<T>& a, const PolymorphicAllocator<U>& b) {
+    return a.resource() == b.resource() || a.resource()->isEqual(*b.resource());
+}
+
+template <typename T, typename U>
+bool operator!=(const PolymorphicAllocator<T>& a, const PolymorphicAllocator<U>& b) {
+    return !(a == b);
+}
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_CPP_KB_MEMORY_HPP
@@ -0,0 +1,547 @@
+/*
+    Karabo bridge processing pipeline.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_CPP_KB_PIPELINE_HPP
+#define KARABO_BRIDGE_CPP_KB_PIPELINE_HPP
+
+#include "kb_client.hpp"
+#include "kb_queue.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+
+namespace karabo_bridge {
+
+/*
+ * What a stage does when the queue of the next stage is full.
+ */
+enum class DropPolicy {
+    block, // wait, i.e. slow down the upstream stages (backpressure)
+    drop_newest, // drop the item being pushed
+    drop_oldest // drop the oldest item in the queue
+};
+
+/*
+ * Deadline of a stage relative to the arrival of the train, i.e. the time
+ * the source produced the item.
+ *
+ * An optional sink (e.g. preview generation) skips the items which it
+ * would finish after the deadline, as estimated from its mean time, so
+ * that one slow train does not leave a backlog behind. Only a sink can be
+ * optional, since skipping an item in a processing stage would drop it for
+ * the following stages. A stage function can also degrade its work itself
+ * according to timeLeft().
+ */
+struct Deadline {
+    std::chrono::milliseconds after_arrival; // zero for none
+    bool optional;
+
+    Deadline(std::chrono::milliseconds after_arrival = std::chrono::milliseconds::zero(),
+             bool optional = false):
+        after_arrival(after_arrival), optional(optional) {}
+};
+
+// deadline of the item being processed by the calling thread
+std::chrono::steady_clock::time_point& currentDeadline() {
+    static thread_local std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    return deadline;
+}
+
+/*
+ * Return the time left before the deadline of the item being processed by
+ * the calling stage function, or a negative duration if it has passed.
+ * Without a deadline, it is std::chrono::steady_clock::duration::max().
+ */
+std::chrono::steady_clock::duration timeLeft() {
+    std::chrono::steady_clock::time_point deadline = currentDeadline();
+    if (deadline == std::chrono::steady_clock::time_point::max()) return std::chrono::steady_clock::duration::max();
+    return deadline - std::chrono::steady_clock::now();
+}
+
+class Pipeline;
+
+// pipeline of the stage run by the calling thread
+Pipeline*& currentPipeline() {
+    static thread_local Pipeline* pipeline = nullptr;
+    return pipeline;
+}
+
+/*
+ * Return whether the pipeline running the calling stage function was
+ * stopped, so that a source which waits for its input can give up (see
+ * receiveFrom). False outside of a pipeline.
+ */
+bool stopRequested();
+
+struct StageStats {
+    std::string name;
+    std::size_t n_threads;
+    std::size_t processed; // items returned by the stage function
+    std::size_t filtered; // items for which the stage function returned false
+    std::size_t dropped; // items dropped at the input queue
+    std::size_t queued; // items waiting in the input queue
+    std::size_t missed; // items finished after the deadline
+    std::size_t skipped; // items skipped by an optional sink to meet the deadline
+    double busy; // seconds spent in the stage function by all the threads
+    double max; // longest call of the stage function in seconds
+
+    // average time of a call in seconds
+    double mean() const {
+        return processed + filtered > 0 ? busy / (processed + filtered) : 0.;
+    }
+};
+
+/*
+ * Bounded queue in front of a stage. The items carry the arrival time of
+ * their train.
+ */
+template <typename T>
+class Channel {
+    struct Stamped {
+        T item;
+        std::chrono::steady_clock::time_point arrival;
+    };
+
+    BoundedQueue<Stamped> queue_;
+    DropPolicy policy_;
+    std::atomic<std::size_t> dropped_;
+
+public:
+    Channel(std::size_t capacity, DropPolicy policy):
+        queue_(capacity), policy_(policy), dropped_(0) {}
+
+    void put(T&& item, std::chrono::steady_clock::time_point arrival) {
+        Stamped stamped{std::move(item), arrival};
+        bool ok;
+        if (policy_ == DropPolicy::block) ok = queue_.push(std::move(stamped));
+        else if (policy_ == DropPolicy::drop_newest) ok = queue_.try_push(std::move(stamped));
+        else ok = queue_.push_overwrite(std::move(stamped));
+        if (!ok) ++dropped_;
+    }
+
+    bool get(T& item, std::chrono::steady_clock::time_point& arrival) {
+        Stamped stamped;
+        if (!queue_.pop(stamped)) return false;
+        item = std::move(stamped.item);
+        arrival = stamped.arrival;
+        return true;
+    }
+
+    void close() { queue_.close(); }
+
+    std::size_t dropped() const { return dropped_; }
+
+    std::size_t size() const { return queue_.size(); }
+};
+
+/*
+ * A stage runs its function in n_threads threads. When all of them have
+ * returned, the input queue of the next stage is closed so that the
+ * pipeline drains from the source to the sink.
+ */
+class StageBase {
+    std::string name_;
+    std::size_t n_threads_;
+    std::vector<std::thread> threads_;
+    std::atomic<std::size_t> active_;
+
+    std::atomic<std::size_t> processed_;
+    std::atomic<std::size_t> filtered_;
+    std::atomic<uint64_t> busy_ns_;
+    std::atomic<uint64_t> max_ns_;
+
+    Deadline deadline_;
+    std::atomic<std::size_t> missed_;
+    std::atomic<std::size_t> skipped_;
+
+    std::chrono::steady_clock::time_point deadlineOf(std::chrono::steady_clock::time_point arrival) const {
+        if (deadline_.after_arrival == std::chrono::milliseconds::zero() ||
+                arrival == std::chrono::steady_clock::time_point::max())
+            return std::chrono::steady_clock::time_point::max();
+        return arrival + deadline_.after_arrival;
+    }
+
+protected:
+    Pipeline* pipeline_ = nullptr;
+
+    // run the stage function and account for it
+    template <typename F>
+    bool timed(F func, std::chrono::steady_clock::time_point arrival = std::chrono::steady_clock::time_point::max()) {
+        std::chrono::steady_clock::time_point deadline = deadlineOf(arrival);
+        currentDeadline() = deadline;
+        auto t0 = std::chrono::steady_clock::now();
+        bool ok = func();
+        auto t1 = std::chrono::steady_clock::now();
+        currentDeadline() = std::chrono::steady_clock::time_point::max();
+
+        auto dt = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+        busy_ns_ += dt;
+        uint64_t max = max_ns_;
+        while (dt > max && !max_ns_.compare_exchange_weak(max, dt)) {}
+        if (ok) ++processed_;
+        else ++filtered_;
+        if (t1 > deadline) ++missed_;
+        return ok;
+    }
+
+    // whether an optional sink skips an item which it would finish late,
+    // the first item is processed to measure the time
+    bool skip(std::chrono::steady_clock::time_point arrival) {
+        if (!deadline_.optional) return false;
+        std::chrono::steady_clock::time_point deadline = deadlineOf(arrival);
+        std::size_t n = processed_ + filtered_;
+        if (deadline == std::chrono::steady_clock::time_point::max() || n == 0) return false;
+
+        std::chrono::nanoseconds mean(busy_ns_ / n);
+        if (std::chrono::steady_clock::now() + mean <= deadline) return false;
+        ++skipped_;
+        return true;
+    }
+
+    virtual void loop() = 0;
+
+    // called once all the threads have returned
+    virtual void finish() {}
+
+    // called when a thread stops because of an exception, so that the
+    // previous stage does not wait for it
+    virtual void closeInput() {}
+
+    virtual std::size_t dropped() const { return 0; }
+
+    virtual std::size_t queued() const { return 0; }
+
+public:
+    StageBase(const std::string& name, std::size_t n_threads):
+        name_(name),
+        n_threads_(std::max<std::size_t>(n_threads, 1)),
+        active_(0),
+        processed_(0),
+        filtered_(0),
+        busy_ns_(0),
+        max_ns_(0),
+        missed_(0),
+        skipped_(0) {}
+
+    StageBase(const StageBase&) = delete;
+    StageBase& operator=(const StageBase&) = delete;
+
+    virtual ~StageBase() = default;
+
+    void start(Pipeline* pipeline);
+
+    void setDeadline(const Deadline& deadline) { deadline_ = deadline; }
+
+    void join() {
+        for (auto& t : threads_) t.join();
+        threads_.clear();
+    }
+
+    StageStats stats() const {
+        StageStats s;
+        s.name = name_;
+        s.n_threads = n_threads_;
+        s.processed = processed_;
+        s.filtered = filtered_;
+        s.dropped = dropped();
+        s.queued = queued();
+        s.missed = missed_;
+        s.skipped = skipped_;
+        s.busy = busy_ns_ * 1e-9;
+        s.max = max_ns_ * 1e-9;
+        return s;
+    }
+};
+
+/*
+ * Output of a stage, connected to the input queue of the next stage when
+ * the latter is appended.
+ */
+template <typename T>
+class StageOutput {
+protected:
+    std::shared_ptr<Channel<T>> output_;
+
+public:
+    void connect(std::shared_ptr<Channel<T>> channel) { output_ = std::move(channel); }
+};
+
+template <typename T> class PipelineBuilder;
+
+/*
+ * A chain of stages: a source, processing stages and a sink, connected by
+ * bounded queues.
+ *
+ * A stage with several threads does not keep the order of the items. An
+ * exception thrown by a stage function stops the source and is rethrown
+ * by wait().
+ *
+ * e.g.
+ *
+ * auto pipeline = karabo_bridge::Pipeline::source<karabo_bridge::MultipartMsg>(
+ *         "receive", karabo_bridge::receiveFrom(client))
+ *     .then<std::map<std::string, karabo_bridge::kb_data>>("decode", karabo_bridge::decodeTrain, 2)
+ *     .then<Result>("reduce", reduce, 4)
+ *     .sink("publish", publish);
+ * pipeline->start();
+ */
+class Pipeline {
+    std::vector<std::unique_ptr<StageBase>> stages_;
+    std::atomic<bool> running_;
+    WorkerError error_;
+
+    template <typename T> friend class PipelineBuilder;
+
+public:
+    Pipeline(): running_(false) {}
+
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+
+    ~Pipeline() {
+        stop();
+        for (auto& stage : stages_) stage->join();
+    }
+
+    /*
+     * Begin a pipeline with a source, which fills in an item and returns
+     * true, or returns false at the end of the stream. The source runs in
+     * a single thread.
+     */
+    template <typename T>
+    static PipelineBuilder<T> source(const std::string& name, std::function<bool(T&)> func);
+
+    void start() {
+        running_ = true;
+        for (auto& stage : stages_) stage->start(this);
+    }
+
+    /*
+     * Stop the source after the current item, or while it waits for one
+     * if it checks stopRequested(). The items in the pipeline are still
+     * processed.
+     */
+    void stop() { running_ = false; }
+
+    bool running() const { return running_; }
+
+    /*
+     * Wait until all the items have gone through the pipeline.
+     *
+     * Exceptions:
+     * the first exception thrown by a stage function
+     */
+    void wait() {
+        for (auto& stage : stages_) stage->join();
+        error_.rethrow();
+    }
+
+    // record the first exception thrown by a stage function and stop
+    void fail(std::exception_ptr error) {
+        error_.capture(error);
+        stop();
+    }
+
+    std::vector<StageStats> stats() const {
+        std::vector<StageStats> s;
+        for (auto& stage : stages_) s.push_back(stage->stats());
+        return s;
+    }
+};
+
+bool stopRequested() {
+    Pipeline* pipeline = currentPipeline();
+    return pipeline != nullptr && !pipeline->running();
+}
+
+void StageBase::start(Pipeline* pipeline) {
+    pipeline_ = pipeline;
+    active_ = n_threads_;
+    for (std::size_t i = 0; i < n_threads_; ++i) {
+        threads_.emplace_back([this] {
+            currentPipeline() = pipeline_;
+            try {
+                loop();
+            } catch (...) {
+                pipeline_->fail(std::current_exception());
+                closeInput();
+            }
+            if (--active_ == 0) finish();
+        });
+    }
+}
+
+template <typename Out>
+class SourceStage : public StageBase, public StageOutput<Out> {
+    std::function<bool(Out&)> func_;
+
+    void loop() override {
+        while (pipeline_->running()) {
+            Out item;
+            if (!timed([&] { return func_(item); })) break;
+            this->output_->put(std::move(item), std::chrono::steady_clock::now());
+        }
+    }
+
+    void finish() override { this->output_->close(); }
+
+public:
+    SourceStage(const std::string& name, std::function<bool(Out&)> func):
+        StageBase(name, 1), func_(std::move(func)) {}
+};
+
+template <typename In, typename Out>
+class Stage : public StageBase, public StageOutput<Out> {
+    std::function<bool(In&, Out&)> func_;
+    std::shared_ptr<Channel<In>> input_;
+
+    void loop() override {
+        In in;
+        std::chrono::steady_clock::time_point arrival;
+        while (input_->get(in, arrival)) {
+            Out out;
+            if (timed([&] { return func_(in, out); }, arrival))
+                this->output_->put(std::move(out), arrival);
+            in = In(); // release the input
+        }
+    }
+
+    void finish() override { this->output_->close(); }
+
+    void closeInput() override { input_->close(); }
+
+    std::size_t dropped() const override { return input_->dropped(); }
+
+    std::size_t queued() const override { return input_->size(); }
+
+public:
+    Stage(const std::string& name, std::size_t n_threads, std::function<bool(In&, Out&)> func,
+          std::shared_ptr<Channel<In>> input):
+        StageBase(name, n_threads), func_(std::move(func)), input_(std::move(input)) {}
+};
+
+template <typename In>
+class SinkStage : public StageBase {
+    std::function<void(In&)> func_;
+    std::shared_ptr<Channel<In>> input_;
+
+    void loop() override {
+        In in;
+        std::chrono::steady_clock::time_point arrival;
+        while (input_->get(in, arrival)) {
+            if (!skip(arrival)) timed([&] { func_(in); return true; }, arrival);
+            in = In(); // release the input
+        }
+    }
+
+    void closeInput() override { input_->close(); }
+
+    std::size_t dropped() const override { return input_->dropped(); }
+
+    std::size_t queued() const override { return input_->size(); }
+
+public:
+    SinkStage(const std::string& name, std::size_t n_threads, std::function<void(In&)> func,
+              std::shared_ptr<Channel<In>> input):
+        StageBase(name, n_threads), func_(std::move(func)), input_(std::move(input)) {}
+};
+
+/*
+ * Append stages to a pipeline whose last stage produces T.
+ */
+template <typename T>
+class PipelineBuilder {
+    std::unique_ptr<Pipeline> pipeline_;
+    StageOutput<T>* last_;
+
+public:
+    PipelineBuilder(std::unique_ptr<Pipeline> pipeline, StageOutput<T>* last):
+        pipeline_(std::move(pipeline)), last_(last) {}
+
+    /*
+     * Append a stage which turns an item into another one and returns true,
+     * or returns false to drop the item.
+     *
+     * n_threads: number of threads running func
+     * capacity: capacity of the input queue of the stage
+     * policy: what the previous stage does when the input queue is full
+     * deadline: deadline of the stage relative to the arrival of the train
+     *
+     * Exceptions:
+     * std::invalid_argument if the deadline is optional, which only a sink
+     * can be
+     */
+    template <typename U>
+    PipelineBuilder<U> then(const std::string& name, std::function<bool(T&, U&)> func,
+                            std::size_t n_threads = 1, std::size_t capacity = 4,
+                            DropPolicy policy = DropPolicy::block, const Deadline& deadline = Deadline()) {
+        if (deadline.optional) throw std::invalid_argument("Only the sink can have an optional deadline!");
+        auto input = std::make_shared<Channel<T>>(capacity, policy);
+        last_->connect(input);
+        auto stage = new Stage<T, U>(name, n_threads, std::move(func), input);
+        stage->setDeadline(deadline);
+        pipeline_->stages_.emplace_back(stage);
+        return PipelineBuilder<U>(std::move(pipeline_), stage);
+    }
+
+    /*
+     * Append the last stage and return the pipeline.
+     */
+    std::unique_ptr<Pipeline> sink(const std::string& name, std::function<void(T&)> func,
+                                   std::size_t n_threads = 1, std::size_t capacity = 4,
+                                   DropPolicy policy = DropPolicy::block, const Deadline& deadline = Deadline()) {
+        auto input = std::make_shared<Channel<T>>(capacity, policy);
+        last_->connect(input);
+        auto stage = new SinkStage<T>(name, n_threads, std::move(func), input);
+        stage->setDeadline(deadline);
+        pipeline_->stages_.emplace_back(stage);
+        return std::move(pipeline_);
+    }
+};
+
+template <typename T>
+PipelineBuilder<T> Pipeline::source(const std::string& name, std::function<bool(T&)> func) {
+    std::unique_ptr<Pipeline> pipeline(new Pipeline());
+    auto stage = new SourceStage<T>(name, std::move(func));
+    pipeline->stages_.emplace_back(stage);
+    return PipelineBuilder<T>(std::move(pipeline), stage);
+}
+
+/*
+ * Source which receives the trains from a client. It checks every poll_ms
+ * whether the pipeline was stopped, so that stop() and the destructor of
+ * the pipeline do not wait for a server which sends nothing.
+ */
+std::function<bool(MultipartMsg&)> receiveFrom(Client& client, int poll_ms = 100) {
+    return [&client, poll_ms](MultipartMsg& train) {
+        while (!client.tryNextMultipartMsg(train, poll_ms)) {
+            if (stopRequested()) return false;
+        }
+        return true;
+    };
+}
+
+/*
+ * Stage function which decodes a train.
+ */
+bool decodeTrain(MultipartMsg& train, std::map<std::string, kb_data>& data_pkg) {
+    data_pkg = decodeMultipartMsg(train);
+    return true;
+}
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_CPP_KB_PIPELINE_HPP
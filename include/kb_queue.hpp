@@ -0,0 +1,195 @@
+/*
+    Karabo bridge queue.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_CPP_KB_QUEUE_HPP
+#define KARABO_BRIDGE_CPP_KB_QUEUE_HPP
+
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+
+
+namespace karabo_bridge {
+
+/*
+ * A bounded multi-producer multi-consumer queue.
+ *
+ * Once closed, push fails and pop drains the remaining items.
+ */
+template <typename T>
+class BoundedQueue {
+    std::deque<T> queue_;
+    std::size_t capacity_;
+    bool closed_ = false;
+
+    mutable std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+
+public:
+    /*
+     * Exceptions:
+     * std::invalid_argument if the capacity is 0
+     */
+    explicit BoundedQueue(std::size_t capacity): capacity_(capacity) {
+        if (capacity == 0) throw std::invalid_argument("The capacity must be positive!");
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    /*
+     * Push an item, waiting for a free slot if the queue is full.
+     *
+     * Return false if the queue is closed.
+     */
+    bool push(T&& item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this] { return closed_ || queue_.size() < capacity_; });
+        if (closed_) return false;
+        queue_.push_back(std::move(item));
+        lock.unlock();
+        not_empty_.notify_one();
+        return true;
+    }
+
+    /*
+     * Push an item, waiting at most timeout for a free slot if the queue is
+     * full.
+     *
+     * Return false if the queue is still full or closed. The item is left
+     * untouched in this case.
+     */
+    template <typename Rep, typename Period>
+    bool push_for(T&& item, const std::chrono::duration<Rep, Period>& timeout) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!not_full_.wait_for(lock, timeout, [this] { return closed_ || queue_.size() < capacity_; }) || closed_)
+            return false;
+        queue_.push_back(std::move(item));
+        lock.unlock();
+        not_empty_.notify_one();
+        return true;
+    }
+
+    /*
+     * Push an item without waiting.
+     *
+     * Return false if the queue is full or closed. The item is left
+     * untouched in this case.
+     */
+    bool try_push(T&& item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (closed_ || queue_.size() >= capacity_) return false;
+        queue_.push_back(std::move(item));
+        lock.unlock();
+        not_empty_.notify_one();
+        return true;
+    }
+
+    /*
+     * Push an item without waiting, dropping the oldest item if the queue
+     * is full.
+     *
+     * Return false if an item was dropped or the queue is closed.
+     */
+    bool push_overwrite(T&& item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (closed_) return false;
+        bool full = queue_.size() >= capacity_;
+        if (full) queue_.pop_front();
+        queue_.push_back(std::move(item));
+        lock.unlock();
+        not_empty_.notify_one();
+        return !full;
+    }
+
+    /*
+     * Pop an item, waiting for one if the queue is empty.
+     *
+     * Return false if the queue is closed and empty.
+     */
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return closed_ || !queue_.empty(); });
+        if (queue_.empty()) return false;
+        item = std::move(queue_.front());
+        queue_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+        return true;
+    }
+
+    /*
+     * Pop an item without waiting.
+     *
+     * Return false if the queue is empty.
+     */
+    bool try_pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (queue_.empty()) return false;
+        item = std::move(queue_.front());
+        queue_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+
+    bool closed() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return closed_;
+    }
+
+    std::size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return queue_.size();
+    }
+
+    std::size_t capacity() const { return capacity_; }
+};
+
+/*
+ * The first exception thrown by the worker threads of an object, rethrown
+ * once by the thread which uses the object.
+ */
+class WorkerError {
+    std::exception_ptr error_;
+    std::mutex mutex_;
+
+public:
+    // keep an exception, e.g. the one being handled, unless one is kept
+    void capture(std::exception_ptr error = std::current_exception()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!error_) error_ = error;
+    }
+
+    // rethrow the exception kept, if any, and forget it
+    void rethrow() {
+        std::exception_ptr error;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::swap(error, error_);
+        }
+        if (error) std::rethrow_exception(error);
+    }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_CPP_KB_QUEUE_HPP
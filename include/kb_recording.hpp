@@ -0,0 +1,579 @@
+/*
+    Karabo bridge recording.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_CPP_KB_RECORDING_HPP
+#define KARABO_BRIDGE_CPP_KB_RECORDING_HPP
+
+#include "kb_client.hpp"
+#include "kb_async_writer.hpp"
+#include "kb_queue.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <atomic>
+#include <functional>
+#include <set>
+#include <thread>
+#include <tuple>
+
+
+namespace karabo_bridge {
+
+/*
+ * A recording holds the raw multipart messages as they were received:
+ *
+ *     file header: "KBRECORD", uint32 version, uint32 reserved
+ *     train record: uint32 "KBTR", uint32 number of frames, uint64 train ID,
+ *                   uint64 record size, (uint64 offset, uint64 size) of each
+ *                   frame relative to the record, frames
+ *     ...
+ *     index: uint32 "KBIX", uint32 number of names, uint64 number of trains,
+ *            uint64 number of sources, uint64 size of the names,
+ *            RecordIndexTrain sorted by train ID, RecordIndexSource,
+ *            null-terminated source names
+ *     footer: uint64 offset of the index, "KBINDEX\0"
+ *
+ * The frames of a record follow each other without padding. The received
+ * frames are not aligned in memory, so that they are copied into the
+ * aligned buffers of the AsyncFileWriter anyway.
+ *
+ * The index is written when the recording is closed. A recording without
+ * index (e.g. an interrupted one) is indexed by scanning it when opened.
+ */
+const char record_file_magic[8] = {'K', 'B', 'R', 'E', 'C', 'O', 'R', 'D'};
+const char record_footer_magic[8] = {'K', 'B', 'I', 'N', 'D', 'E', 'X', '\0'};
+const uint32_t record_version = 1;
+const uint32_t record_train_magic = 0x5254424B; // "KBTR"
+const uint32_t record_index_magic = 0x5849424B; // "KBIX"
+const std::size_t record_file_header_size = 16;
+const std::size_t record_header_size = 24;
+const std::size_t record_index_header_size = 32;
+const std::size_t record_footer_size = 16;
+
+struct RecordIndexTrain {
+    uint64_t train_id;
+    uint64_t offset; // of the record in the file
+    uint32_t first_source; // in the source entries
+    uint32_t n_sources;
+};
+
+/*
+ * Frames [first_frame, first_frame + n_frames) of a record belong to
+ * the source.
+ */
+struct RecordIndexSource {
+    uint32_t source; // in the source names
+    uint32_t first_frame;
+    uint32_t n_frames;
+};
+
+/*
+ * Return the sources of a train as (source, first frame, number of frames)
+ * from the header frames.
+ */
+template <typename HeaderAt>
+std::vector<std::tuple<std::string, uint32_t, uint32_t>> recordSources(std::size_t n_frames,
+                                                                       HeaderAt header_at) {
+    std::vector<std::tuple<std::string, uint32_t, uint32_t>> sources;
+    for (std::size_t i = 0; i + 1 < n_frames; i += 2) {
+        const zmq::message_t& header = header_at(i);
+        msgpack::object_handle oh;
+        msgpack::unpack(oh, static_cast<const char*>(header.data()), header.size());
+        auto source = oh.get().as<MsgObjectMap>().at("source").as<std::string>();
+        auto n = static_cast<uint32_t>(i);
+        if (!sources.empty() && std::get<0>(sources.back()) == source)
+            std::get<2>(sources.back()) += 2;
+        else
+            sources.emplace_back(source, n, 2);
+    }
+    return sources;
+}
+
+/*
+ * Collect the index entries of a recording.
+ */
+class RecordIndexBuilder {
+    std::vector<RecordIndexTrain> trains_;
+    std::vector<RecordIndexSource> sources_;
+    std::vector<std::string> names_;
+    std::map<std::string, uint32_t> name_ids_;
+
+public:
+    void add(uint64_t train_id, uint64_t offset,
+             const std::vector<std::tuple<std::string, uint32_t, uint32_t>>& sources) {
+        RecordIndexTrain train = {train_id, offset, static_cast<uint32_t>(sources_.size()),
+                                  static_cast<uint32_t>(sources.size())};
+        trains_.push_back(train);
+        for (auto& s : sources) {
+            auto it = name_ids_.find(std::get<0>(s));
+            if (it == name_ids_.end()) {
+                it = name_ids_.emplace(std::get<0>(s), static_cast<uint32_t>(names_.size())).first;
+                names_.push_back(std::get<0>(s));
+            }
+            RecordIndexSource source = {it->second, std::get<1>(s), std::get<2>(s)};
+            sources_.push_back(source);
+        }
+    }
+
+    // sort the trains by train ID, keeping the order of duplicates
+    void sort() {
+        std::stable_sort(trains_.begin(), trains_.end(),
+                         [](const RecordIndexTrain& a, const RecordIndexTrain& b) {
+                             return a.train_id < b.train_id; });
+    }
+
+    std::vector<RecordIndexTrain>& trains() { return trains_; }
+    std::vector<RecordIndexSource>& sources() { return sources_; }
+    std::vector<std::string>& names() { return names_; }
+};
+
+/*
+ * Record trains into a file in the background (see AsyncFileWriter).
+ */
+class RecordWriter {
+    AsyncFileWriter file_;
+    RecordIndexBuilder index_;
+    std::size_t written_ = 0;
+    bool closed_ = false;
+
+    void writeIndex() {
+        static const char zeros[8] = {0};
+        std::size_t pad = (8 - file_.offset() % 8) % 8;
+        if (pad > 0) file_.write(zeros, pad);
+        uint64_t index_offset = file_.offset();
+
+        index_.sort();
+        auto& trains = index_.trains();
+        auto& sources = index_.sources();
+        std::string names;
+        for (auto& name : index_.names()) names.append(name.c_str(), name.size() + 1);
+
+        char header[record_index_header_size];
+        auto n_names = static_cast<uint32_t>(index_.names().size());
+        uint64_t n_trains = trains.size();
+        uint64_t n_sources = sources.size();
+        uint64_t names_size = names.size();
+        memcpy(header, &record_index_magic, 4);
+        memcpy(header + 4, &n_names, 4);
+        memcpy(header + 8, &n_trains, 8);
+        memcpy(header + 16, &n_sources, 8);
+        memcpy(header + 24, &names_size, 8);
+        file_.write(header, sizeof header);
+        if (n_trains) file_.write(trains.data(), n_trains * sizeof(RecordIndexTrain));
+        if (n_sources) file_.write(sources.data(), n_sources * sizeof(RecordIndexSource));
+        if (names_size) file_.write(names.data(), names.size());
+        pad = (8 - file_.offset() % 8) % 8;
+        if (pad > 0) file_.write(zeros, pad);
+
+        char footer[record_footer_size];
+        memcpy(footer, &index_offset, 8);
+        memcpy(footer + 8, record_footer_magic, 8);
+        file_.write(footer, sizeof footer);
+    }
+
+public:
+    /*
+     * Exceptions:
+     * std::runtime_error if the file cannot be created
+     */
+    explicit RecordWriter(const std::string& path, std::size_t n_buffers = 8,
+                          std::size_t buffer_size = 4 << 20):
+        file_(path, n_buffers, buffer_size) {
+        char header[record_file_header_size] = {0};
+        memcpy(header, record_file_magic, sizeof record_file_magic);
+        memcpy(header + 8, &record_version, sizeof record_version);
+        file_.write(header, sizeof header);
+    }
+
+    RecordWriter(const RecordWriter&) = delete;
+    RecordWriter& operator=(const RecordWriter&) = delete;
+
+    ~RecordWriter() {
+        try { close(); } catch (...) {}
+    }
+
+    /*
+     * Append a train. The frames are moved into the writer and released
+     * once they are on disk.
+     *
+     * Return the offset of the record in the file.
+     *
+     * Exceptions:
+     * std::runtime_error if writing fails
+     */
+    uint64_t write(MultipartMsg&& train) {
+        uint64_t train_id = 0;
+        try {
+            train_id = trainId(train);
+        } catch (std::out_of_range&) {}
+
+        // lay out the record
+        uint64_t start = file_.offset();
+        uint64_t pos = start + record_header_size + 16 * train.size();
+        std::vector<uint64_t> table;
+        for (auto& frame : train) {
+            table.push_back(pos - start);
+            table.push_back(frame.size());
+            pos += frame.size();
+        }
+
+        index_.add(train_id, start, recordSources(train.size(), [&train](std::size_t i)
+            -> const zmq::message_t& { return train[i]; }));
+
+        char header[record_header_size];
+        auto n_frames = static_cast<uint32_t>(train.size());
+        uint64_t record_size = pos - start;
+        memcpy(header, &record_train_magic, 4);
+        memcpy(header + 4, &n_frames, 4);
+        memcpy(header + 8, &train_id, 8);
+        memcpy(header + 16, &record_size, 8);
+        file_.write(header, sizeof header);
+        if (!table.empty()) file_.write(table.data(), table.size() * sizeof(uint64_t));
+
+        for (auto& frame : train) file_.write(std::move(frame));
+        train.clear();
+
+        ++written_;
+        return start;
+    }
+
+    // number of trains written
+    std::size_t written() const { return written_; }
+
+    /*
+     * Write the index and close the file.
+     *
+     * Exceptions:
+     * std::runtime_error if writing fails
+     */
+    void close() {
+        if (closed_) return;
+        closed_ = true;
+        try {
+            writeIndex();
+        } catch (...) {
+            try { file_.close(); } catch (...) {}
+            throw;
+        }
+        file_.close();
+    }
+};
+
+/*
+ * Read the trains of a recording.
+ *
+ * The trains are indexed by train ID: next() returns them in the order of
+ * their train IDs, starting from the position set by seek(), and read()
+ * gives random access to them. read() can be called concurrently.
+ */
+class RecordReader {
+    int fd_;
+    uint64_t size_;
+
+    // index, either mapped from the file or built by scanning it
+    void* map_ = nullptr;
+    std::size_t map_size_ = 0;
+    const RecordIndexTrain* trains_ = nullptr;
+    const RecordIndexSource* sources_ = nullptr;
+    std::size_t n_trains_ = 0;
+    std::vector<std::string> names_;
+    RecordIndexBuilder scanned_;
+
+    std::size_t cursor_ = 0; // position of the next train in the index
+
+    void readAt(void* buf, std::size_t size, uint64_t offset) const {
+        auto ptr = static_cast<char*>(buf);
+        while (size > 0) {
+            ssize_t n = ::pread(fd_, ptr, size, static_cast<off_t>(offset));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) throw std::runtime_error("Failed to read the recording!");
+            ptr += n;
+            offset += n;
+            size -= n;
+        }
+    }
+
+    /*
+     * Read the header and the frame table of the record at the given offset.
+     *
+     * Return false if there is no record at this offset, or if its size
+     * does not cover its header and frame table, so that a scan stops at a
+     * corrupted record as at a truncated one.
+     */
+    bool readRecordHeader(uint64_t offset, uint64_t& train_id, uint64_t& record_size,
+                          std::vector<uint64_t>& table) const {
+        char header[record_header_size];
+        readAt(header, sizeof header, offset);
+        uint32_t magic, n_frames;
+        memcpy(&magic, header, 4);
+        memcpy(&n_frames, header + 4, 4);
+        memcpy(&train_id, header + 8, 8);
+        memcpy(&record_size, header + 16, 8);
+        if (magic != record_train_magic) return false;
+        if (record_size < record_header_size + 2 * sizeof(uint64_t) * n_frames) return false;
+
+        table.resize(2 * n_frames);
+        if (n_frames) readAt(table.data(), table.size() * sizeof(uint64_t), offset + record_header_size);
+        return true;
+    }
+
+    void readFrame(uint64_t offset, const std::vector<uint64_t>& table, std::size_t i,
+                   MultipartMsg& train) const {
+        // read straight into the message
+        zmq::message_t frame(table[2 * i + 1]);
+        if (frame.size()) readAt(frame.data(), frame.size(), offset + table[2 * i]);
+        train.emplace_back(std::move(frame));
+    }
+
+    bool loadIndex() {
+        if (size_ < record_file_header_size + record_footer_size) return false;
+        char footer[record_footer_size];
+        readAt(footer, sizeof footer, size_ - record_footer_size);
+        if (memcmp(footer + 8, record_footer_magic, sizeof record_footer_magic) != 0) return false;
+        uint64_t index_offset;
+        memcpy(&index_offset, footer, 8);
+        // the offset is read from the file: compare without adding to it
+        if (index_offset < record_file_header_size || index_offset > size_ - record_footer_size ||
+                size_ - record_footer_size - index_offset < record_index_header_size) return false;
+
+        // map from the page containing the index to the end of the file
+        auto page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+        uint64_t map_offset = index_offset / page * page;
+        std::size_t map_size = size_ - map_offset;
+        void* map = ::mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd_, static_cast<off_t>(map_offset));
+        if (map == MAP_FAILED) return false;
+        const char* index = static_cast<const char*>(map) + (index_offset - map_offset);
+
+        uint32_t magic, n_names;
+        uint64_t n_trains, n_sources, names_size;
+        memcpy(&magic, index, 4);
+        memcpy(&n_names, index + 4, 4);
+        memcpy(&n_trains, index + 8, 8);
+        memcpy(&n_sources, index + 16, 8);
+        memcpy(&names_size, index + 24, 8);
+        // check each count against the space left before multiplying, so
+        // that a corrupt count cannot wrap around
+        uint64_t space = size_ - record_footer_size - index_offset - record_index_header_size;
+        bool valid = magic == record_index_magic && n_trains <= space / sizeof(RecordIndexTrain);
+        if (valid) {
+            space -= n_trains * sizeof(RecordIndexTrain);
+            valid = n_sources <= space / sizeof(RecordIndexSource) &&
+                    names_size <= space - n_sources * sizeof(RecordIndexSource);
+        }
+        if (!valid) {
+            ::munmap(map, map_size);
+            return false;
+        }
+
+        map_ = map;
+        map_size_ = map_size;
+        index += record_index_header_size;
+        trains_ = reinterpret_cast<const RecordIndexTrain*>(index);
+        n_trains_ = n_trains;
+        index += n_trains * sizeof(RecordIndexTrain);
+        sources_ = reinterpret_cast<const RecordIndexSource*>(index);
+        index += n_sources * sizeof(RecordIndexSource);
+        const char* end = index + names_size;
+        for (uint32_t i = 0; i < n_names && index < end; ++i) {
+            names_.emplace_back(index);
+            index += names_.back().size() + 1;
+        }
+        return true;
+    }
+
+    void scanIndex() {
+        uint64_t offset = record_file_header_size;
+        uint64_t train_id, record_size;
+        std::vector<uint64_t> table;
+        MultipartMsg headers;
+        while (offset + record_header_size <= size_) {
+            // stop at the index or at a truncated record
+            if (!readRecordHeader(offset, train_id, record_size, table) ||
+                    offset + record_size > size_) break;
+
+            headers.clear();
+            std::size_t n_frames = table.size() / 2;
+            for (std::size_t i = 0; i < n_frames; ++i) {
+                if (i % 2 == 0) readFrame(offset, table, i, headers);
+                else headers.emplace_back();
+            }
+            scanned_.add(train_id, offset, recordSources(n_frames, [&headers](std::size_t i)
+                -> const zmq::message_t& { return headers[i]; }));
+
+            offset += record_size;
+        }
+
+        scanned_.sort();
+        trains_ = scanned_.trains().data();
+        n_trains_ = scanned_.trains().size();
+        sources_ = scanned_.sources().data();
+        names_ = scanned_.names();
+    }
+
+public:
+    /*
+     * Exceptions:
+     * std::runtime_error if the file is not a recording
+     */
+    explicit RecordReader(const std::string& path) {
+        fd_ = ::open(path.c_str(), O_RDONLY);
+        if (fd_ < 0) throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+        size_ = static_cast<uint64_t>(::lseek(fd_, 0, SEEK_END));
+
+        try {
+            char header[record_file_header_size] = {0};
+            if (size_ >= record_file_header_size) readAt(header, sizeof header, 0);
+            if (memcmp(header, record_file_magic, sizeof record_file_magic) != 0)
+                throw std::runtime_error(path + " is not a recording!");
+            if (!loadIndex()) scanIndex();
+        } catch (...) {
+            ::close(fd_);
+            throw;
+        }
+    }
+
+    RecordReader(const RecordReader&) = delete;
+    RecordReader& operator=(const RecordReader&) = delete;
+
+    ~RecordReader() {
+        if (map_) ::munmap(map_, map_size_);
+        ::close(fd_);
+    }
+
+    // number of trains
+    std::size_t size() const { return n_trains_; }
+
+    // train ID of the i-th train in the index
+    uint64_t trainIdAt(std::size_t i) const { return trains_[i].train_id; }
+
+    // names of the sources in the recording
+    const std::vector<std::string>& sources() const { return names_; }
+
+    /*
+     * Return the position in the index of the first train whose train ID
+     * is not less than the given one.
+     */
+    std::size_t find(uint64_t train_id) const {
+        return std::lower_bound(trains_, trains_ + n_trains_, train_id,
+                                [](const RecordIndexTrain& t, uint64_t tid) {
+                                    return t.train_id < tid; }) - trains_;
+    }
+
+    /*
+     * Return the positions [first, last) in the index of the trains with
+     * t0 <= train ID < t1.
+     */
+    std::pair<std::size_t, std::size_t> range(uint64_t t0, uint64_t t1) const {
+        std::size_t first = find(t0);
+        return std::make_pair(first, std::max(first, find(t1)));
+    }
+
+    /*
+     * Move to the first train whose train ID is not less than the given one.
+     *
+     * Return true if a train with this train ID exists.
+     */
+    bool seek(uint64_t train_id) {
+        cursor_ = find(train_id);
+        return cursor_ < n_trains_ && trains_[cursor_].train_id == train_id;
+    }
+
+    /*
+     * Read the i-th train of the index. If sources is given, only the
+     * frames of these sources are read.
+     *
+     * Exceptions:
+     * std::out_of_range if i is out of range
+     * std::runtime_error if the recording is corrupted
+     */
+    void read(std::size_t i, MultipartMsg& train, const std::set<std::string>* sources = nullptr) const {
+        if (i >= n_trains_) throw std::out_of_range("Train index out of range!");
+        const RecordIndexTrain& entry = trains_[i];
+
+        uint64_t train_id, record_size;
+        std::vector<uint64_t> table;
+        if (!readRecordHeader(entry.offset, train_id, record_size, table))
+            throw std::runtime_error("Corrupted recording!");
+
+        train.clear();
+        if (sources == nullptr) {
+            for (std::size_t j = 0; j < table.size() / 2; ++j) readFrame(entry.offset, table, j, train);
+            return;
+        }
+        for (uint32_t s = entry.first_source; s < entry.first_source + entry.n_sources; ++s) {
+            const RecordIndexSource& source = sources_[s];
+            if (sources->count(names_.at(source.source)) == 0) continue;
+            for (uint32_t j = source.first_frame; j < source.first_frame + source.n_frames; ++j)
+                readFrame(entry.offset, table, j, train);
+        }
+    }
+
+    /*
+     * Read the next train. Return false at the end of the recording.
+     *
+     * Exceptions:
+     * std::runtime_error if the recording is corrupted
+     */
+    bool next(MultipartMsg& train, uint64_t* train_id = nullptr) {
+        if (cursor_ >= n_trains_) return false;
+        if (train_id) *train_id = trains_[cursor_].train_id;
+        read(cursor_++, train);
+        return true;
+    }
+
+    // go back to the first train
+    void rewind() { cursor_ = 0; }
+
+    /*
+     * Call func(train, train ID) for every train with t0 <= train ID < t1,
+     * reading in n_threads threads which each get a contiguous part of the
+     * range. func is called concurrently.
+     *
+     * Exceptions:
+     * the first exception thrown by func or by reading
+     */
+    void forEach(uint64_t t0, uint64_t t1, std::function<void(MultipartMsg&, uint64_t)> func,
+                 unsigned n_threads = std::thread::hardware_concurrency(),
+                 const std::set<std::string>* sources = nullptr) const {
+        auto positions = range(t0, t1);
+        std::size_t n = positions.second - positions.first;
+        if (n_threads == 0) n_threads = 1;
+        if (n_threads > n) n_threads = static_cast<unsigned>(n);
+
+        WorkerError error;
+        std::atomic<bool> failed(false);
+        auto work = [&](std::size_t first, std::size_t last) {
+            try {
+                MultipartMsg train;
+                for (std::size_t i = first; i < last && !failed; ++i) {
+                    read(i, train, sources);
+                    func(train, trains_[i].train_id);
+                }
+            } catch (...) {
+                error.capture();
+                failed = true;
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned k = 0; k < n_threads; ++k) {
+            threads.emplace_back(work, positions.first + n * k / n_threads,
+                                 positions.first + n * (k + 1) / n_threads);
+        }
+        for (auto& t : threads) t.join();
+        error.rethrow();
+    }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_CPP_KB_RECORDING_HPP
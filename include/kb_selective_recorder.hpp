@@ -0,0 +1,175 @@
+/*
+    Karabo bridge selective recorder.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_CPP_KB_SELECTIVE_RECORDER_HPP
+#define KARABO_BRIDGE_CPP_KB_SELECTIVE_RECORDER_HPP
+
+#include "kb_client.hpp"
+#include "kb_server.hpp"
+#include "kb_queue.hpp"
+#include "kb_recording.hpp"
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+
+namespace karabo_bridge {
+
+/*
+ * Record the trains, or the pulses of the trains, which pass a filter.
+ *
+ * The filter is called on the decoded train by a pool of worker threads,
+ * so that push() only queues the train. It returns whether the train is
+ * kept and may fill in a selection (see SourceSelection), e.g. the pulses
+ * with a hit, in which case only the selected data are recorded. Note that
+ * the sources which are not in a non-empty selection are dropped.
+ *
+ * The frames of rejected trains are released as soon as the filter has
+ * returned.
+ */
+class SelectiveRecorder {
+public:
+    using Filter = std::function<bool(std::map<std::string, kb_data>&, Selection&)>;
+    using Predicate = std::function<bool(std::map<std::string, kb_data>&)>;
+
+private:
+    Filter filter_;
+    RecordWriter writer_;
+    std::mutex writer_mutex_;
+
+    BoundedQueue<MultipartMsg> trains_;
+    std::vector<std::thread> workers_;
+
+    std::atomic<std::size_t> recorded_;
+    std::atomic<std::size_t> rejected_;
+    std::atomic<std::size_t> dropped_;
+    WorkerError error_;
+    bool closed_ = false;
+
+    void workLoop() {
+        MultipartMsg train;
+        MultipartMsg shared;
+        while (trains_.pop(train)) {
+            try {
+                shared.clear();
+                shareMultipartMsg(train, shared);
+                auto data_pkg = decodeMultipartMsg(shared);
+                Selection selection;
+                bool keep = filter_(data_pkg, selection);
+                data_pkg.clear();
+
+                if (!keep) {
+                    train.clear(); // release the frames
+                    ++rejected_;
+                    continue;
+                }
+
+                if (!selection.empty()) train = applySelection(train, selection);
+                std::lock_guard<std::mutex> lock(writer_mutex_);
+                writer_.write(std::move(train));
+                ++recorded_;
+            } catch (...) {
+                error_.capture();
+                ++dropped_;
+            }
+            train.clear();
+        }
+    }
+
+public:
+    /*
+     * path: path of the recording
+     * n_threads: number of threads calling the filter
+     * queue_capacity: maximum number of trains waiting to be filtered
+     *
+     * Exceptions:
+     * std::runtime_error if the recording cannot be created
+     */
+    SelectiveRecorder(const std::string& path, Filter filter,
+                      std::size_t n_threads = std::thread::hardware_concurrency(),
+                      std::size_t queue_capacity = 64):
+        filter_(std::move(filter)),
+        writer_(path),
+        trains_(queue_capacity),
+        recorded_(0),
+        rejected_(0),
+        dropped_(0) {
+        for (std::size_t i = 0; i < std::max<std::size_t>(n_threads, 1); ++i)
+            workers_.emplace_back(&SelectiveRecorder::workLoop, this);
+    }
+
+    // filter which keeps whole trains
+    static Filter trainFilter(Predicate predicate) {
+        return [predicate](std::map<std::string, kb_data>& data_pkg, Selection&) {
+            return predicate(data_pkg); };
+    }
+
+    SelectiveRecorder(const SelectiveRecorder&) = delete;
+    SelectiveRecorder& operator=(const SelectiveRecorder&) = delete;
+
+    ~SelectiveRecorder() {
+        try { close(); } catch (...) {}
+    }
+
+    /*
+     * Queue a train for filtering without waiting.
+     *
+     * Return false if the queue is full, in which case the train is
+     * dropped.
+     *
+     * Exceptions:
+     * the error which happened while filtering or recording a previous train
+     */
+    bool push(MultipartMsg&& train) {
+        error_.rethrow();
+        if (trains_.try_push(std::move(train))) return true;
+        ++dropped_;
+        return false;
+    }
+
+    /*
+     * Filter the queued trains and close the recording.
+     *
+     * Exceptions:
+     * the error which happened while filtering or recording a train
+     */
+    void close() {
+        if (closed_) return;
+        closed_ = true;
+
+        trains_.close();
+        for (auto& t : workers_) t.join();
+        try {
+            writer_.close();
+        } catch (...) {
+            error_.capture();
+        }
+        error_.rethrow();
+    }
+
+    // number of trains recorded
+    std::size_t recorded() const { return recorded_; }
+
+    // number of trains rejected by the filter
+    std::size_t rejected() const { return rejected_; }
+
+    // number of trains dropped because the queue was full or an error occurred
+    std::size_t dropped() const { return dropped_; }
+
+    // number of trains waiting to be filtered
+    std::size_t queued() const { return trains_.size(); }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_CPP_KB_SELECTIVE_RECORDER_HPP
@@ -0,0 +1,472 @@
+/*
+    Karabo bridge server.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_CPP_KB_SERVER_HPP
+#define KARABO_BRIDGE_CPP_KB_SERVER_HPP
+
+#include "kb_client.hpp"
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <functional>
+
+
+namespace karabo_bridge {
+
+// extensions of the protocol understood by Server
+const std::vector<std::string> server_extensions = {"selection", "batch"};
+
+/*
+ * A request received by the server.
+ */
+struct Request {
+    Selection selection; // empty for a plain "next"
+    std::size_t count = 1; // number of trains wanted
+};
+
+/*
+ * Parse a plain "next" or an extended request (see packRequest).
+ *
+ * Exceptions:
+ * std::runtime_error if the request is neither of them
+ */
+Request parseRequest(const zmq::message_t& msg) {
+    Request request;
+    if (msg.size() == 4 && memcmp(msg.data(), "next", 4) == 0) return request;
+
+    msgpack::object_handle oh;
+    msgpack::unpack(oh, static_cast<const char*>(msg.data()), msg.size());
+    if (oh.get().type != msgpack::type::object_type::MAP)
+        throw std::runtime_error("Unknown request!");
+    auto request_unpacked = oh.get().as<MsgObjectMap>();
+
+    auto it = request_unpacked.find("request");
+    if (it == request_unpacked.end() || it->second.as<std::string>() != "next")
+        throw std::runtime_error("Unknown request!");
+
+    it = request_unpacked.find("count");
+    if (it != request_unpacked.end())
+        request.count = std::max<std::size_t>(it->second.as<uint64_t>(), 1);
+
+    it = request_unpacked.find("sources");
+    if (it == request_unpacked.end()) return request;
+    for (auto& src : it->second.as<MsgObjectMap>()) {
+        auto src_unpacked = src.second.as<MsgObjectMap>();
+        SourceSelection src_selection;
+
+        auto sit = src_unpacked.find("paths");
+        if (sit != src_unpacked.end())
+            src_selection.paths = sit->second.as<std::vector<std::string>>();
+
+        sit = src_unpacked.find("pulses");
+        if (sit != src_unpacked.end())
+            src_selection.pulses = sit->second.as<std::vector<unsigned int>>();
+
+        sit = src_unpacked.find("roi");
+        if (sit != src_unpacked.end()) {
+            auto roi = sit->second.as<std::vector<unsigned int>>();
+            if (roi.size() != src_selection.roi.size())
+                throw std::runtime_error("ROI must be (y, x, height, width)!");
+            std::copy(roi.begin(), roi.end(), src_selection.roi.begin());
+        }
+
+        request.selection.insert(std::make_pair(src.first, std::move(src_selection)));
+    }
+
+    return request;
+}
+
+/*
+ * Pack a header, optionally with a new shape and the advertised extensions.
+ */
+zmq::message_t packHeader(const MsgObjectMap& header,
+                          const std::vector<unsigned int>* shape = nullptr,
+                          const std::vector<std::string>* extensions = nullptr) {
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> packer(&buffer);
+
+    bool advertise = extensions && !header.count("kb_extensions");
+    packer.pack_map(header.size() + (advertise ? 1 : 0));
+    for (auto& kv : header) {
+        packer.pack(kv.first);
+        if (shape && kv.first == "shape") packer.pack(*shape);
+        else packer.pack(kv.second);
+    }
+    if (advertise) {
+        packer.pack(std::string("kb_extensions"));
+        packer.pack(*extensions);
+    }
+
+    return zmq::message_t(buffer.data(), buffer.size());
+}
+
+/*
+ * Pack the header of a batch reply (see splitBatch).
+ */
+zmq::message_t packBatchHeader(const std::deque<MultipartMsg>& trains) {
+    std::vector<uint64_t> frames;
+    for (auto& train : trains) frames.push_back(train.size());
+
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> packer(&buffer);
+    packer.pack_map(2);
+    packer.pack(std::string("content"));
+    packer.pack(std::string("batch"));
+    packer.pack(std::string("frames"));
+    packer.pack(frames);
+
+    return zmq::message_t(buffer.data(), buffer.size());
+}
+
+/*
+ * Append the (header, data) pair of a msgpack map to a train.
+ *
+ * The data is a map of flattened paths, e.g. "metadata.timestamp.tid", to
+ * values which is packed by the caller.
+ */
+void appendMsgpackData(MultipartMsg& train, const std::string& source, const msgpack::sbuffer& data) {
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> packer(&buffer);
+    packer.pack_map(2);
+    packer.pack(std::string("source"));
+    packer.pack(source);
+    packer.pack(std::string("content"));
+    packer.pack(std::string("msgpack"));
+
+    train.emplace_back(zmq::message_t(buffer.data(), buffer.size()));
+    train.emplace_back(zmq::message_t(data.data(), data.size()));
+}
+
+/*
+ * Append the (header, data) pair of an array to a train.
+ *
+ * The data message is moved into the train without copying the array.
+ */
+void appendArray(MultipartMsg& train, const std::string& source, const std::string& path,
+                 const std::vector<unsigned int>& shape, const std::string& dtype,
+                 zmq::message_t&& data) {
+    // python type strings are used on the wire
+    std::string py_dtype(dtype);
+    if (py_dtype == "float") py_dtype = "float32";
+    else if (py_dtype == "double") py_dtype = "float64";
+    else if (py_dtype.size() > 2 && py_dtype.compare(py_dtype.size() - 2, 2, "_t") == 0)
+        py_dtype.erase(py_dtype.size() - 2);
+
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> packer(&buffer);
+    packer.pack_map(5);
+    packer.pack(std::string("source"));
+    packer.pack(source);
+    packer.pack(std::string("content"));
+    packer.pack(std::string("array"));
+    packer.pack(std::string("path"));
+    packer.pack(path);
+    packer.pack(std::string("dtype"));
+    packer.pack(py_dtype);
+    packer.pack(std::string("shape"));
+    packer.pack(shape);
+
+    train.emplace_back(zmq::message_t(buffer.data(), buffer.size()));
+    train.emplace_back(std::move(data));
+}
+
+/*
+ * Append the (header, data) pair of an array to a train by copying the data.
+ */
+void appendArray(MultipartMsg& train, const std::string& source, const std::string& path,
+                 const std::vector<unsigned int>& shape, const std::string& dtype,
+                 const void* data) {
+    std::size_t nbytes = dtype_size(dtype);
+    for (auto v : shape) nbytes *= v;
+    appendArray(train, source, path, shape, dtype, zmq::message_t(data, nbytes));
+}
+
+/*
+ * Gather the selected pulses and ROI of an array into a new message.
+ *
+ * The shape is updated in place.
+ */
+zmq::message_t sliceArray(const zmq::message_t& data, std::vector<unsigned int>& shape,
+                          std::size_t itemsize, const SourceSelection& selection) {
+    std::size_t ndim = shape.size();
+
+    // view the array as (outer, mid, rows, cols)
+    std::size_t outer = 1, mid = 1, rows = 1, cols = 1;
+    if (ndim == 1) {
+        outer = shape[0];
+    } else if (ndim == 2) {
+        rows = shape[0];
+        cols = shape[1];
+    } else if (ndim > 2) {
+        outer = shape[0];
+        for (std::size_t i = 1; i < ndim - 2; ++i) mid *= shape[i];
+        rows = shape[ndim - 2];
+        cols = shape[ndim - 1];
+    }
+
+    std::vector<std::size_t> outer_indices;
+    if (ndim != 2 && !selection.pulses.empty()) {
+        for (auto p : selection.pulses)
+            if (p < outer) outer_indices.push_back(p);
+    } else {
+        for (std::size_t i = 0; i < outer; ++i) outer_indices.push_back(i);
+    }
+
+    std::size_t row0 = 0, nrows = rows, col0 = 0, ncols = cols;
+    if (ndim >= 2 && selection.hasRoi()) {
+        row0 = std::min<std::size_t>(selection.roi[0], rows);
+        col0 = std::min<std::size_t>(selection.roi[1], cols);
+        nrows = std::min<std::size_t>(selection.roi[2], rows - row0);
+        ncols = std::min<std::size_t>(selection.roi[3], cols - col0);
+    }
+
+    std::size_t expected = outer * mid * rows * cols * itemsize;
+    if (ndim == 0 || data.size() != expected)
+        throw std::runtime_error("Array size does not match its shape!");
+
+    zmq::message_t sliced(outer_indices.size() * mid * nrows * ncols * itemsize);
+    auto src = static_cast<const char*>(data.data());
+    auto dst = static_cast<char*>(sliced.data());
+    std::size_t row_bytes = ncols * itemsize;
+    for (auto o : outer_indices) {
+        for (std::size_t m = 0; m < mid; ++m) {
+            for (std::size_t r = row0; r < row0 + nrows; ++r) {
+                memcpy(dst, src + (((o * mid + m) * rows + r) * cols + col0) * itemsize, row_bytes);
+                dst += row_bytes;
+            }
+        }
+    }
+
+    if (ndim == 1) {
+        shape[0] = static_cast<unsigned int>(outer_indices.size());
+    } else {
+        if (ndim > 2) shape[0] = static_cast<unsigned int>(outer_indices.size());
+        shape[ndim - 2] = static_cast<unsigned int>(nrows);
+        shape[ndim - 1] = static_cast<unsigned int>(ncols);
+    }
+
+    return sliced;
+}
+
+/*
+ * Apply a selection to a train.
+ *
+ * Unchanged frames are shared with the original train instead of being
+ * copied. The extensions, if given, are advertised in the first header.
+ */
+MultipartMsg applySelection(const MultipartMsg& train, const Selection& selection,
+                            const std::vector<std::string>* extensions = nullptr) {
+    MultipartMsg selected;
+    if (train.size() % 2)
+        throw std::runtime_error("The multipart message is expected to "
+                                 "contain (header, data) pairs!");
+
+    for (auto it = train.begin(); it != train.end(); std::advance(it, 2)) {
+        const zmq::message_t& header = *it;
+        const zmq::message_t& data = *std::next(it);
+
+        bool first = selected.empty();
+        if (selection.empty() && !(first && extensions)) {
+            selected.emplace_back();
+            selected.back().copy(&header);
+            selected.emplace_back();
+            selected.back().copy(&data);
+            continue;
+        }
+
+        msgpack::object_handle oh_header;
+        msgpack::unpack(oh_header, static_cast<const char*>(header.data()), header.size());
+        auto header_unpacked = oh_header.get().as<MsgObjectMap>();
+
+        const SourceSelection* src_selection = nullptr;
+        if (!selection.empty()) {
+            auto sit = selection.find(header_unpacked.at("source").as<std::string>());
+            if (sit == selection.end()) continue;
+            src_selection = &sit->second;
+        }
+
+        auto content = header_unpacked.at("content").as<std::string>();
+        if (content == "msgpack") {
+            if (src_selection && !src_selection->paths.empty()) {
+                msgpack::object_handle oh_data;
+                msgpack::unpack(oh_data, static_cast<const char*>(data.data()), data.size());
+                auto data_unpacked = oh_data.get().as<MsgObjectMap>();
+
+                std::size_t n = 0;
+                for (auto& dt : data_unpacked)
+                    if (src_selection->hasPath(dt.first)) ++n;
+
+                msgpack::sbuffer buffer;
+                msgpack::packer<msgpack::sbuffer> packer(&buffer);
+                packer.pack_map(n);
+                for (auto& dt : data_unpacked) {
+                    if (!src_selection->hasPath(dt.first)) continue;
+                    packer.pack(dt.first);
+                    packer.pack(dt.second);
+                }
+
+                selected.emplace_back(packHeader(header_unpacked, nullptr, first ? extensions : nullptr));
+                selected.emplace_back(buffer.data(), buffer.size());
+            } else {
+                selected.emplace_back(packHeader(header_unpacked, nullptr, first ? extensions : nullptr));
+                selected.emplace_back();
+                selected.back().copy(&data);
+            }
+
+        } else if (content == "array" || content == "ImageData") {
+            if (src_selection && !src_selection->hasPath(header_unpacked.at("path").as<std::string>()))
+                continue;
+
+            if (src_selection && (!src_selection->pulses.empty() || src_selection->hasRoi())) {
+                auto shape = header_unpacked.at("shape").as<std::vector<unsigned int>>();
+                auto itemsize = dtype_size(header_unpacked.at("dtype").as<std::string>());
+                zmq::message_t sliced = sliceArray(data, shape, itemsize, *src_selection);
+                selected.emplace_back(packHeader(header_unpacked, &shape, first ? extensions : nullptr));
+                selected.emplace_back(std::move(sliced));
+            } else {
+                selected.emplace_back(packHeader(header_unpacked, nullptr, first ? extensions : nullptr));
+                selected.emplace_back();
+                selected.back().copy(&data);
+            }
+
+        } else {
+            throw std::runtime_error("Unknown data content: " + content);
+        }
+    }
+
+    return selected;
+}
+
+/*
+ * Karabo-bridge Server class.
+ *
+ * It replies to both plain "next" requests and extended requests which
+ * carry a selection. In the latter case, only the selected data is
+ * serialized and sent.
+ */
+class Server {
+    zmq::context_t ctx_;
+    zmq::socket_t socket_;
+    std::size_t max_batch_ = 64; // maximum number of trains in a reply
+
+    /*
+     * Send a multipart message to the client.
+     */
+    void sendMultipartMsg(MultipartMsg& mpmsg) {
+        for (std::size_t i = 0; i < mpmsg.size(); ++i)
+            socket_.send(mpmsg[i], i + 1 < mpmsg.size() ? ZMQ_SNDMORE : 0);
+    }
+
+public:
+    Server(): ctx_(1), socket_(ctx_, ZMQ_REP) {}
+
+    /*
+     * Bind to an endpoint and return the endpoint bound, which differs if
+     * the system chose the port, e.g. for "tcp://127.0.0.1:*".
+     */
+    std::string bind(const std::string& endpoint) {
+        std::cout << "Binding server to: " << endpoint << std::endl;
+        socket_.bind(endpoint.c_str());
+
+        char bound[256];
+        std::size_t size = sizeof bound;
+        socket_.getsockopt(ZMQ_LAST_ENDPOINT, bound, &size);
+        return std::string(bound);
+    }
+
+    /*
+     * Wait at most timeout_ms for a request and return whether one came,
+     * e.g. to stop serving between requests.
+     */
+    bool poll(long timeout_ms) {
+        zmq::pollitem_t item = {static_cast<void*>(socket_), 0, ZMQ_POLLIN, 0};
+        zmq::poll(&item, 1, timeout_ms);
+        return (item.revents & ZMQ_POLLIN) != 0;
+    }
+
+    /*
+     * Wait for a request and reply with the given train.
+     *
+     * The frames of the train are shared, not copied, so the same train can
+     * be served several times.
+     *
+     * Exceptions:
+     * std::runtime_error if the request is unknown
+     */
+    void serve(const MultipartMsg& train) {
+        zmq::message_t msg;
+        socket_.recv(&msg);
+        Request request = parseRequest(msg);
+
+        MultipartMsg reply = applySelection(train, request.selection, &server_extensions);
+        sendMultipartMsg(reply);
+    }
+
+    /*
+     * Wait for a request and reply with as many trains as requested, up to
+     * the maximum batch size, taken from a source which returns false when
+     * it has no more trains, e.g. a replay.
+     *
+     * Several trains are sent in one batch reply. Return the number of
+     * trains sent: if it is 0, the reply is an empty batch.
+     * Client::nextMultipartMsgs stops there, but a client which does not
+     * know the batch extension, e.g. Client::next, gets the lone batch
+     * header as a train and fails to decode it.
+     *
+     * Exceptions:
+     * std::runtime_error if the request is unknown
+     */
+    std::size_t serve(const std::function<bool(MultipartMsg&)>& source) {
+        zmq::message_t msg;
+        socket_.recv(&msg);
+        Request request = parseRequest(msg);
+
+        std::deque<MultipartMsg> trains;
+        std::size_t count = std::min(request.count, max_batch_);
+        while (trains.size() < count) {
+            MultipartMsg train;
+            if (!source(train)) break;
+            trains.push_back(applySelection(train, request.selection, &server_extensions));
+        }
+
+        if (trains.size() == 1 && request.count == 1) {
+            sendMultipartMsg(trains.front());
+            return 1;
+        }
+
+        zmq::message_t header = packBatchHeader(trains);
+        bool more = !trains.empty();
+        socket_.send(header, more ? ZMQ_SNDMORE : 0);
+        for (std::size_t i = 0; i < trains.size(); ++i) {
+            MultipartMsg& train = trains[i];
+            for (std::size_t j = 0; j < train.size(); ++j) {
+                bool last = i + 1 == trains.size() && j + 1 == train.size();
+                socket_.send(train[j], last ? 0 : ZMQ_SNDMORE);
+            }
+        }
+        return trains.size();
+    }
+
+    /*
+     * Set the maximum number of trains sent in one reply.
+     *
+     * Exceptions:
+     * std::invalid_argument if it is 0
+     */
+    void setMaxBatch(std::size_t max_batch) {
+        if (max_batch == 0) throw std::invalid_argument("The maximum batch size must be positive!");
+        max_batch_ = max_batch;
+    }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_CPP_KB_SERVER_HPP
@@ -0,0 +1,418 @@
+/*
+    Karabo bridge shared memory bus.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_CPP_KB_SHM_BUS_HPP
+#define KARABO_BRIDGE_CPP_KB_SHM_BUS_HPP
+
+#include "kb_client.hpp"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <memory>
+
+
+namespace karabo_bridge {
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "The shared memory bus requires lock-free atomics");
+static_assert(sizeof(pid_t) == 4, "The shared memory bus stores the process IDs as int32");
+
+/*
+ * Layout of the shared memory object:
+ *
+ *     ShmBusHeader, ShmBusSlot * n_slots, data of the slots
+ *
+ * The data of a slot is a table of (uint64 offset, uint64 size) per frame,
+ * relative to the slot, followed by the frames, each aligned to
+ * shm_bus_alignment bytes.
+ */
+const char shm_bus_magic[8] = {'K', 'B', 'S', 'H', 'M', 'B', 'U', 'S'};
+const uint32_t shm_bus_version = 2;
+const std::size_t shm_bus_alignment = 64;
+// maximum number of readers holding the same train
+const std::size_t shm_bus_max_holders = 32;
+
+struct ShmBusHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_slots;
+    uint64_t slot_size;
+    uint64_t data_offset;
+    std::atomic<uint64_t> write_seq; // sequence number of the last train published
+    std::atomic<uint32_t> notify; // futex incremented for every train published
+};
+
+struct ShmBusSlot {
+    std::atomic<uint64_t> seq; // sequence number of the train, 0 while being written
+    uint32_t n_frames;
+    uint64_t train_id;
+    std::atomic<int32_t> holders[shm_bus_max_holders]; // process IDs of the readers holding the train, 0 if free
+};
+
+/*
+ * A shared memory mapping, kept alive by the frames pointing into it.
+ */
+class ShmMapping {
+    void* addr_ = nullptr;
+    std::size_t size_ = 0;
+
+public:
+    ShmMapping(int fd, std::size_t size): size_(size) {
+        addr_ = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr_ == MAP_FAILED)
+            throw std::runtime_error(std::string("Failed to map the shared memory: ") + strerror(errno));
+    }
+
+    ShmMapping(const ShmMapping&) = delete;
+    ShmMapping& operator=(const ShmMapping&) = delete;
+
+    ~ShmMapping() { ::munmap(addr_, size_); }
+
+    char* data() const { return static_cast<char*>(addr_); }
+
+    std::size_t size() const { return size_; }
+
+    ShmBusHeader* header() const { return reinterpret_cast<ShmBusHeader*>(addr_); }
+
+    ShmBusSlot* slot(std::size_t i) const {
+        return reinterpret_cast<ShmBusSlot*>(data() + sizeof(ShmBusHeader)) + i;
+    }
+
+    char* slotData(std::size_t i) const {
+        return data() + header()->data_offset + i * header()->slot_size;
+    }
+};
+
+std::size_t shmBusAligned(std::size_t n) {
+    return (n + shm_bus_alignment - 1) / shm_bus_alignment * shm_bus_alignment;
+}
+
+/*
+ * Publish trains to the readers on the same node through a ring of slots
+ * in a POSIX shared memory object (e.g. "/trains", at /dev/shm/trains).
+ *
+ * The writer never waits for the readers: a slot which is still held by a
+ * reader is skipped, and a train is dropped if all the slots are held. A
+ * reader which falls behind by more than the number of slots misses trains.
+ *
+ * Every hold records the process ID of the reader, so that the writer
+ * reclaims the slots held by the readers which died without releasing them.
+ * The readers must therefore run in the same PID namespace as the writer.
+ *
+ * The shared memory object is removed when the writer is destroyed.
+ */
+class ShmBusWriter {
+    std::string name_;
+    std::unique_ptr<ShmMapping> map_;
+    std::size_t cursor_ = 0; // next slot to write
+    uint64_t seq_ = 0;
+    std::size_t published_ = 0;
+    std::size_t dropped_ = 0;
+    std::size_t reclaimed_ = 0;
+
+    // whether no reader holds the slot, after reclaiming the holds of the dead readers
+    bool unheld(ShmBusSlot* slot) {
+        bool held = false;
+        for (auto& holder : slot->holders) {
+            int32_t pid = holder.load();
+            if (pid == 0) continue;
+            if (::kill(pid, 0) < 0 && errno == ESRCH && holder.compare_exchange_strong(pid, 0)) {
+                ++reclaimed_;
+                continue;
+            }
+            held = true;
+        }
+        return !held;
+    }
+
+public:
+    /*
+     * Exceptions:
+     * std::runtime_error if the shared memory object cannot be created
+     */
+    ShmBusWriter(const std::string& name, std::size_t n_slots, std::size_t slot_size):
+        name_(name) {
+        if (n_slots == 0) throw std::invalid_argument("At least one slot is required!");
+        slot_size = shmBusAligned(slot_size);
+        std::size_t data_offset = shmBusAligned(sizeof(ShmBusHeader) + n_slots * sizeof(ShmBusSlot));
+        std::size_t size = data_offset + n_slots * slot_size;
+
+        int fd = ::shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if (fd < 0)
+            throw std::runtime_error("Failed to create the shared memory " + name + ": " + strerror(errno));
+        if (::ftruncate(fd, static_cast<off_t>(size)) < 0) {
+            ::close(fd);
+            ::shm_unlink(name.c_str());
+            throw std::runtime_error("Failed to resize the shared memory " + name + ": " + strerror(errno));
+        }
+        try {
+            map_.reset(new ShmMapping(fd, size));
+        } catch (...) {
+            ::close(fd);
+            ::shm_unlink(name.c_str());
+            throw;
+        }
+        ::close(fd);
+
+        ShmBusHeader* header = new (map_->data()) ShmBusHeader;
+        header->version = shm_bus_version;
+        header->n_slots = static_cast<uint32_t>(n_slots);
+        header->slot_size = slot_size;
+        header->data_offset = data_offset;
+        header->write_seq = 0;
+        header->notify = 0;
+        for (std::size_t i = 0; i < n_slots; ++i) {
+            ShmBusSlot* slot = new (map_->slot(i)) ShmBusSlot;
+            slot->seq = 0;
+            slot->n_frames = 0;
+            slot->train_id = 0;
+            for (auto& holder : slot->holders) holder = 0;
+        }
+        // readers check the magic last
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(header->magic, shm_bus_magic, sizeof shm_bus_magic);
+    }
+
+    ShmBusWriter(const ShmBusWriter&) = delete;
+    ShmBusWriter& operator=(const ShmBusWriter&) = delete;
+
+    ~ShmBusWriter() {
+        ::shm_unlink(name_.c_str());
+    }
+
+    /*
+     * Copy a train into the next free slot and wake up the readers.
+     *
+     * Return false if the train is dropped because it is larger than a
+     * slot or all the slots are held by readers.
+     */
+    bool publish(const MultipartMsg& train) {
+        ShmBusHeader* header = map_->header();
+
+        std::size_t size = shmBusAligned(16 * train.size());
+        for (auto& frame : train) size += shmBusAligned(frame.size());
+        if (size > header->slot_size) {
+            ++dropped_;
+            return false;
+        }
+
+        uint64_t train_id = 0;
+        try {
+            train_id = trainId(train);
+        } catch (std::exception&) {}
+
+        // claim a slot which no reader holds
+        std::size_t n_slots = header->n_slots;
+        ShmBusSlot* slot = nullptr;
+        std::size_t index = 0;
+        for (std::size_t k = 0; k < n_slots; ++k) {
+            index = (cursor_ + k) % n_slots;
+            ShmBusSlot* candidate = map_->slot(index);
+            uint64_t seq = candidate->seq.exchange(0);
+            if (unheld(candidate)) {
+                slot = candidate;
+                break;
+            }
+            candidate->seq = seq;
+        }
+        if (!slot) {
+            ++dropped_;
+            return false;
+        }
+        cursor_ = index + 1;
+
+        char* data = map_->slotData(index);
+        auto table = reinterpret_cast<uint64_t*>(data);
+        std::size_t offset = shmBusAligned(16 * train.size());
+        for (std::size_t i = 0; i < train.size(); ++i) {
+            table[2 * i] = offset;
+            table[2 * i + 1] = train[i].size();
+            memcpy(data + offset, train[i].data(), train[i].size());
+            offset += shmBusAligned(train[i].size());
+        }
+        slot->n_frames = static_cast<uint32_t>(train.size());
+        slot->train_id = train_id;
+        slot->seq = ++seq_;
+
+        header->write_seq = seq_;
+        ++header->notify;
+        ::syscall(SYS_futex, &header->notify, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+
+        ++published_;
+        return true;
+    }
+
+    // number of trains published
+    std::size_t published() const { return published_; }
+
+    // number of trains dropped
+    std::size_t dropped() const { return dropped_; }
+
+    // number of holds reclaimed from readers which died
+    std::size_t reclaimed() const { return reclaimed_; }
+};
+
+/*
+ * Read the trains published by a ShmBusWriter.
+ *
+ * The frames of the trains point into the shared memory, so that e.g. the
+ * arrays decoded by decodeMultipartMsg() are views of it. A slot is held
+ * until all the frames of the train have been released.
+ */
+class ShmBusReader {
+    // a train held by the reader
+    struct Hold {
+        std::shared_ptr<ShmMapping> map;
+        std::atomic<int32_t>* holder;
+        std::atomic<std::size_t> frames;
+    };
+
+    std::shared_ptr<ShmMapping> map_;
+    uint64_t next_seq_; // sequence number of the next train to read
+    std::size_t missed_ = 0;
+
+    static void release(void*, void* hint) {
+        auto hold = static_cast<Hold*>(hint);
+        if (--hold->frames == 0) {
+            *hold->holder = 0;
+            delete hold;
+        }
+    }
+
+    // hold the slot if it still contains the train, return the holder entry
+    // or nullptr if the train was overwritten or too many readers hold it
+    static std::atomic<int32_t>* acquire(ShmBusSlot* slot, uint64_t seq) {
+        int32_t pid = ::getpid();
+        for (auto& holder : slot->holders) {
+            int32_t empty = 0;
+            if (!holder.compare_exchange_strong(empty, pid)) continue;
+            if (slot->seq.load() == seq) return &holder;
+            holder = 0;
+            return nullptr;
+        }
+        return nullptr;
+    }
+
+public:
+    /*
+     * Attach to a bus. The first train read is the last one published.
+     *
+     * Exceptions:
+     * std::runtime_error if the bus does not exist
+     */
+    explicit ShmBusReader(const std::string& name) {
+        int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0) throw std::runtime_error("Failed to open the shared memory " + name + ": " + strerror(errno));
+        struct stat st;
+        if (::fstat(fd, &st) < 0 || static_cast<std::size_t>(st.st_size) < sizeof(ShmBusHeader)) {
+            ::close(fd);
+            throw std::runtime_error(name + " is not a train bus!");
+        }
+        try {
+            map_ = std::make_shared<ShmMapping>(fd, static_cast<std::size_t>(st.st_size));
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+
+        ShmBusHeader* header = map_->header();
+        if (memcmp(header->magic, shm_bus_magic, sizeof shm_bus_magic) != 0 ||
+                header->version != shm_bus_version)
+            throw std::runtime_error(name + " is not a train bus!");
+        std::atomic_thread_fence(std::memory_order_acquire);
+        next_seq_ = std::max<uint64_t>(header->write_seq, 1);
+    }
+
+    /*
+     * Wait for the next train.
+     *
+     * timeout: in milliseconds, negative to wait forever
+     *
+     * Return false if no train was published within the timeout.
+     */
+    bool next(MultipartMsg& train, uint64_t* train_id = nullptr, int timeout = -1) {
+        ShmBusHeader* header = map_->header();
+        std::size_t n_slots = header->n_slots;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+        while (true) {
+            uint32_t notify = header->notify;
+            uint64_t last = header->write_seq;
+
+            if (next_seq_ > last) {
+                // wait for the time left after a spurious wake-up or a train overwritten meanwhile
+                timespec ts = {0, 0};
+                if (timeout >= 0) {
+                    auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        deadline - std::chrono::steady_clock::now()).count();
+                    if (left <= 0) return false;
+                    ts.tv_sec = static_cast<time_t>(left / 1000000000);
+                    ts.tv_nsec = static_cast<long>(left % 1000000000);
+                }
+                long rc = ::syscall(SYS_futex, &header->notify, FUTEX_WAIT, notify,
+                                    timeout < 0 ? nullptr : &ts, nullptr, 0);
+                if (rc < 0 && errno == ETIMEDOUT) return false;
+                continue;
+            }
+
+            // too far behind
+            if (last - next_seq_ >= n_slots) {
+                missed_ += last - n_slots + 1 - next_seq_;
+                next_seq_ = last - n_slots + 1;
+            }
+
+            for (std::size_t i = 0; i < n_slots; ++i) {
+                ShmBusSlot* slot = map_->slot(i);
+                if (slot->seq.load() != next_seq_) continue;
+                std::atomic<int32_t>* holder = acquire(slot, next_seq_);
+                if (!holder) continue;
+
+                char* data = map_->slotData(i);
+                auto table = reinterpret_cast<const uint64_t*>(data);
+                train.clear();
+                if (slot->n_frames > 0) {
+                    auto hold = new Hold{map_, holder, {slot->n_frames}};
+                    for (uint32_t j = 0; j < slot->n_frames; ++j)
+                        train.emplace_back(data + table[2 * j], table[2 * j + 1], release, hold);
+                } else {
+                    *holder = 0;
+                }
+                if (train_id) *train_id = slot->train_id;
+
+                ++next_seq_;
+                return true;
+            }
+
+            // overwritten meanwhile
+            ++missed_;
+            ++next_seq_;
+        }
+    }
+
+    // number of trains missed because the reader was too slow, or because
+    // shm_bus_max_holders readers were holding them
+    std::size_t missed() const { return missed_; }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_CPP_KB_SHM_BUS_HPP
@@ -0,0 +1,265 @@
+/*
+    Karabo bridge time series of scalars.
+
+    Copyright (c) 2018, European X-Ray Free-Electron Laser Facility GmbH
+    All rights reserved.
+
+    You should have received a copy of the 3-Clause BSD License along with this
+    program. If not, see <https://opensource.org/licenses/BSD-3-Clause>
+*/
+
+#ifndef KARABO_BRIDGE_CPP_KB_TIMESERIES_HPP
+#define KARABO_BRIDGE_CPP_KB_TIMESERIES_HPP
+
+#include "kb_client.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+
+namespace karabo_bridge {
+
+/*
+ * Handle of a field of a TimeSeries, with the type of its values.
+ */
+template <typename T>
+struct Field {
+    std::size_t index;
+};
+
+/*
+ * Aggregate of the values of a field in a bin of train IDs.
+ */
+struct Aggregate {
+    uint64_t first_train_id; // first train ID of the bin
+    std::size_t count; // number of values
+    double min;
+    double max;
+    double mean;
+};
+
+/*
+ * History of scalar fields of the trains, e.g. "header.pulseCount" or a
+ * motor position, over the last capacity trains.
+ *
+ * Every field is a column of values in a ring buffer shared with the train
+ * IDs, which must increase. The fields are looked up once per train when
+ * appending, while the queries go through the handles of the fields and
+ * run in O(log(size) + range). A value is missing if the source or the
+ * path is absent or cannot be converted to the type of the field. Not
+ * thread-safe.
+ *
+ * The values are stored as double, int64_t or uint64_t.
+ */
+class TimeSeries {
+    template <typename T>
+    struct Column {
+        std::string source;
+        std::string path;
+        std::vector<T> values;
+        std::vector<uint8_t> valid;
+    };
+
+    std::size_t capacity_;
+    std::size_t start_ = 0; // row of the oldest train
+    std::size_t size_ = 0;
+    std::vector<uint64_t> train_ids_;
+    std::size_t rejected_ = 0;
+
+    std::vector<Column<double>> doubles_;
+    std::vector<Column<int64_t>> int64s_;
+    std::vector<Column<uint64_t>> uint64s_;
+
+    std::vector<Column<double>>& columns(double*) { return doubles_; }
+    std::vector<Column<int64_t>>& columns(int64_t*) { return int64s_; }
+    std::vector<Column<uint64_t>>& columns(uint64_t*) { return uint64s_; }
+    const std::vector<Column<double>>& columns(double*) const { return doubles_; }
+    const std::vector<Column<int64_t>>& columns(int64_t*) const { return int64s_; }
+    const std::vector<Column<uint64_t>>& columns(uint64_t*) const { return uint64s_; }
+
+    template <typename T>
+    const Column<T>& column(Field<T> field) const {
+        return columns(static_cast<T*>(nullptr)).at(field.index);
+    }
+
+    std::size_t row(std::size_t i) const {
+        std::size_t r = start_ + i;
+        return r < capacity_ ? r : r - capacity_;
+    }
+
+    // first train, counted from the oldest one, whose ID is not less than train_id
+    std::size_t lowerBound(uint64_t train_id) const {
+        std::size_t lo = 0, hi = size_;
+        while (lo < hi) {
+            std::size_t mid = lo + (hi - lo) / 2;
+            if (train_ids_[row(mid)] < train_id) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    template <typename T>
+    static void fill(std::vector<Column<T>>& columns, std::map<std::string, kb_data>& data_pkg, std::size_t r) {
+        for (auto& col : columns) {
+            col.valid[r] = 0;
+            auto src = data_pkg.find(col.source);
+            if (src == data_pkg.end()) continue;
+            auto it = src->second.msgpack_data.find(col.path);
+            if (it == src->second.msgpack_data.end()) continue;
+            try {
+                col.values[r] = it->second.template as<T>();
+                col.valid[r] = 1;
+            } catch (std::bad_cast&) {}
+        }
+    }
+
+public:
+    /*
+     * Exceptions:
+     * std::invalid_argument if the capacity is 0
+     */
+    explicit TimeSeries(std::size_t capacity): capacity_(capacity), train_ids_(capacity) {
+        if (capacity == 0) throw std::invalid_argument("The capacity must be positive!");
+    }
+
+    /*
+     * Record the field at path of a source from now on, with values of
+     * type T (double, int64_t or uint64_t).
+     */
+    template <typename T>
+    Field<T> addField(const std::string& source, const std::string& path) {
+        auto& cols = columns(static_cast<T*>(nullptr));
+        cols.push_back(Column<T>{source, path, std::vector<T>(capacity_), std::vector<uint8_t>(capacity_, 0)});
+        return Field<T>{cols.size() - 1};
+    }
+
+    /*
+     * Append the fields of a train, overwriting the oldest train if full.
+     *
+     * Return false if the train ID is not larger than the last one, in
+     * which case the train is ignored.
+     *
+     * Exceptions:
+     * std::out_of_range if the train has no train ID
+     */
+    bool append(std::map<std::string, kb_data>& data_pkg) {
+        uint64_t train_id = trainId(data_pkg);
+        if (size_ > 0 && train_id <= train_ids_[row(size_ - 1)]) {
+            ++rejected_;
+            return false;
+        }
+
+        std::size_t r;
+        if (size_ < capacity_) {
+            r = row(size_++);
+        } else {
+            r = start_;
+            start_ = row(1);
+        }
+        train_ids_[r] = train_id;
+        fill(doubles_, data_pkg, r);
+        fill(int64s_, data_pkg, r);
+        fill(uint64s_, data_pkg, r);
+        return true;
+    }
+
+    /*
+     * Copy the values of a field in the train IDs [first, last], and their
+     * train IDs. The missing values are skipped. Return the number of
+     * values.
+     */
+    template <typename T>
+    std::size_t range(Field<T> field, uint64_t first, uint64_t last,
+                      std::vector<uint64_t>& train_ids, std::vector<T>& values) const {
+        const Column<T>& col = column(field);
+        train_ids.clear();
+        values.clear();
+
+        std::size_t i = lowerBound(first);
+        std::size_t r = row(i);
+        for (; i < size_ && train_ids_[r] <= last; ++i) {
+            if (col.valid[r]) {
+                train_ids.push_back(train_ids_[r]);
+                values.push_back(col.values[r]);
+            }
+            if (++r == capacity_) r = 0;
+        }
+        return values.size();
+    }
+
+    /*
+     * Aggregate the values of a field in the train IDs [first, last] by
+     * bins of bin_size train IDs, starting at first. Only the bins with
+     * values are returned.
+     *
+     * Exceptions:
+     * std::invalid_argument if bin_size is 0
+     */
+    template <typename T>
+    std::vector<Aggregate> downsample(Field<T> field, uint64_t first, uint64_t last, uint64_t bin_size) const {
+        if (bin_size == 0) throw std::invalid_argument("The bin size must be positive!");
+        const Column<T>& col = column(field);
+        std::vector<Aggregate> bins;
+
+        std::size_t i = lowerBound(first);
+        std::size_t r = row(i);
+        double sum = 0;
+        for (; i < size_ && train_ids_[r] <= last; ++i) {
+            if (col.valid[r]) {
+                uint64_t bin_start = first + (train_ids_[r] - first) / bin_size * bin_size;
+                double v = static_cast<double>(col.values[r]);
+                if (bins.empty() || bins.back().first_train_id != bin_start) {
+                    if (!bins.empty()) bins.back().mean = sum / bins.back().count;
+                    bins.push_back(Aggregate{bin_start, 0, v, v, 0.});
+                    sum = 0;
+                }
+                Aggregate& bin = bins.back();
+                ++bin.count;
+                bin.min = std::min(bin.min, v);
+                bin.max = std::max(bin.max, v);
+                sum += v;
+            }
+            if (++r == capacity_) r = 0;
+        }
+        if (!bins.empty()) bins.back().mean = sum / bins.back().count;
+        return bins;
+    }
+
+    /*
+     * Get the value of a field in the last train which has it. Return false
+     * if there is none.
+     */
+    template <typename T>
+    bool latest(Field<T> field, T& value, uint64_t* train_id = nullptr) const {
+        const Column<T>& col = column(field);
+        for (std::size_t i = size_; i-- > 0;) {
+            std::size_t r = row(i);
+            if (!col.valid[r]) continue;
+            value = col.values[r];
+            if (train_id) *train_id = train_ids_[r];
+            return true;
+        }
+        return false;
+    }
+
+    // number of trains held
+    std::size_t size() const { return size_; }
+
+    std::size_t capacity() const { return capacity_; }
+
+    // oldest and newest train IDs held, size() must be positive
+    uint64_t firstTrainId() const { return train_ids_[start_]; }
+
+    uint64_t lastTrainId() const { return train_ids_[row(size_ - 1)]; }
+
+    // number of trains ignored because their train ID did not increase
+    std::size_t rejected() const { return rejected_; }
+};
+
+} // karabo_bridge
+
+#endif //KARABO_BRIDGE_CPP_KB_TIMESERIES_HPP
@@ -0,0 +1,185 @@
+/*
+ * Throughput of the fan-in of 16 detector modules as the number of worker
+ * threads of the client grows, with and without matching the modules into
+ * complete trains.
+ *
+ * 16 servers run in threads of the same process and serve AGIPD module
+ * sized trains, (pulses, 512, 128) uint16. The modules are shared out
+ * between the workers, which receive, decode and, if matching, hand them
+ * to a TrainMatcher shared by all the workers.
+ *
+ * Usage: bench2 [max number of workers] [pulses per train] [seconds per run]
+ */
+#include "kb_client.hpp"
+#include "kb_event_builder.hpp"
+#include "kb_server.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+
+const int n_modules = 16;
+const int first_port = 45470;
+const uint64_t window = 4; // rounds a worker may be ahead of the slowest one
+
+std::string moduleSource(int module) {
+    return "SPB_DET_AGIPD1M-1/DET/" + std::to_string(module) + "CH0:xtdf";
+}
+
+std::string moduleEndpoint(int module) {
+    return "tcp://127.0.0.1:" + std::to_string(first_port + module);
+}
+
+// serve the trains of a module forever, the train ID is the number of the request
+void serveModule(int module, unsigned int pulses) {
+    std::thread([=] {
+        std::vector<uint16_t> image(static_cast<std::size_t>(pulses) * 512 * 128, static_cast<uint16_t>(module));
+        zmq::message_t image_msg(image.data(), image.size() * sizeof(uint16_t));
+        std::vector<uint64_t> pulse_ids(pulses);
+        for (unsigned int i = 0; i < pulses; ++i) pulse_ids[i] = i;
+
+        karabo_bridge::Server server;
+        server.bind(moduleEndpoint(module));
+        for (uint64_t tid = 1; ; ++tid) {
+            karabo_bridge::MultipartMsg train;
+            msgpack::sbuffer buffer;
+            msgpack::packer<msgpack::sbuffer> packer(&buffer);
+            packer.pack_map(1);
+            packer.pack(std::string("metadata.timestamp.tid"));
+            packer.pack(tid);
+            karabo_bridge::appendMsgpackData(train, moduleSource(module), buffer);
+
+            zmq::message_t data;
+            data.copy(&image_msg);
+            karabo_bridge::appendArray(train, moduleSource(module), "image.data", {pulses, 512, 128},
+                                       "uint16_t", std::move(data));
+            karabo_bridge::appendArray(train, moduleSource(module), "image.pulseId", {pulses},
+                                       "uint64_t", pulse_ids.data());
+            server.serve(train);
+        }
+    }).detach();
+}
+
+struct Result {
+    double seconds;
+    std::size_t modules; // module trains received
+    std::size_t matched; // complete trains
+    std::size_t bytes;
+    uint64_t match_ns; // spent by all the workers in the matcher, including the lock
+};
+
+using Clients = std::vector<std::unique_ptr<karabo_bridge::Client>>;
+
+Result run(Clients& clients, int n_workers, bool match, double duration) {
+    std::vector<uint64_t> requested(n_modules, 0);
+
+    std::vector<std::string> sources;
+    for (int m = 0; m < n_modules; ++m) sources.push_back(moduleSource(m));
+    karabo_bridge::TrainMatcher matcher(sources, 4 * window);
+    std::mutex matcher_mutex;
+
+    std::unique_ptr<std::atomic<uint64_t>[]> rounds(new std::atomic<uint64_t>[n_workers]);
+    for (int w = 0; w < n_workers; ++w) rounds[w] = 0;
+    auto slowest = [&rounds, n_workers] {
+        uint64_t min = rounds[0];
+        for (int w = 1; w < n_workers; ++w) min = std::min<uint64_t>(min, rounds[w]);
+        return min;
+    };
+
+    std::atomic<bool> stop(false);
+    std::atomic<std::size_t> modules(0), matched(0), bytes(0);
+    std::atomic<uint64_t> match_ns(0);
+
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int w = 0; w < n_workers; ++w) {
+        workers.emplace_back([&, w] {
+            for (uint64_t round = 0; ; ++round) {
+                // keep the modules of all the workers within the window of the matcher
+                while (!stop && round > slowest() + window) std::this_thread::yield();
+                if (stop) break;
+
+                for (int m = w; m < n_modules; m += n_workers) {
+                    karabo_bridge::MultipartMsg mpmsg = clients[m]->nextMultipartMsg();
+                    ++requested[m];
+                    std::size_t n = 0;
+                    for (auto& msg : mpmsg) n += msg.size();
+                    bytes += n;
+                    ++modules;
+
+                    auto data_pkg = karabo_bridge::decodeMultipartMsg(mpmsg);
+                    if (!match) continue;
+
+                    std::map<std::string, karabo_bridge::kb_data> train;
+                    auto m0 = std::chrono::steady_clock::now();
+                    bool complete;
+                    {
+                        std::lock_guard<std::mutex> lock(matcher_mutex);
+                        complete = matcher.add(std::move(data_pkg), train);
+                    }
+                    match_ns += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - m0).count());
+                    if (complete) ++matched;
+                }
+                rounds[w] = round + 1;
+            }
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(duration));
+    stop = true;
+    for (auto& t : workers) t.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    // leave all the servers at the same train for the next run
+    uint64_t last = *std::max_element(requested.begin(), requested.end());
+    for (int m = 0; m < n_modules; ++m) {
+        for (; requested[m] < last; ++requested[m]) clients[m]->nextMultipartMsg();
+    }
+
+    return Result{seconds, modules, matched, bytes, match_ns};
+}
+
+
+int main (int argc, char* argv[]) {
+    int max_workers = static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u));
+    unsigned int pulses = 64;
+    double duration = 3;
+    if (argc >= 2) max_workers = std::stoi(argv[1]);
+    if (argc >= 3) pulses = static_cast<unsigned int>(std::stoul(argv[2]));
+    if (argc >= 4) duration = std::stod(argv[3]);
+    max_workers = std::max(std::min(max_workers, n_modules), 1);
+
+    Clients clients;
+    for (int m = 0; m < n_modules; ++m) {
+        serveModule(m, pulses);
+        clients.emplace_back(new karabo_bridge::Client());
+        clients.back()->connect(moduleEndpoint(m));
+    }
+
+    std::vector<int> n_workers;
+    for (int n = 1; n < max_workers; n *= 2) n_workers.push_back(n);
+    n_workers.push_back(max_workers);
+
+    std::cout << "\n" << n_modules << " modules of " << pulses << " pulses, "
+              << std::fixed << std::setprecision(1) << pulses * 512 * 128 * 2 / 1e6 << " MB per module\n"
+              << "workers  matching  trains/s     GB/s  match us/module  match share\n";
+    for (int n : n_workers) {
+        for (bool match : {false, true}) {
+            Result r = run(clients, n, match, duration);
+            double trains = match ? r.matched : r.modules / static_cast<double>(n_modules);
+            double per_module = r.modules > 0 ? r.match_ns * 1e-3 / r.modules : 0.;
+            std::cout << std::setw(7) << n << std::setw(10) << (match ? "yes" : "no")
+                      << std::setw(10) << std::setprecision(1) << trains / r.seconds
+                      << std::setw(9) << std::setprecision(2) << r.bytes / r.seconds / 1e9
+                      << std::setw(17) << std::setprecision(1) << per_module
+                      << std::setw(12) << std::setprecision(3) << r.match_ns * 1e-9 / (r.seconds * n)
+                      << std::endl;
+        }
+    }
+}
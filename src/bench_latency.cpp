@@ -0,0 +1,97 @@
+/*
+ * Latency from the last frame of a train leaving the server to the start of
+ * the handler in the client, with a blocking and a spinning receive.
+ *
+ * The server runs in a thread of the same process and replies after a
+ * random delay, so that the client is waiting when the train arrives.
+ *
+ * Usage: bench1 [number of trains] [cpu of the client] [busy poll in us]
+ */
+#include "kb_client.hpp"
+#include "kb_server.hpp"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <thread>
+
+
+uint64_t nowNs() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// reply to n requests, the send time is carried by the last frame
+void serve(zmq::context_t& ctx, const std::string& endpoint, int n) {
+    zmq::socket_t socket(ctx, ZMQ_REP);
+    socket.bind(endpoint.c_str());
+
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> delay_us(200, 2000);
+    for (int i = 0; i < n; ++i) {
+        zmq::message_t request;
+        socket.recv(&request);
+
+        karabo_bridge::MultipartMsg train;
+        msgpack::sbuffer buffer;
+        msgpack::packer<msgpack::sbuffer> packer(&buffer);
+        packer.pack_map(1);
+        packer.pack(std::string("metadata.timestamp.tid"));
+        packer.pack(static_cast<uint64_t>(i));
+        karabo_bridge::appendMsgpackData(train, "feedback", buffer);
+        uint64_t sent = 0;
+        karabo_bridge::appendArray(train, "feedback", "sent", {1}, "uint64", &sent);
+
+        std::this_thread::sleep_for(std::chrono::microseconds(delay_us(gen)));
+
+        sent = nowNs();
+        memcpy(train.back().data(), &sent, sizeof(sent));
+        for (std::size_t j = 0; j < train.size(); ++j)
+            socket.send(train[j], j + 1 < train.size() ? ZMQ_SNDMORE : 0);
+    }
+}
+
+void run(bool spin, int n, int cpu, int busy_poll_us, int port) {
+    std::string endpoint = "tcp://127.0.0.1:" + std::to_string(port);
+    zmq::context_t ctx(1);
+    std::thread server(serve, std::ref(ctx), endpoint, n);
+
+    std::vector<double> latencies;
+    {
+        karabo_bridge::Client client;
+        client.setSpinning(spin, spin ? cpu : -1, spin ? busy_poll_us : 0);
+        client.connect(endpoint);
+        for (int i = 0; i < n; ++i) {
+            karabo_bridge::MultipartMsg train = client.nextMultipartMsg();
+            uint64_t start = nowNs();
+            uint64_t sent;
+            memcpy(&sent, train.back().data(), sizeof(sent));
+            if (i >= n / 10) latencies.push_back((start - sent) * 1e-3); // warm-up
+        }
+    }
+    server.join();
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        return latencies[static_cast<std::size_t>(p * (latencies.size() - 1))];
+    };
+    std::cout << std::setw(9) << (spin ? "spinning" : "blocking") << std::fixed << std::setprecision(1)
+              << ": p50 " << std::setw(7) << percentile(0.5)
+              << " us, p99 " << std::setw(7) << percentile(0.99)
+              << " us, max " << std::setw(7) << latencies.back() << " us" << std::endl;
+}
+
+
+int main (int argc, char* argv[]) {
+    int n = 2000;
+    int cpu = -1;
+    int busy_poll_us = 0;
+    if (argc >= 2) n = std::stoi(argv[1]);
+    if (argc >= 3) cpu = std::stoi(argv[2]);
+    if (argc >= 4) busy_poll_us = std::stoi(argv[3]);
+    if (n < 10) throw std::invalid_argument("At least 10 trains are required!");
+
+    run(false, n, cpu, busy_poll_us, 45461);
+    run(true, n, cpu, busy_poll_us, 45462);
+}
@@ -0,0 +1,44 @@
+/*
+ * Record the trains received from a server into a file and read them back.
+ *
+ * Usage: run5 <port> <path> [number of trains]
+ */
+#include "kb_client.hpp"
+#include "kb_recording.hpp"
+
+#include <chrono>
+#include <iostream>
+
+
+int main (int argc, char* argv[]) {
+    if (argc < 3) throw std::invalid_argument("Port and path are required!");
+    std::string port = argv[1];
+    std::string path = argv[2];
+    int n_trains = 100;
+    if (argc >= 4) n_trains = std::stoi(argv[3]);
+
+    karabo_bridge::Client client;
+    client.connect("tcp://localhost:" + port);
+
+    karabo_bridge::RecordWriter writer(path);
+    std::size_t n_bytes = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < n_trains; ++i) {
+        auto train = client.nextMultipartMsg();
+        for (auto& frame : train) n_bytes += frame.size();
+        writer.write(std::move(train));
+    }
+    writer.close();
+    auto dt = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    std::cout << n_trains << " trains (" << n_bytes / (1 << 20) << " MB) recorded in "
+              << dt << " ms" << std::endl;
+
+    karabo_bridge::RecordReader reader(path);
+    karabo_bridge::MultipartMsg train;
+    uint64_t train_id;
+    while (reader.next(train, &train_id)) {
+        auto data_pkg = karabo_bridge::decodeMultipartMsg(train);
+        std::cout << "Train " << train_id << ": " << data_pkg.size() << " sources" << std::endl;
+    }
+}
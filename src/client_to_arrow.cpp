@@ -0,0 +1,54 @@
+/*
+ * Stream the trains received from a server as Apache Arrow record batches.
+ *
+ * Usage: run4 <port> <file|pipe|shm> <path> [number of trains]
+ *
+ * e.g. "run4 1234 pipe /tmp/trains" and, in python,
+ *
+ *      import pyarrow as pa
+ *      reader = pa.ipc.open_stream("/tmp/trains")
+ *      for batch in reader: ...
+ */
+#include "kb_client.hpp"
+#include "kb_arrow.hpp"
+
+#include <iostream>
+#include <memory>
+
+
+int main (int argc, char* argv[]) {
+    if (argc < 4) throw std::invalid_argument("Port, output type and path are required!");
+    std::string port = argv[1];
+    std::string output = argv[2];
+    std::string path = argv[3];
+    int n_trains = 100;
+    if (argc >= 5) n_trains = std::stoi(argv[4]);
+
+    // files are written with O_DIRECT in the background
+    std::unique_ptr<karabo_bridge::AsyncFileWriter> file;
+    std::unique_ptr<karabo_bridge::ArrowStreamWriter> writer;
+    if (output == "file") {
+        file.reset(new karabo_bridge::AsyncFileWriter(path));
+        writer.reset(new karabo_bridge::ArrowStreamWriter(*file));
+    } else if (output == "pipe") {
+        writer.reset(new karabo_bridge::ArrowStreamWriter(
+            karabo_bridge::ArrowStreamWriter::openPipe(path), true));
+    } else if (output == "shm") {
+        writer.reset(new karabo_bridge::ArrowStreamWriter(
+            karabo_bridge::ArrowStreamWriter::openSharedMemory(path), true));
+    } else {
+        throw std::invalid_argument("Unknown output type: " + output);
+    }
+
+    karabo_bridge::Client client;
+    client.connect("tcp://localhost:" + port);
+
+    for (int i = 0; i < n_trains; ++i) {
+        auto data_pkg = client.next();
+        writer->write(data_pkg);
+    }
+    writer->close();
+    if (file) file->close();
+
+    std::cout << n_trains << " trains written to " << path << std::endl;
+}
@@ -0,0 +1,41 @@
+/*
+ * Write the trains received from a server into an HDF5 file.
+ *
+ * Usage: run3 <port> [filename] [number of trains]
+ */
+#include "kb_client.hpp"
+#include "kb_hdf5_writer.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+
+
+int main (int argc, char* argv[]) {
+    std::string port;
+    if (argc >= 2) port = argv[1];
+    else throw std::invalid_argument("Port is required!");
+    std::string filename = "trains.h5";
+    if (argc >= 3) filename = argv[2];
+    int n_trains = 100;
+    if (argc >= 4) n_trains = std::stoi(argv[3]);
+
+    karabo_bridge::Client client;
+    client.connect("tcp://localhost:" + port);
+
+    karabo_bridge::Hdf5Writer writer(filename);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < n_trains; ++i) {
+        auto data_pkg = client.next();
+        if (!writer.write(std::move(data_pkg)))
+            std::cout << "Train " << i << " dropped: the disk is too slow!\n";
+    }
+    writer.close();
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::cout << writer.written() << " trains written to " << filename << " in "
+              << std::fixed << std::setprecision(1)
+              << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() / 1000.
+              << " s, " << writer.dropped() << " dropped" << std::endl;
+}
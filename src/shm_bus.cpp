@@ -0,0 +1,47 @@
+/*
+ * Share the trains received from a server with the processes on the node.
+ *
+ * Usage: run6 publish <port> <name> [number of slots] [slot size in MB]
+ *        run6 read <name>
+ *
+ * e.g. "run6 publish 1234 /trains" and "run6 read /trains" in as many
+ * processes as needed.
+ */
+#include "kb_client.hpp"
+#include "kb_shm_bus.hpp"
+
+#include <iostream>
+
+
+int main (int argc, char* argv[]) {
+    if (argc < 3) throw std::invalid_argument("Mode and name are required!");
+    std::string mode = argv[1];
+
+    if (mode == "publish") {
+        if (argc < 4) throw std::invalid_argument("Port and name are required!");
+        std::string port = argv[2];
+        std::size_t n_slots = 8;
+        std::size_t slot_size = 256;
+        if (argc >= 5) n_slots = std::stoul(argv[4]);
+        if (argc >= 6) slot_size = std::stoul(argv[5]);
+
+        karabo_bridge::ShmBusWriter writer(argv[3], n_slots, slot_size << 20);
+        karabo_bridge::Client client;
+        client.connect("tcp://localhost:" + port);
+        while (true) {
+            if (!writer.publish(client.nextMultipartMsg()))
+                std::cout << "Train dropped (" << writer.dropped() << " so far)" << std::endl;
+        }
+    } else if (mode == "read") {
+        karabo_bridge::ShmBusReader reader(argv[2]);
+        karabo_bridge::MultipartMsg train;
+        uint64_t train_id;
+        while (reader.next(train, &train_id)) {
+            auto data_pkg = karabo_bridge::decodeMultipartMsg(train);
+            std::cout << "Train " << train_id << ": " << data_pkg.size() << " sources, "
+                      << reader.missed() << " trains missed" << std::endl;
+        }
+    } else {
+        throw std::invalid_argument("Unknown mode: " + mode);
+    }
+}
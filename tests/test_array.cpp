@@ -0,0 +1,119 @@
+#include "kb_client.hpp"
+
+#include <cassert>
+#include <cstdint>
+
+
+int main() {
+    // (2, 3, 4)
+    std::vector<uint16_t> data(24);
+    for (std::size_t i = 0; i < data.size(); ++i) data[i] = static_cast<uint16_t>(i);
+    karabo_bridge::Array array(data.data(), {2, 3, 4}, "uint16_t");
+
+    {
+        std::vector<uint16_t> dst(24);
+        array.copy_to(dst.data());
+        assert(dst == data);
+
+        std::vector<float> converted(24);
+        array.convert_to(converted.data());
+        for (std::size_t i = 0; i < 24; ++i) assert(converted[i] == i);
+
+        std::vector<double> by_name(24);
+        array.copy_to(by_name.data(), {}, "float64");
+        assert(by_name[23] == 23.);
+    }
+
+    {
+        // rows padded to 6 pixels
+        std::vector<int32_t> padded(2 * 3 * 6, -1);
+        array.convert_to(padded.data(), {3 * 6 * 4, 6 * 4, 4});
+        for (std::size_t p = 0; p < 2; ++p) {
+            for (std::size_t y = 0; y < 3; ++y) {
+                for (std::size_t x = 0; x < 6; ++x) {
+                    int32_t expected = x < 4 ? static_cast<int32_t>(p * 12 + y * 4 + x) : -1;
+                    assert(padded[(p * 3 + y) * 6 + x] == expected);
+                }
+            }
+        }
+    }
+
+    {
+        // transposed into (4, 3, 2)
+        std::vector<uint16_t> transposed(24);
+        array.copy_to(transposed.data(), {2, 2 * 2, 3 * 2 * 2});
+        for (std::size_t p = 0; p < 2; ++p) {
+            for (std::size_t y = 0; y < 3; ++y) {
+                for (std::size_t x = 0; x < 4; ++x) assert(transposed[(x * 3 + y) * 2 + p] == data[(p * 3 + y) * 4 + x]);
+            }
+        }
+    }
+
+    {
+        bool thrown = false;
+        std::vector<float> dst(24);
+        try {
+            array.convert_to(dst.data(), {4, 4});
+        } catch (std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        thrown = false;
+        try {
+            array.copy_to(dst.data(), {}, "float16");
+        } catch (std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    {
+        assert(array.size() == 24);
+        assert(array.nbytes() == 48);
+        assert(array.view<uint16_t>() == data.data());
+        assert(array.at<uint16_t>(23) == 23);
+
+        // the size of the data chunk is checked against the shape
+        karabo_bridge::Array checked(data.data(), {2, 3, 4}, "uint16_t", 48);
+        assert(checked.nbytes() == 48);
+
+        bool thrown = false;
+        try {
+            karabo_bridge::Array truncated(data.data(), {2, 3, 4}, "uint16_t", 46);
+        } catch (std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        thrown = false;
+        try {
+            karabo_bridge::Array huge(data.data(), {65536, 65536, 65536, 65536}, "uint16_t", 48);
+        } catch (std::overflow_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        // a train without pulses
+        karabo_bridge::Array empty(nullptr, {0, 512, 128}, "uint16_t", 0);
+        assert(empty.size() == 0 && empty.nbytes() == 0);
+
+#ifndef NDEBUG
+        thrown = false;
+        try {
+            array.at<uint16_t>(24);
+        } catch (std::out_of_range&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        thrown = false;
+        try {
+            array.view<float>();
+        } catch (std::bad_cast&) {
+            thrown = true;
+        }
+        assert(thrown);
+#endif
+    }
+}
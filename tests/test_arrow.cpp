@@ -0,0 +1,248 @@
+#include "kb_server.hpp"
+#include "kb_arrow.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+
+const char* filename = "test_arrow.arrows";
+
+// a camera and a motor with a counter, which exceeds INT64_MAX in train 1000
+std::map<std::string, karabo_bridge::kb_data> makeTrain(uint64_t tid, int64_t counter) {
+    karabo_bridge::MultipartMsg train;
+    {
+        msgpack::sbuffer buffer;
+        msgpack::packer<msgpack::sbuffer> packer(&buffer);
+        packer.pack_map(1);
+        packer.pack(std::string("metadata.timestamp.tid"));
+        packer.pack(tid);
+        karabo_bridge::appendMsgpackData(train, "camera", buffer);
+        std::vector<uint16_t> image(6, static_cast<uint16_t>(tid));
+        karabo_bridge::appendArray(train, "camera", "image.data", {2, 3}, "uint16_t", image.data());
+    }
+    {
+        msgpack::sbuffer buffer;
+        msgpack::packer<msgpack::sbuffer> packer(&buffer);
+        packer.pack_map(4);
+        packer.pack(std::string("counter"));
+        if (tid == 1000) packer.pack(static_cast<uint64_t>(1) << 63 | 5);
+        else packer.pack(counter);
+        packer.pack(std::string("metadata.timestamp.tid"));
+        packer.pack(tid);
+        packer.pack(std::string("position"));
+        packer.pack(1.5);
+        packer.pack(std::string("state"));
+        packer.pack(std::string("ON"));
+        karabo_bridge::appendMsgpackData(train, "motor", buffer);
+    }
+    return karabo_bridge::decodeMultipartMsg(train);
+}
+
+template <typename T>
+T read(const std::string& buf, std::size_t pos) {
+    assert(pos + sizeof(T) <= buf.size());
+    T v;
+    memcpy(&v, &buf[pos], sizeof v);
+    return v;
+}
+
+/*
+ * A FlatBuffers table of the Arrow IPC metadata.
+ */
+class Table {
+    const std::string* buf_;
+    std::size_t pos_;
+
+    // position of a field, 0 if it is absent
+    std::size_t field(uint16_t id) const {
+        std::size_t vtable = pos_ - read<int32_t>(*buf_, pos_);
+        if (4u + 2u * id >= read<uint16_t>(*buf_, vtable)) return 0;
+        uint16_t offset = read<uint16_t>(*buf_, vtable + 4 + 2 * id);
+        return offset ? pos_ + offset : 0;
+    }
+
+    // position of the object a field refers to
+    std::size_t deref(uint16_t id) const {
+        std::size_t pos = field(id);
+        assert(pos != 0);
+        return pos + read<uint32_t>(*buf_, pos);
+    }
+
+public:
+    Table(const std::string& buf, std::size_t pos): buf_(&buf), pos_(pos) {}
+
+    static Table root(const std::string& buf) { return Table(buf, read<uint32_t>(buf, 0)); }
+
+    template <typename T>
+    T scalar(uint16_t id, T default_value = 0) const {
+        std::size_t pos = field(id);
+        return pos ? read<T>(*buf_, pos) : default_value;
+    }
+
+    std::string string(uint16_t id) const {
+        std::size_t pos = deref(id);
+        return buf_->substr(pos + 4, read<uint32_t>(*buf_, pos));
+    }
+
+    Table table(uint16_t id) const { return Table(*buf_, deref(id)); }
+
+    // length of a vector
+    uint32_t length(uint16_t id) const { return read<uint32_t>(*buf_, deref(id)); }
+
+    // element of a vector of tables
+    Table element(uint16_t id, std::size_t i) const {
+        std::size_t pos = deref(id) + 4 + 4 * i;
+        return Table(*buf_, pos + read<uint32_t>(*buf_, pos));
+    }
+
+    // member of an element of a vector of structs of two int64 (FieldNode, Buffer)
+    int64_t pair(uint16_t id, std::size_t i, std::size_t member) const {
+        return read<int64_t>(*buf_, deref(id) + 4 + 16 * i + 8 * member);
+    }
+};
+
+/*
+ * An encapsulated message: continuation marker, metadata size, metadata
+ * (a Message table) and body.
+ */
+struct Message {
+    std::string metadata;
+    std::string body;
+
+    Table header() const { return Table::root(metadata).table(2); }
+
+    uint8_t type() const { return Table::root(metadata).scalar<uint8_t>(1); }
+};
+
+// read the next message, return false at the end of the stream
+bool nextMessage(const std::string& stream, std::size_t& pos, Message& msg) {
+    assert(pos % 8 == 0);
+    assert(read<uint32_t>(stream, pos) == 0xFFFFFFFF);
+    auto size = read<int32_t>(stream, pos + 4);
+    pos += 8;
+    if (size == 0) return false;
+    assert(size % 8 == 0);
+    msg.metadata = stream.substr(pos, static_cast<std::size_t>(size));
+    pos += static_cast<std::size_t>(size);
+
+    Table message = Table::root(msg.metadata);
+    assert(message.scalar<int16_t>(0) == 4); // V5
+    auto body_length = static_cast<std::size_t>(message.scalar<int64_t>(3));
+    assert(body_length % 8 == 0 && pos + body_length <= stream.size());
+    msg.body = stream.substr(pos, body_length);
+    pos += body_length;
+    return true;
+}
+
+// type id and bit width (or precision) of a field
+std::pair<uint8_t, int> fieldType(const Table& field) {
+    auto type_type = field.scalar<uint8_t>(2);
+    Table type = field.table(3);
+    if (type_type == 2) return std::make_pair(type_type, type.scalar<int32_t>(0) * (type.scalar<uint8_t>(1) ? 1 : -1));
+    if (type_type == 3) return std::make_pair(type_type, static_cast<int>(type.scalar<int16_t>(0)));
+    return std::make_pair(type_type, 0);
+}
+
+
+int main() {
+    {
+        karabo_bridge::ArrowStreamWriter writer(karabo_bridge::ArrowStreamWriter::openFile(filename), true);
+        auto data_pkg = makeTrain(1000, 0);
+        writer.write(data_pkg);
+        // a counter which fits in an int64 is written to the uint64 column
+        data_pkg = makeTrain(1001, 7);
+        writer.write(data_pkg);
+
+        // but not a negative one
+        bool thrown = false;
+        data_pkg = makeTrain(1002, -1);
+        try {
+            writer.write(data_pkg);
+        } catch (std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        writer.close();
+    }
+
+    std::ifstream file(filename, std::ios::binary);
+    std::stringstream ss;
+    ss << file.rdbuf();
+    std::string stream = ss.str();
+    std::size_t pos = 0;
+    Message msg;
+
+    {
+        assert(nextMessage(stream, pos, msg));
+        assert(msg.type() == 1 && msg.body.empty());
+        Table schema = msg.header();
+        assert(schema.length(1) == 7);
+
+        const char* names[] = {"trainId", "camera/metadata.timestamp.tid", "camera/image.data", "motor/counter",
+                               "motor/metadata.timestamp.tid", "motor/position", "motor/state"};
+        for (std::size_t i = 0; i < 7; ++i) assert(schema.element(1, i).string(0) == names[i]);
+
+        assert(fieldType(schema.element(1, 0)) == std::make_pair(uint8_t(2), -64));
+        assert(fieldType(schema.element(1, 1)) == std::make_pair(uint8_t(2), 64));
+        assert(fieldType(schema.element(1, 3)) == std::make_pair(uint8_t(2), -64));
+        assert(fieldType(schema.element(1, 5)) == std::make_pair(uint8_t(3), 2));
+        assert(fieldType(schema.element(1, 6)).first == 5);
+
+        // the image is a fixed size list of 6 uint16 with the tensor extension
+        Table image = schema.element(1, 2);
+        assert(image.scalar<uint8_t>(2) == 16 && image.table(3).scalar<int32_t>(0) == 6);
+        assert(image.length(5) == 1 && fieldType(image.element(5, 0)) == std::make_pair(uint8_t(2), -16));
+        assert(image.length(6) == 2);
+        assert(image.element(6, 0).string(0) == "ARROW:extension:name");
+        assert(image.element(6, 0).string(1) == "arrow.fixed_shape_tensor");
+        assert(image.element(6, 1).string(1) == "{\"shape\":[2, 3]}");
+    }
+
+    for (uint64_t tid = 1000; tid < 1002; ++tid) {
+        assert(nextMessage(stream, pos, msg));
+        assert(msg.type() == 3);
+        Table batch = msg.header();
+        assert(batch.scalar<int64_t>(0) == 1);
+        // one node per column and one for the values of the image
+        assert(batch.length(1) == 8);
+        assert(batch.pair(1, 3, 0) == 6);
+        // a validity bitmap per node, offsets for the string and the values
+        assert(batch.length(2) == 16);
+        for (std::size_t i = 0; i < 16; ++i) {
+            auto offset = batch.pair(2, i, 0);
+            assert(offset % 8 == 0 && offset + batch.pair(2, i, 1) <= static_cast<int64_t>(msg.body.size()));
+        }
+
+        assert(read<uint64_t>(msg.body, static_cast<std::size_t>(batch.pair(2, 1, 0))) == tid);
+        assert(batch.pair(2, 6, 1) == 12);
+        assert(read<uint16_t>(msg.body, static_cast<std::size_t>(batch.pair(2, 6, 0)) + 10) == tid);
+        uint64_t counter = read<uint64_t>(msg.body, static_cast<std::size_t>(batch.pair(2, 8, 0)));
+        assert(counter == (tid == 1000 ? (static_cast<uint64_t>(1) << 63 | 5) : 7));
+        assert(read<double>(msg.body, static_cast<std::size_t>(batch.pair(2, 12, 0))) == 1.5);
+        assert(msg.body.substr(static_cast<std::size_t>(batch.pair(2, 15, 0)), 2) == "ON");
+    }
+
+    // the end-of-stream marker
+    assert(!nextMessage(stream, pos, msg));
+    assert(pos == stream.size());
+
+    {
+        // a counter above INT64_MAX does not fit in an int64 column
+        karabo_bridge::ArrowStreamWriter writer(karabo_bridge::ArrowStreamWriter::openFile(filename), true);
+        auto data_pkg = makeTrain(1001, 7);
+        writer.write(data_pkg);
+        bool thrown = false;
+        data_pkg = makeTrain(1000, 0);
+        try {
+            writer.write(data_pkg);
+        } catch (std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        writer.close();
+    }
+
+    std::remove(filename);
+}
@@ -0,0 +1,68 @@
+#include "kb_async_writer.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+
+const char* filename = "test_async_writer.bin";
+
+std::string readFile() {
+    std::ifstream file(filename, std::ios::binary);
+    std::stringstream ss;
+    ss << file.rdbuf();
+    return ss.str();
+}
+
+void freeAligned(void* data, void*) { free(data); }
+
+// a frame whose data is aligned to the block size
+zmq::message_t alignedFrame(std::size_t size, char value) {
+    void* data = nullptr;
+    int rc = posix_memalign(&data, karabo_bridge::AsyncFileWriter::alignment, size);
+    assert(rc == 0);
+    memset(data, value, size);
+    return zmq::message_t(data, size, freeAligned, nullptr);
+}
+
+
+int main() {
+    // io_uring if the kernel allows it, and the pwrite threads
+    for (bool use_io_uring : {true, false}) {
+        std::string expected;
+        {
+            // small buffers, so that the writer waits for the buffers in flight
+            karabo_bridge::AsyncFileWriter writer(filename, 2, 4096, true, use_io_uring);
+            if (!use_io_uring) assert(!writer.usesIoUring());
+
+            for (int i = 0; i < 100; ++i) {
+                std::string chunk(static_cast<std::size_t>(97 * i % 1000), static_cast<char>('a' + i % 26));
+                writer.write(chunk.data(), chunk.size());
+                expected += chunk;
+            }
+
+            // a frame which is not aligned in the file is copied
+            zmq::message_t frame = alignedFrame(3 * 4096 + 100, 'x');
+            expected.append(frame.size(), 'x');
+            writer.write(std::move(frame));
+
+            // an aligned frame is written without copying, its tail is copied
+            writer.align();
+            expected.resize((expected.size() + 4095) / 4096 * 4096, '\0');
+            assert(writer.offset() == expected.size());
+            frame = alignedFrame(5 * 4096 + 10, 'y');
+            expected.append(frame.size(), 'y');
+            writer.write(std::move(frame));
+
+            writer.write("end", 3);
+            expected += "end";
+            assert(writer.offset() == expected.size());
+            writer.close();
+        }
+
+        // the padding of the last block is removed
+        assert(readFile() == expected);
+        std::remove(filename);
+    }
+}
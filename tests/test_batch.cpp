@@ -0,0 +1,71 @@
+#include "kb_batch.hpp"
+
+#include <cassert>
+#include <cstdint>
+#include <thread>
+
+
+int main() {
+    // trains of 4 frames of (2, 3) pixels: pixel = 100 * train + 10 * pulse + index
+    std::vector<std::vector<uint16_t>> trains;
+    for (uint16_t tid = 0; tid < 5; ++tid) {
+        std::vector<uint16_t> image(4 * 6);
+        for (std::size_t i = 0; i < image.size(); ++i) image[i] = 100 * tid + 10 * (i / 6) + i % 6;
+        trains.push_back(image);
+    }
+
+    {
+        karabo_bridge::BatchStacker<float> stacker(6, {2, 3});
+        assert(stacker.batchSize() == 6);
+
+        std::thread producer([&] {
+            for (uint16_t tid = 0; tid < 5; ++tid) {
+                karabo_bridge::Array array(trains[tid].data(), {4, 2, 3}, "uint16_t");
+                // only the pulses 1 and 3 of the odd trains
+                if (tid % 2) stacker.add(array, tid, {1, 3});
+                else stacker.add(array, tid);
+            }
+            stacker.close();
+        });
+
+        std::vector<std::size_t> sizes;
+        std::size_t n_frames = 0;
+        while (auto batch = stacker.acquire()) {
+            assert(reinterpret_cast<uintptr_t>(batch->data) % stacker.alignment == 0);
+            for (std::size_t i = 0; i < batch->size; ++i) {
+                for (std::size_t j = 0; j < 6; ++j) {
+                    float expected = 100.f * batch->train_ids[i] + 10.f * batch->pulses[i] + j;
+                    assert(batch->data[i * 6 + j] == expected);
+                }
+            }
+            sizes.push_back(batch->size);
+            n_frames += batch->size;
+            stacker.release();
+        }
+        producer.join();
+
+        assert(n_frames == 3 * 4 + 2 * 2);
+        assert(sizes == std::vector<std::size_t>({6, 6, 4}));
+    }
+
+    {
+        karabo_bridge::BatchStacker<uint16_t> stacker(2, {2, 3});
+        // a single frame
+        karabo_bridge::Array frame(trains[1].data(), {2, 3}, "uint16_t");
+        stacker.add(frame, 1);
+        stacker.close();
+        auto batch = stacker.acquire();
+        assert(batch != nullptr && batch->size == 1 && batch->data[5] == 105);
+        stacker.release();
+        assert(stacker.acquire() == nullptr);
+
+        bool thrown = false;
+        try {
+            karabo_bridge::Array wrong(trains[0].data(), {4, 3, 2}, "uint16_t");
+            stacker.add(wrong, 0);
+        } catch (std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+}
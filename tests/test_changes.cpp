@@ -0,0 +1,117 @@
+#include "kb_client.hpp"
+#include "test_helpers.hpp"
+
+#include <cassert>
+
+
+// a motor, whose position changes when moving, and a detector
+std::map<std::string, karabo_bridge::kb_data> makeDataPkg(uint64_t tid, double position, bool moving,
+                                                          const std::string& state = "ON") {
+    karabo_bridge::MultipartMsg train;
+    appendTrainId(train, "motor", tid, 3, [&](msgpack::packer<msgpack::sbuffer>& packer) {
+        packer.pack(std::string("actualPosition"));
+        packer.pack(position);
+        packer.pack(std::string("isMoving"));
+        packer.pack(moving);
+        packer.pack(std::string("state"));
+        packer.pack(state);
+    });
+    appendTrainId(train, "detector", tid, 1, [](msgpack::packer<msgpack::sbuffer>& packer) {
+        packer.pack(std::string("header.pulseCount"));
+        packer.pack(64);
+    });
+    std::vector<uint16_t> image(4, 1);
+    karabo_bridge::appendArray(train, "detector", "image.data", {2, 2}, "uint16_t", image.data());
+    return karabo_bridge::decodeMultipartMsg(train);
+}
+
+
+int main() {
+    karabo_bridge::ChangeFilter filter({"motor"});
+
+    {
+        // everything is delivered for the first train
+        auto data_pkg = makeDataPkg(1000, 1.5, false);
+        assert(filter.apply(data_pkg) == 1);
+        assert(data_pkg.at("motor").changed);
+        assert(data_pkg.at("motor").msgpack_data.size() == 4);
+    }
+
+    {
+        // only the train ID changed, the frame is compared without it
+        auto data_pkg = makeDataPkg(1001, 1.5, false);
+        assert(filter.apply(data_pkg) == 0);
+        auto& motor = data_pkg.at("motor");
+        assert(!motor.changed);
+        assert(motor.msgpack_data.size() == 1);
+        assert(motor["metadata.timestamp.tid"].as<uint64_t>() == 1001);
+
+        // the other sources are delivered as they are
+        auto& detector = data_pkg.at("detector");
+        assert(detector.changed);
+        assert(detector.msgpack_data.size() == 2 && detector.array.size() == 1);
+    }
+
+    {
+        auto data_pkg = makeDataPkg(1002, 2.5, true);
+        assert(filter.apply(data_pkg) == 1);
+        auto& motor = data_pkg.at("motor");
+        assert(motor.changed);
+        assert(motor.msgpack_data.size() == 3);
+        assert(motor["actualPosition"].as<double>() == 2.5);
+        assert(motor["isMoving"].as<bool>());
+        assert(motor.msgpack_data.count("state") == 0);
+    }
+
+    {
+        auto data_pkg = makeDataPkg(1003, 2.5, true, "MOVING");
+        assert(filter.apply(data_pkg) == 1);
+        auto& motor = data_pkg.at("motor");
+        assert(motor.msgpack_data.size() == 2);
+        assert(motor["state"].as<std::string>() == "MOVING");
+    }
+
+    {
+        auto data_pkg = makeDataPkg(1004, 2.5, true, "MOVING");
+        assert(filter.apply(data_pkg) == 0);
+        auto& motor = data_pkg.at("motor");
+        assert(!motor.changed);
+        assert(motor.msgpack_data.size() == 1);
+        assert(motor["metadata.timestamp.tid"].as<uint64_t>() == 1004);
+    }
+
+    {
+        // the train ID takes more bytes, so that the frames no longer line up
+        auto data_pkg = makeDataPkg(100000, 2.5, true, "MOVING");
+        assert(filter.apply(data_pkg) == 0);
+        assert(!data_pkg.at("motor").changed);
+    }
+
+    {
+        auto& stats = filter.stats();
+        assert(stats.sources == 6 && stats.identical == 2 && stats.hashed == 4);
+        assert(stats.unchanged == 3);
+        assert(stats.dropped_keys == 3 + 1 + 2 + 3 + 3);
+    }
+
+    {
+        // the frame of train 100000 is compared from now on
+        auto data_pkg = makeDataPkg(100001, 2.5, true, "MOVING");
+        assert(filter.apply(data_pkg) == 0);
+        assert(filter.stats().identical == 3);
+    }
+
+    {
+        // everything is delivered again after a reset
+        filter.reset();
+        auto data_pkg = makeDataPkg(100002, 2.5, true, "MOVING");
+        assert(filter.apply(data_pkg) == 1);
+        assert(data_pkg.at("motor").msgpack_data.size() == 4);
+    }
+
+    {
+        // a value with the same bytes but another type is a change
+        assert(karabo_bridge::hashObject(msgpack::object(1)) != karabo_bridge::hashObject(msgpack::object(1.)));
+        assert(karabo_bridge::hashObject(msgpack::object(true)) != karabo_bridge::hashObject(msgpack::object(false)));
+    }
+}
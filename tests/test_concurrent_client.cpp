@@ -0,0 +1,119 @@
+#include "kb_concurrent_client.hpp"
+#include "test_helpers.hpp"
+
+#include <cassert>
+#include <set>
+
+
+int main() {
+    TestServer server(1000, 1);
+    TestServer even(2000, 2, 500);
+    TestServer odd(2001, 2, 300);
+
+    {
+        // every consumer gets different trains
+        karabo_bridge::ConcurrentClient client(4, 8);
+        client.connect(server.endpoint());
+
+        std::set<uint64_t> tids;
+        std::mutex mutex;
+        std::vector<std::thread> consumers;
+        for (int i = 0; i < 4; ++i) {
+            consumers.emplace_back([&] {
+                for (int j = 0; j < 10; ++j) {
+                    auto data_pkg = client.next();
+                    uint64_t tid = karabo_bridge::trainId(data_pkg);
+                    assert(data_pkg["detector"].array["image.data"].as<float>()[0] == tid);
+                    std::lock_guard<std::mutex> lock(mutex);
+                    bool inserted = tids.insert(tid).second;
+                    assert(inserted);
+                }
+            });
+        }
+        for (auto& t : consumers) t.join();
+        assert(tids.size() == 40);
+        client.close();
+    }
+
+    {
+        // trains from two servers handed out in train ID order
+        karabo_bridge::ConcurrentClient client(4, 8, true);
+        client.connect(even.endpoint());
+        client.connect(odd.endpoint());
+
+        uint64_t last = 0;
+        for (int i = 0; i < 40; ++i) {
+            uint64_t tid = karabo_bridge::trainId(client.nextMultipartMsg());
+            assert(tid > last);
+            last = tid;
+        }
+        client.close();
+        assert(client.received() >= 40);
+
+        // the trains held back for reordering are queued or counted as dropped
+        std::size_t remaining = 0;
+        bool closed = false;
+        try {
+            while (true) {
+                client.nextMultipartMsg();
+                ++remaining;
+            }
+        } catch (std::runtime_error&) {
+            closed = true;
+        }
+        assert(closed);
+        assert(40 + remaining + client.dropped() + client.late() == client.received());
+    }
+
+    {
+        std::size_t train_bytes = 0;
+        for (auto& msg : makeTrain(1000)) train_bytes += msg.size();
+
+        karabo_bridge::PrefetchStats stats = karabo_bridge::PrefetchStats();
+        stats.prefetch = 4;
+        stats.min_prefetch = 1;
+        stats.max_prefetch = 8;
+        stats.network_time = 0.001;
+        stats.train_bytes = train_bytes;
+        bool capped = true;
+
+        // a slow consumer needs few requests in flight
+        stats.consumer_time = 0.01;
+        assert(karabo_bridge::prefetchTarget(stats, false, 0, capped) == 2 && !capped);
+        // fast consumers need more, within the bounds
+        stats.consumer_time = 0.0001;
+        assert(karabo_bridge::prefetchTarget(stats, false, 0, capped) == 8);
+        stats.consumer_time = 0.0005;
+        assert(karabo_bridge::prefetchTarget(stats, false, 0, capped) == 3);
+        // waiting consumers get one more
+        assert(karabo_bridge::prefetchTarget(stats, true, 0, capped) == 5);
+
+        // the memory cap wins over the consumers, counting the trains held
+        stats.max_bytes = 6 * train_bytes;
+        assert(karabo_bridge::prefetchTarget(stats, true, 0, capped) == 5 && !capped);
+        assert(karabo_bridge::prefetchTarget(stats, true, 2, capped) == 4 && capped);
+        // but not over the minimum
+        stats.min_prefetch = 2;
+        stats.max_bytes = 1;
+        assert(karabo_bridge::prefetchTarget(stats, true, 0, capped) == 2 && capped);
+
+        // the depth moves one step per reply towards a target within the bounds
+        karabo_bridge::ConcurrentClient client(4, 8);
+        client.setPrefetchBounds(2, 8, 1);
+        client.connect(server.endpoint());
+        for (int i = 0; i < 30; ++i) client.nextMultipartMsg();
+        stats = client.prefetchStats();
+        assert(stats.min_prefetch == 2 && stats.max_prefetch == 8 && stats.max_bytes == 1);
+        assert(stats.prefetch == 2 && stats.decreases == 2 + stats.increases);
+        assert(stats.network_time > 0 && stats.train_bytes == train_bytes);
+        client.close();
+
+        bool thrown = false;
+        try {
+            client.setPrefetchBounds(4, 2);
+        } catch (std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+}
@@ -0,0 +1,75 @@
+#include "kb_dispatch.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <random>
+
+
+// every instruction set must give the same bits as the generic kernels
+int main() {
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<unsigned int> dist(0, 65535);
+    std::normal_distribution<float> normal(100.f, 30.f);
+
+    const std::size_t n = 100003; // not a multiple of any vector width
+    std::vector<uint16_t> u16(n);
+    std::vector<float> f32(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        u16[i] = static_cast<uint16_t>(dist(gen));
+        f32[i] = normal(gen);
+    }
+
+    const karabo_bridge::Kernels& ref = karabo_bridge::kernelsFor(karabo_bridge::Isa::generic);
+    auto isas = karabo_bridge::supportedIsas();
+    assert(isas.front() == karabo_bridge::Isa::generic);
+
+    for (auto isa : isas) {
+        const karabo_bridge::Kernels& k = karabo_bridge::kernelsFor(isa);
+        assert(k.isa == isa);
+
+        for (std::size_t len : {std::size_t(0), std::size_t(1), std::size_t(17), std::size_t(47), n}) {
+            std::vector<float> a(len), b(len);
+            ref.convert_u16_f32(u16.data(), a.data(), len);
+            k.convert_u16_f32(u16.data(), b.data(), len);
+            assert(std::memcmp(a.data(), b.data(), len * sizeof(float)) == 0);
+
+            std::vector<uint16_t> c(len), d(len);
+            ref.byteswap_u16(u16.data(), c.data(), len);
+            k.byteswap_u16(u16.data(), d.data(), len);
+            assert(c == d);
+
+            double s1 = ref.sum_f32(f32.data(), len);
+            double s2 = k.sum_f32(f32.data(), len);
+            assert(std::memcmp(&s1, &s2, sizeof(double)) == 0);
+
+            std::vector<uint8_t> m1(len), m2(len);
+            std::size_t n1 = ref.threshold_f32(f32.data(), len, 120.f, m1.data());
+            std::size_t n2 = k.threshold_f32(f32.data(), len, 120.f, m2.data());
+            assert(n1 == n2 && m1 == m2);
+
+            std::vector<uint32_t> h1(64), h2(64);
+            ref.histogram_u16(u16.data(), len, 1000, 10, h1.data(), h1.size());
+            k.histogram_u16(u16.data(), len, 1000, 10, h2.data(), h2.size());
+            assert(h1 == h2);
+        }
+    }
+
+    {
+        assert(karabo_bridge::isaFromName("avx2") == karabo_bridge::Isa::avx2);
+        assert(std::string(karabo_bridge::isaName(karabo_bridge::Isa::sse42)) == "sse4.2");
+
+        setenv("KARABO_BRIDGE_ISA", "generic", 1);
+        assert(karabo_bridge::selectIsa() == karabo_bridge::Isa::generic);
+        // an unknown name is ignored
+        setenv("KARABO_BRIDGE_ISA", "avx1024", 1);
+        assert(karabo_bridge::selectIsa() == isas.back());
+        unsetenv("KARABO_BRIDGE_ISA");
+        assert(karabo_bridge::selectIsa() == isas.back());
+        assert(karabo_bridge::kernels().isa == isas.back());
+
+        std::vector<uint16_t> x = {0x0102, 0xff00};
+        std::vector<uint16_t> y(2);
+        karabo_bridge::kernels().byteswap_u16(x.data(), y.data(), 2);
+        assert(y[0] == 0x0201 && y[1] == 0x00ff);
+    }
+}
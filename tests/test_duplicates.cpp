@@ -0,0 +1,120 @@
+#include "kb_client.hpp"
+#include "test_helpers.hpp"
+
+#include <cassert>
+#include <thread>
+
+
+void appendSource(karabo_bridge::MultipartMsg& train, const std::string& source, uint64_t tid, int value) {
+    appendTrainId(train, source, tid, 1, [value](msgpack::packer<msgpack::sbuffer>& packer) {
+        packer.pack(std::string("value"));
+        packer.pack(value);
+    });
+}
+
+// a detector with an image of (64, 64) pixels whose value is the train ID, and a motor
+karabo_bridge::MultipartMsg makeDetectorTrain(uint64_t tid, int position = 0) {
+    auto train = makeTrain<uint16_t>(tid, "detector", {64, 64}, "uint16_t");
+    appendSource(train, "motor", tid, position);
+    return train;
+}
+
+
+int main() {
+    {
+        std::vector<uint16_t> a(100, 1), b(100, 1);
+        assert(karabo_bridge::hashBytes(a.data(), 200) == karabo_bridge::hashBytes(b.data(), 200));
+        b[99] = 2;
+        assert(karabo_bridge::hashBytes(a.data(), 200) != karabo_bridge::hashBytes(b.data(), 200));
+        assert(karabo_bridge::hashBytes(a.data(), 199) != karabo_bridge::hashBytes(a.data(), 198));
+    }
+
+    // the image is larger than the bytes hashed in full
+    karabo_bridge::DuplicateFilter filter(4, 1024);
+
+    {
+        auto train = makeDetectorTrain(1000);
+        assert(filter.apply(train) == 0 && train.size() == 6);
+        train = makeDetectorTrain(1001);
+        assert(filter.apply(train) == 0 && train.size() == 6);
+    }
+
+    {
+        // the whole train again
+        auto train = makeDetectorTrain(1001);
+        assert(filter.apply(train) == 2);
+        assert(train.empty());
+        assert(karabo_bridge::decodeMultipartMsg(train).empty());
+    }
+
+    {
+        // an older train is replayed while the motor moved
+        auto train = makeDetectorTrain(1000, 1);
+        assert(filter.apply(train) == 1);
+        assert(train.size() == 2);
+        auto data_pkg = karabo_bridge::decodeMultipartMsg(train);
+        assert(data_pkg.size() == 1 && data_pkg.count("motor") == 1);
+        assert(data_pkg.at("motor")["value"].as<int>() == 1);
+    }
+
+    {
+        // the detector repeats itself, the motor has new data
+        karabo_bridge::MultipartMsg train;
+        appendSource(train, "motor", 1002, 0);
+        auto old = makeDetectorTrain(1001);
+        for (auto& frame : old) train.emplace_back(std::move(frame));
+        // the headers unpacked by the filter follow the frames kept
+        std::vector<karabo_bridge::UnpackedHeader> headers;
+        assert(filter.apply(train, headers) == 2);
+        assert(train.size() == 2 && headers.size() == 1);
+        auto data_pkg = karabo_bridge::decodeMultipartMsg(train, headers);
+        assert(data_pkg.size() == 1);
+        assert(karabo_bridge::trainId(data_pkg) == 1002);
+    }
+
+    {
+        // the trains out of the window are forgotten
+        for (uint64_t tid = 1003; tid < 1008; ++tid) {
+            auto train = makeDetectorTrain(tid);
+            assert(filter.apply(train) == 0);
+        }
+        auto train = makeDetectorTrain(1001);
+        assert(filter.apply(train) == 0);
+    }
+
+    {
+        auto& stats = filter.stats();
+        assert(stats.sources == 2 * 2 + 2 + 2 + 3 + 2 * 5 + 2);
+        assert(stats.duplicates == 5);
+        assert(stats.trains == 1);
+        assert(stats.bytes > 64 * 64 * 2 * 2);
+    }
+
+    {
+        // next() skips the trains whose sources are all duplicates
+        karabo_bridge::Server server;
+        std::string endpoint = server.bind("tcp://127.0.0.1:*");
+        std::thread serving([&server] {
+            for (uint64_t tid : {1000, 1000, 1000, 1001}) server.serve(makeDetectorTrain(tid));
+        });
+
+        karabo_bridge::Client client;
+        client.setDuplicateWindow(4);
+        client.connect(endpoint);
+        auto data_pkg = client.next();
+        assert(karabo_bridge::trainId(data_pkg) == 1000);
+        data_pkg = client.next();
+        assert(karabo_bridge::trainId(data_pkg) == 1001);
+        assert(client.duplicateStats().trains == 2);
+        serving.join();
+    }
+
+    {
+        karabo_bridge::DuplicateFilter disabled(0);
+        auto train = makeDetectorTrain(1000);
+        assert(disabled.apply(train) == 0);
+        train = makeDetectorTrain(1000);
+        assert(disabled.apply(train) == 0 && train.size() == 6);
+        assert(!disabled.enabled());
+    }
+}
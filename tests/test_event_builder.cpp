@@ -0,0 +1,121 @@
+#include "kb_event_builder.hpp"
+#include "test_helpers.hpp"
+
+#include <cassert>
+
+
+// frames of (2, 2) pixels whose value is the pulse ID
+void appendDetector(karabo_bridge::MultipartMsg& train, const std::string& source,
+                    const std::vector<uint16_t>& pulse_ids) {
+    std::vector<float> image(pulse_ids.size() * 4);
+    for (std::size_t i = 0; i < image.size(); ++i) image[i] = pulse_ids[i / 4];
+    unsigned int n = static_cast<unsigned int>(pulse_ids.size());
+    karabo_bridge::appendArray(train, source, "image.data", {n, 2, 2}, "float", image.data());
+    karabo_bridge::appendArray(train, source, "image.pulseId", {n}, "uint16_t", pulse_ids.data());
+}
+
+// two detectors with pulses and a spectrometer with per-train data
+karabo_bridge::MultipartMsg makeEventTrain(uint64_t tid) {
+    karabo_bridge::MultipartMsg train;
+    appendTrainId(train, "detector1", tid);
+    appendDetector(train, "detector1", {0, 1, 2, 3});
+    appendTrainId(train, "detector2", tid);
+    appendDetector(train, "detector2", {5, 3, 1});
+
+    std::vector<double> spectrum(8, 1.);
+    appendTrainId(train, "spectrometer", tid);
+    karabo_bridge::appendArray(train, "spectrometer", "data.spectrum", {2, 4}, "double", spectrum.data());
+    return train;
+}
+
+float pixel(const karabo_bridge::Events& events, std::size_t event, std::size_t source) {
+    return *static_cast<const float*>(events.frame(event, source));
+}
+
+
+int main() {
+    std::vector<karabo_bridge::EventSource> sources = {
+        karabo_bridge::EventSource("detector1"),
+        karabo_bridge::EventSource("detector2"),
+        karabo_bridge::EventSource("spectrometer", "data.spectrum", "")
+    };
+
+    karabo_bridge::MultipartMsg train = makeEventTrain(1000);
+    auto data_pkg = karabo_bridge::decodeMultipartMsg(train);
+    karabo_bridge::Events events;
+
+    {
+        karabo_bridge::EventBuilder builder(sources);
+        builder.build(data_pkg, events);
+        assert(events.trainId() == 1000);
+        assert(events.size() == 2);
+        assert(events.pulseId(0) == 1 && events.pulseId(1) == 3);
+        assert(pixel(events, 0, 0) == 1 && pixel(events, 0, 1) == 1);
+        assert(pixel(events, 1, 0) == 3 && pixel(events, 1, 1) == 3);
+        assert(events.frameIndex(0, 1) == 2 && events.frameIndex(1, 1) == 1);
+        assert(events.frameShape(0) == std::vector<unsigned int>({2, 2}));
+        assert(events.frameShape(2) == std::vector<unsigned int>({2, 4}));
+        assert(events.frame(0, 2) == events.frame(1, 2));
+        assert(events.dtype(2) == "double");
+
+        // a missing required source
+        data_pkg["detector2"].array.erase("image.data");
+        builder.build(data_pkg, events);
+        assert(events.size() == 0);
+        train = makeEventTrain(1000);
+        data_pkg = karabo_bridge::decodeMultipartMsg(train);
+    }
+
+    {
+        karabo_bridge::EventBuilder builder(sources, karabo_bridge::MissingPulse::keep);
+        builder.build(data_pkg, events);
+        assert(events.size() == 5);
+        std::vector<uint64_t> expected = {0, 1, 2, 3, 5};
+        for (std::size_t i = 0; i < events.size(); ++i) {
+            assert(events.pulseId(i) == expected[i]);
+            assert(events.frame(i, 2) != nullptr);
+        }
+        assert(events.frame(0, 1) == nullptr && pixel(events, 0, 0) == 0);
+        assert(events.frame(4, 0) == nullptr && pixel(events, 4, 1) == 5);
+    }
+
+    {
+        // an optional source does not remove events
+        std::vector<karabo_bridge::EventSource> optional = sources;
+        optional[1].required = false;
+        karabo_bridge::EventBuilder builder(optional);
+        builder.build(data_pkg, events);
+        assert(events.size() == 4);
+        assert(events.frame(0, 1) == nullptr && pixel(events, 1, 1) == 1);
+    }
+
+    {
+        karabo_bridge::TrainMatcher matcher({"detector1", "detector2"}, 2);
+        std::map<std::string, karabo_bridge::kb_data> matched;
+        for (uint64_t tid = 1001; tid <= 1004; ++tid) {
+            karabo_bridge::MultipartMsg part;
+            appendTrainId(part, "detector1", tid);
+            appendDetector(part, "detector1", {0});
+            bool complete = matcher.add(karabo_bridge::decodeMultipartMsg(part), matched);
+            assert(!complete);
+        }
+        // at most two incomplete trains are kept
+        assert(matcher.pending() == 2 && matcher.dropped() == 2);
+
+        karabo_bridge::MultipartMsg part;
+        appendTrainId(part, "detector2", 1004);
+        appendDetector(part, "detector2", {0});
+        bool complete = matcher.add(karabo_bridge::decodeMultipartMsg(part), matched);
+        assert(complete);
+        assert(karabo_bridge::trainId(matched) == 1004);
+        assert(matched.size() == 2);
+        assert(matcher.pending() == 0 && matcher.dropped() == 3);
+
+        // too late
+        karabo_bridge::MultipartMsg late;
+        appendTrainId(late, "detector2", 1003);
+        complete = matcher.add(karabo_bridge::decodeMultipartMsg(late), matched);
+        assert(!complete);
+        assert(matcher.dropped() == 4);
+    }
+}
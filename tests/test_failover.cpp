@@ -0,0 +1,37 @@
+#include "kb_concurrent_client.hpp"
+#include "test_helpers.hpp"
+
+#include <cassert>
+
+
+int main() {
+    // the primary server never replies
+    TestServer primary(0, 1, 0, true);
+    TestServer standby(1000, 1);
+
+    {
+        karabo_bridge::Client client;
+        client.setFailoverTimeout(200, 50);
+        client.connect(primary.endpoint(), {standby.endpoint()});
+        auto data_pkg = client.next();
+        assert(client.failovers() >= 1 && client.endpoint() == standby.endpoint());
+        uint64_t tid = karabo_bridge::trainId(data_pkg);
+        assert(tid >= 1000);
+        data_pkg = client.next();
+        assert(karabo_bridge::trainId(data_pkg) > tid);
+    }
+
+    {
+        karabo_bridge::ConcurrentClient client(2, 4, true);
+        client.setFailoverTimeout(200);
+        client.connect(primary.endpoint(), {standby.endpoint()});
+        uint64_t tid = 999;
+        for (int i = 0; i < 10; ++i) {
+            uint64_t next = karabo_bridge::trainId(client.nextMultipartMsg());
+            assert(next > tid);
+            tid = next;
+        }
+        assert(client.failovers() >= 1);
+        client.close();
+    }
+}
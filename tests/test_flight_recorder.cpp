@@ -0,0 +1,90 @@
+#include "kb_flight_recorder.hpp"
+#include "test_helpers.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+
+int main() {
+    // a camera whose image is filled with the train ID
+    const std::vector<unsigned int> shape = {10, 10};
+    std::string prefix = "test_flight_recorder";
+    {
+        karabo_bridge::FlightRecorder recorder(prefix, 4);
+        recorder.setTrigger([](std::map<std::string, karabo_bridge::kb_data>& data_pkg) {
+            return karabo_bridge::trainId(data_pkg) == 1008;
+        });
+
+        for (uint64_t tid = 1000; tid < 1006; ++tid) recorder.push(makeTrain<uint16_t>(tid, "camera", shape, "uint16_t"));
+        assert(recorder.size() == 4);
+        std::size_t train_bytes = recorder.bytes() / 4;
+
+        recorder.trigger();
+        recorder.push(makeTrain<uint16_t>(1006, "camera", shape, "uint16_t")); // dump 0: 1003 - 1006
+        recorder.push(makeTrain<uint16_t>(1007, "camera", shape, "uint16_t"));
+        recorder.push(makeTrain<uint16_t>(1008, "camera", shape, "uint16_t")); // dump 1: 1005 - 1008
+        recorder.close();
+        assert(recorder.dumped() == 2);
+        assert(recorder.dropped() == 0);
+        assert(recorder.size() == 4);
+        assert(recorder.bytes() == 4 * train_bytes);
+    }
+
+    uint64_t first[2] = {1003, 1005};
+    for (int i = 0; i < 2; ++i) {
+        std::string path = prefix + "-" + std::to_string(i) + ".kbr";
+        {
+            karabo_bridge::RecordReader reader(path);
+            assert(reader.size() == 4);
+            karabo_bridge::MultipartMsg train;
+            uint64_t tid, expected = first[i];
+            while (reader.next(train, &tid)) {
+                assert(tid == expected++);
+                auto data_pkg = karabo_bridge::decodeMultipartMsg(train);
+                assert(data_pkg["camera"].array["image.data"].as<uint16_t>()[0] == tid);
+            }
+        }
+        std::remove(path.c_str());
+    }
+
+    // a train whose frames are held in memory of an arena, which is reused
+    // once the train is pushed
+    {
+        karabo_bridge::FlightRecorder recorder(prefix, 4);
+        char buffer[4096];
+        {
+            karabo_bridge::MonotonicBufferResource arena(buffer, sizeof(buffer));
+            karabo_bridge::PolymorphicAllocator<zmq::message_t> alloc(&arena);
+            karabo_bridge::MultipartMsg train(alloc);
+            for (auto& frame : makeTrain<uint16_t>(1000, "camera", shape, "uint16_t")) {
+                train.push_back(std::move(frame));
+            }
+            recorder.push(std::move(train));
+        }
+        std::memset(buffer, 0xff, sizeof(buffer));
+        recorder.trigger();
+        recorder.push(makeTrain<uint16_t>(1001, "camera", shape, "uint16_t")); // dump 0: 1000 - 1001
+        recorder.close();
+        assert(recorder.dumped() == 1);
+    }
+    {
+        std::string path = prefix + "-0.kbr";
+        {
+            karabo_bridge::RecordReader reader(path);
+            assert(reader.size() == 2);
+            karabo_bridge::MultipartMsg train;
+            uint64_t tid;
+            assert(reader.next(train, &tid) && tid == 1000);
+            auto data_pkg = karabo_bridge::decodeMultipartMsg(train);
+            assert(data_pkg["camera"].array["image.data"].as<uint16_t>()[99] == 1000);
+        }
+        std::remove(path.c_str());
+    }
+
+    // evicted by size
+    karabo_bridge::FlightRecorder recorder(prefix, 100, 1e9, 1000);
+    for (uint64_t tid = 1000; tid < 1010; ++tid) recorder.push(makeTrain<uint16_t>(tid, "camera", shape, "uint16_t"));
+    assert(recorder.bytes() <= 1000);
+    assert(recorder.size() < 10);
+}
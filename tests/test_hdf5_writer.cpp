@@ -0,0 +1,156 @@
+#include "kb_server.hpp"
+#include "kb_hdf5_writer.hpp"
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+
+
+const char* filename = "test_hdf5_writer.h5";
+
+void appendScalars(karabo_bridge::MultipartMsg& train, const std::string& source, uint64_t tid,
+                   const std::map<std::string, double>& values) {
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> packer(&buffer);
+    packer.pack_map(static_cast<uint32_t>(values.size() + 1));
+    packer.pack(std::string("metadata.timestamp.tid"));
+    packer.pack(tid);
+    for (auto& v : values) {
+        packer.pack(v.first);
+        packer.pack(v.second);
+    }
+    karabo_bridge::appendMsgpackData(train, source, buffer);
+}
+
+// a detector with tid % 3 + 1 pulses of (4, 8) pixels, an XGM, a motor which
+// has no position in train 1001 and a velocity from train 1002 on, and a laser
+// only in train 1001
+std::map<std::string, karabo_bridge::kb_data> makeTrain(uint64_t tid) {
+    karabo_bridge::MultipartMsg train;
+    unsigned int n_pulses = static_cast<unsigned int>(tid % 3 + 1);
+
+    appendScalars(train, "det", tid, {{"header.pulseCount", static_cast<double>(n_pulses)}});
+    std::vector<uint16_t> image(n_pulses * 4 * 8, static_cast<uint16_t>(tid));
+    karabo_bridge::appendArray(train, "det", "image.data", {n_pulses, 4, 8}, "uint16_t", image.data());
+    std::vector<uint64_t> pulse_ids(n_pulses);
+    for (unsigned int i = 0; i < n_pulses; ++i) pulse_ids[i] = i;
+    karabo_bridge::appendArray(train, "det", "image.pulseId", {n_pulses}, "uint64_t", pulse_ids.data());
+
+    appendScalars(train, "xgm", tid, {});
+    std::vector<float> intensity(n_pulses, 1.f);
+    karabo_bridge::appendArray(train, "xgm", "data.intensityTD", {n_pulses}, "float", intensity.data());
+
+    std::map<std::string, double> motor;
+    if (tid != 1001) motor["position"] = 0.5 * static_cast<double>(tid - 1000);
+    if (tid >= 1002) motor["velocity"] = 2.;
+    appendScalars(train, "motor", tid, motor);
+
+    if (tid == 1001) appendScalars(train, "laser", tid, {{"power", 10.}});
+
+    return karabo_bridge::decodeMultipartMsg(train);
+}
+
+template <typename T>
+std::vector<T> readDataset(hid_t file, const std::string& name, hid_t type, std::vector<hsize_t>* dims = nullptr) {
+    hid_t dataset = H5Dopen2(file, name.c_str(), H5P_DEFAULT);
+    assert(dataset >= 0);
+    hid_t space = H5Dget_space(dataset);
+    if (dims) {
+        dims->resize(static_cast<std::size_t>(H5Sget_simple_extent_ndims(space)));
+        H5Sget_simple_extent_dims(space, dims->data(), nullptr);
+    }
+    std::vector<T> values(static_cast<std::size_t>(H5Sget_simple_extent_npoints(space)));
+    herr_t status = H5Dread(dataset, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, values.data());
+    assert(status >= 0);
+    H5Sclose(space);
+    H5Dclose(dataset);
+    return values;
+}
+
+std::vector<uint64_t> readUint64(hid_t file, const std::string& name) {
+    return readDataset<uint64_t>(file, name, H5T_NATIVE_UINT64);
+}
+
+
+int main() {
+    {
+        karabo_bridge::Hdf5Writer writer(filename, 1, 2);
+        for (uint64_t tid = 1000; tid < 1003; ++tid) {
+            bool queued = writer.write(makeTrain(tid));
+            assert(queued);
+        }
+
+        // the XGM changes its shape after a new camera and the detector were
+        // written, so that the whole train is rolled back
+        auto data_pkg = makeTrain(1003);
+        karabo_bridge::MultipartMsg extra;
+        appendScalars(extra, "a_cam", 1003, {});
+        std::vector<uint8_t> frame(16, 1);
+        karabo_bridge::appendArray(extra, "a_cam", "data.image", {4, 4}, "uint8_t", frame.data());
+        std::vector<float> intensity(4, 1.f);
+        karabo_bridge::appendArray(extra, "xgm", "data.intensityTD", {2, 2}, "float", intensity.data());
+        appendScalars(extra, "xgm", 1003, {});
+        auto extra_pkg = karabo_bridge::decodeMultipartMsg(extra);
+        data_pkg["a_cam"] = std::move(extra_pkg["a_cam"]);
+        data_pkg["xgm"] = std::move(extra_pkg["xgm"]);
+        bool queued = writer.write(std::move(data_pkg));
+        assert(queued);
+
+        bool thrown = false;
+        try {
+            writer.close();
+        } catch (std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        assert(writer.written() == 3 && writer.dropped() == 1);
+    }
+
+    hid_t file = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+    assert(file >= 0);
+
+    assert((readUint64(file, "INDEX/trainId") == std::vector<uint64_t>{1000, 1001, 1002}));
+
+    {
+        // by group for the sources with arrays
+        assert((readUint64(file, "INDEX/det/image/first") == std::vector<uint64_t>{0, 2, 5}));
+        assert((readUint64(file, "INDEX/det/image/count") == std::vector<uint64_t>{2, 3, 1}));
+        assert((readUint64(file, "INDEX/det/header/first") == std::vector<uint64_t>{0, 1, 2}));
+        assert((readUint64(file, "INDEX/det/header/count") == std::vector<uint64_t>{1, 1, 1}));
+        assert((readUint64(file, "INDEX/xgm/data/count") == std::vector<uint64_t>{2, 3, 1}));
+
+        std::vector<hsize_t> dims;
+        auto image = readDataset<uint16_t>(file, "INSTRUMENT/det/image/data", H5T_NATIVE_UINT16, &dims);
+        assert((dims == std::vector<hsize_t>{6, 4, 8}));
+        assert(image[0] == 1000 && image[2 * 32] == 1001 && image[5 * 32 + 31] == 1002);
+        assert((readUint64(file, "INSTRUMENT/det/image/pulseId") == std::vector<uint64_t>{0, 1, 0, 1, 2, 0}));
+        auto pulse_count = readDataset<double>(file, "INSTRUMENT/det/header/pulseCount", H5T_NATIVE_DOUBLE);
+        assert((pulse_count == std::vector<double>{2., 3., 1.}));
+    }
+
+    {
+        // one entry per train for the sources without arrays, with fill values
+        assert((readUint64(file, "INDEX/motor/first") == std::vector<uint64_t>{0, 1, 2}));
+        assert((readUint64(file, "INDEX/motor/count") == std::vector<uint64_t>{1, 1, 1}));
+        auto position = readDataset<double>(file, "CONTROL/motor/position/value", H5T_NATIVE_DOUBLE);
+        assert(position.size() == 3 && position[0] == 0. && std::isnan(position[1]) && position[2] == 1.);
+        auto velocity = readDataset<double>(file, "CONTROL/motor/velocity/value", H5T_NATIVE_DOUBLE);
+        assert(velocity.size() == 3 && std::isnan(velocity[0]) && std::isnan(velocity[1]) && velocity[2] == 2.);
+
+        assert((readUint64(file, "INDEX/laser/first") == std::vector<uint64_t>{0, 0, 1}));
+        assert((readUint64(file, "INDEX/laser/count") == std::vector<uint64_t>{0, 1, 0}));
+        auto power = readDataset<double>(file, "CONTROL/laser/power/value", H5T_NATIVE_DOUBLE);
+        assert(power.size() == 1 && power[0] == 10.);
+    }
+
+    {
+        // nothing is left of the failed train
+        assert(H5Lexists(file, "INDEX/a_cam/data/first", H5P_DEFAULT) <= 0);
+        assert(H5Lexists(file, "INSTRUMENT/a_cam/data/image", H5P_DEFAULT) <= 0);
+        assert(readUint64(file, "INDEX/motor/count").size() == 3);
+        assert(readUint64(file, "CONTROL/motor/metadata/timestamp/tid/value").size() == 3);
+    }
+
+    H5Fclose(file);
+    std::remove(filename);
+}
@@ -0,0 +1,74 @@
+#ifndef KARABO_BRIDGE_CPP_TEST_HELPERS_HPP
+#define KARABO_BRIDGE_CPP_TEST_HELPERS_HPP
+
+#include "kb_server.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+
+// msgpack data of a source with its train ID, followed by n_values more
+// key-value pairs packed by pack_values
+void appendTrainId(karabo_bridge::MultipartMsg& train, const std::string& source, uint64_t tid,
+                   uint32_t n_values = 0,
+                   const std::function<void(msgpack::packer<msgpack::sbuffer>&)>& pack_values = nullptr) {
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> packer(&buffer);
+    packer.pack_map(1 + n_values);
+    packer.pack(std::string("metadata.timestamp.tid"));
+    packer.pack(tid);
+    if (pack_values) pack_values(packer);
+    karabo_bridge::appendMsgpackData(train, source, buffer);
+}
+
+// a source with its train ID and an image whose pixels are the train ID
+template <typename T = float>
+karabo_bridge::MultipartMsg makeTrain(uint64_t tid, const std::string& source = "detector",
+                                      const std::vector<unsigned int>& shape = {2, 2},
+                                      const std::string& dtype = "float") {
+    karabo_bridge::MultipartMsg train;
+    appendTrainId(train, source, tid);
+
+    std::size_t size = 1;
+    for (auto n : shape) size *= n;
+    std::vector<T> image(size, static_cast<T>(tid));
+    karabo_bridge::appendArray(train, source, "image.data", shape, dtype, image.data());
+    return train;
+}
+
+/*
+ * A server of the trains first_tid, first_tid + step, ... on a port chosen
+ * by the system, which stops when it is destroyed. A silent server accepts
+ * the requests but never replies.
+ */
+class TestServer {
+    karabo_bridge::Server server_;
+    std::string endpoint_;
+    std::atomic<bool> stop_;
+    std::thread thread_;
+
+public:
+    TestServer(uint64_t first_tid, uint64_t step, int delay_us = 0, bool silent = false): stop_(false) {
+        endpoint_ = server_.bind("tcp://127.0.0.1:*");
+        if (silent) return;
+        thread_ = std::thread([=] {
+            for (uint64_t tid = first_tid; !stop_; ) {
+                if (!server_.poll(10)) continue;
+                server_.serve(makeTrain(tid));
+                if (delay_us > 0) std::this_thread::sleep_for(std::chrono::microseconds(delay_us * (tid % 3)));
+                tid += step;
+            }
+        });
+    }
+
+    ~TestServer() {
+        stop_ = true;
+        if (thread_.joinable()) thread_.join();
+    }
+
+    const std::string& endpoint() const { return endpoint_; }
+};
+
+#endif //KARABO_BRIDGE_CPP_TEST_HELPERS_HPP
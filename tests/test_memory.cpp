@@ -0,0 +1,89 @@
+#include "kb_client.hpp"
+
+#include <cassert>
+
+
+// count the memory taken from the global heap
+class CountingResource : public karabo_bridge::MemoryResource {
+protected:
+    void* doAllocate(std::size_t bytes, std::size_t) override {
+        ++allocations;
+        return ::operator new(bytes);
+    }
+
+    void doDeallocate(void* p, std::size_t, std::size_t) override {
+        ++deallocations;
+        ::operator delete(p);
+    }
+
+public:
+    int allocations = 0;
+    int deallocations = 0;
+};
+
+
+int main() {
+    CountingResource upstream;
+
+    {
+        // a train worth of containers in an arena
+        karabo_bridge::MonotonicBufferResource arena(1 << 16, &upstream);
+        {
+            karabo_bridge::ScopedResource scope(&arena);
+            karabo_bridge::kb_data data;
+            for (int i = 0; i < 100; ++i) data.array[std::to_string(i)] = karabo_bridge::Array();
+            karabo_bridge::MultipartMsg mpmsg;
+            for (int i = 0; i < 100; ++i) mpmsg.emplace_back();
+            assert(karabo_bridge::getDefaultResource() == &arena);
+        }
+        assert(karabo_bridge::getDefaultResource() == karabo_bridge::newDeleteResource());
+        assert(upstream.allocations == 1);
+        assert(upstream.deallocations == 0);
+        arena.release();
+        assert(upstream.deallocations == 1);
+
+        // the memory of the arena grows
+        void* p = arena.allocate(1 << 17, 64);
+        assert(reinterpret_cast<uintptr_t>(p) % 64 == 0);
+        assert(upstream.allocations == 2);
+    }
+    assert(upstream.deallocations == 2);
+
+    {
+        char buffer[1024];
+        karabo_bridge::MonotonicBufferResource arena(buffer, sizeof(buffer), &upstream);
+        void* p = arena.allocate(100);
+        assert(p >= static_cast<void*>(buffer) && p < static_cast<void*>(buffer + sizeof(buffer)));
+        arena.release();
+        assert(arena.allocate(100) == p);
+    }
+
+    {
+        upstream.allocations = 0;
+        karabo_bridge::PoolResource pool(&upstream, 4096);
+        karabo_bridge::PolymorphicAllocator<int> alloc(&pool);
+        {
+            std::vector<int, karabo_bridge::PolymorphicAllocator<int>> v(alloc);
+            for (int i = 0; i < 10; ++i) {
+                karabo_bridge::PathMap<int> m(alloc);
+                for (int j = 0; j < 50; ++j) m[std::to_string(j)] = j;
+                assert(m["42"] == 42);
+            }
+            v.resize(1000); // larger than a block
+        }
+        // the nodes are recycled
+        int allocations = upstream.allocations;
+        {
+            karabo_bridge::PathMap<int> m(alloc);
+            for (int j = 0; j < 50; ++j) m[std::to_string(j)] = j;
+        }
+        assert(upstream.allocations == allocations);
+    }
+
+    {
+        karabo_bridge::PolymorphicAllocator<int> a(&upstream);
+        karabo_bridge::PolymorphicAllocator<double> b(a);
+        assert(a == b);
+        assert(karabo_bridge::PolymorphicAllocator<int>() != a);
+    }
+}
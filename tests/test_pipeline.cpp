@@ -0,0 +1,113 @@
+#include "kb_pipeline.hpp"
+
+#include <cassert>
+#include <stdexcept>
+
+
+std::function<bool(int&)> counter(int n) {
+    auto i = std::make_shared<int>(0);
+    return [i, n](int& item) {
+        if (*i >= n) return false;
+        item = ++*i;
+        return true;
+    };
+}
+
+
+int main() {
+    const int n = 1000;
+
+    // the odd numbers are dropped by the second stage
+    std::atomic<long> sum(0);
+    auto pipeline = karabo_bridge::Pipeline::source<int>("count", counter(n))
+        .then<long>("square", [](int& i, long& out) { out = long(i) * i; return true; }, 4)
+        .then<long>("even", [](long& i, long& out) { out = i; return i % 2 == 0; }, 2)
+        .sink("sum", [&sum](long& i) { sum += i; });
+    pipeline->start();
+    pipeline->wait();
+
+    long expected = 0;
+    for (long i = 2; i <= n; i += 2) expected += i * i;
+    assert(sum == expected);
+
+    auto stats = pipeline->stats();
+    assert(stats.size() == 4);
+    assert(stats[0].name == "count" && stats[0].processed == n);
+    assert(stats[1].n_threads == 4 && stats[1].processed == n);
+    assert(stats[2].processed == n/2 && stats[2].filtered == n/2);
+    assert(stats[3].processed == n/2 && stats[3].dropped == 0);
+
+    // a slow sink drops items instead of slowing down the source
+    std::atomic<int> received(0);
+    pipeline = karabo_bridge::Pipeline::source<int>("count", counter(100))
+        .sink("slow", [&received](int&) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            ++received;
+        }, 1, 2, karabo_bridge::DropPolicy::drop_newest);
+    pipeline->start();
+    pipeline->wait();
+    stats = pipeline->stats();
+    assert(stats[1].dropped > 0);
+    assert(received + stats[1].dropped == 100);
+
+    // an exception stops the pipeline and is rethrown
+    pipeline = karabo_bridge::Pipeline::source<int>("count", counter(1000000))
+        .sink("fail", [](int& i) { if (i == 10) throw std::runtime_error("failed"); });
+    pipeline->start();
+    bool thrown = false;
+    try {
+        pipeline->wait();
+    } catch (std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // a mandatory stage processes the trains late, an optional sink skips
+    // the trains which it would finish late: the first preview takes twice
+    // the deadline, so that all the others are estimated to be late
+    std::atomic<int> previews(0);
+    pipeline = karabo_bridge::Pipeline::source<int>("count", counter(50))
+        .then<int>("calibrate", [](int& i, int& out) {
+            assert(karabo_bridge::timeLeft() <= std::chrono::milliseconds(1));
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            out = i;
+            return true;
+        }, 1, 4, karabo_bridge::DropPolicy::block, karabo_bridge::Deadline(std::chrono::milliseconds(1)))
+        .sink("preview", [&previews](int&) {
+            if (previews++ == 0) std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }, 1, 4, karabo_bridge::DropPolicy::block, karabo_bridge::Deadline(std::chrono::milliseconds(10), true));
+    pipeline->start();
+    pipeline->wait();
+    stats = pipeline->stats();
+    assert(stats[1].processed == 50 && stats[1].missed == 50 && stats[1].skipped == 0);
+    assert(previews == 1 && stats[2].processed == 1 && stats[2].skipped == 49);
+    assert(stats[0].missed == 0 && stats[0].skipped == 0);
+    assert(karabo_bridge::timeLeft() == std::chrono::steady_clock::duration::max());
+
+    // skipping an item in a processing stage would drop it for the next stages
+    thrown = false;
+    try {
+        karabo_bridge::Pipeline::source<int>("count", counter(1))
+            .then<int>("optional", [](int& i, int& out) { out = i; return true; }, 1, 4,
+                       karabo_bridge::DropPolicy::block, karabo_bridge::Deadline(std::chrono::milliseconds(10), true));
+    } catch (std::invalid_argument&) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // a source waiting for a server which never replies is stopped
+    {
+        karabo_bridge::Client client;
+        client.connect("tcp://127.0.0.1:1");
+        std::atomic<int> received_trains(0);
+        pipeline = karabo_bridge::Pipeline::source<karabo_bridge::MultipartMsg>(
+                "receive", karabo_bridge::receiveFrom(client, 10))
+            .sink("count", [&received_trains](karabo_bridge::MultipartMsg&) { ++received_trains; });
+        pipeline->start();
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        pipeline->stop();
+        pipeline->wait();
+        assert(received_trains == 0);
+        assert(!karabo_bridge::stopRequested());
+    }
+}
@@ -0,0 +1,87 @@
+#include "kb_queue.hpp"
+
+#include <cassert>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+int main() {
+    karabo_bridge::BoundedQueue<std::unique_ptr<int>> queue(2);
+
+    assert(queue.try_push(std::unique_ptr<int>(new int(1))));
+    assert(queue.try_push(std::unique_ptr<int>(new int(2))));
+    // full
+    std::unique_ptr<int> item(new int(3));
+    assert(!queue.try_push(std::move(item)));
+    assert(item && *item == 3);
+    bool pushed = queue.push_for(std::move(item), std::chrono::milliseconds(10));
+    assert(!pushed && item && *item == 3);
+    assert(queue.size() == 2);
+
+    std::unique_ptr<int> popped;
+    assert(queue.pop(popped) && *popped == 1);
+    assert(queue.try_pop(popped) && *popped == 2);
+    assert(!queue.try_pop(popped));
+
+    // the oldest item is dropped
+    assert(queue.push_overwrite(std::unique_ptr<int>(new int(1))));
+    assert(queue.push_overwrite(std::unique_ptr<int>(new int(2))));
+    assert(!queue.push_overwrite(std::unique_ptr<int>(new int(3))));
+    assert(queue.pop(popped) && *popped == 2);
+    assert(queue.pop(popped) && *popped == 3);
+
+    // producers and consumers
+    const int n = 10000;
+    std::vector<int> sums(2, 0);
+    std::vector<std::thread> consumers;
+    for (int c = 0; c < 2; ++c) {
+        consumers.emplace_back([&queue, &sums, c] {
+            std::unique_ptr<int> v;
+            while (queue.pop(v)) sums[c] += *v;
+        });
+    }
+    std::thread producer([&queue] {
+        for (int i = 1; i <= n; ++i) queue.push(std::unique_ptr<int>(new int(i)));
+    });
+    producer.join();
+    queue.close();
+    for (auto& t : consumers) t.join();
+    assert(sums[0] + sums[1] == n*(n + 1)/2);
+
+    // closed
+    assert(!queue.push(std::unique_ptr<int>(new int(0))));
+    assert(!queue.pop(popped));
+
+    bool thrown = false;
+    try {
+        karabo_bridge::BoundedQueue<int> empty(0);
+    } catch (std::invalid_argument&) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // the first error of the workers is rethrown once
+    karabo_bridge::WorkerError error;
+    error.rethrow();
+    std::thread worker([&error] {
+        for (int i = 0; i < 2; ++i) {
+            try {
+                throw std::runtime_error(std::to_string(i));
+            } catch (...) {
+                error.capture();
+            }
+        }
+    });
+    worker.join();
+    std::string what;
+    try {
+        error.rethrow();
+    } catch (std::runtime_error& e) {
+        what = e.what();
+    }
+    assert(what == "0");
+    error.rethrow();
+}
@@ -0,0 +1,116 @@
+#include "kb_recording.hpp"
+#include "test_helpers.hpp"
+
+#include <sys/stat.h>
+
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+
+
+// a camera whose image of 256 KiB is filled with the train ID, and a motor
+karabo_bridge::MultipartMsg makeRecordedTrain(uint64_t tid) {
+    auto train = makeTrain<uint32_t>(tid, "camera", {256, 256}, "uint32_t");
+    appendTrainId(train, "motor", tid);
+    return train;
+}
+
+void check(karabo_bridge::RecordReader& reader) {
+    assert(reader.size() == 20);
+    assert(reader.sources().size() == 2);
+
+    // the trains come in the order of their train IDs
+    karabo_bridge::MultipartMsg train;
+    uint64_t tid, previous = 0;
+    while (reader.next(train, &tid)) {
+        assert(tid > previous);
+        previous = tid;
+        assert(train.size() == 6);
+        assert(karabo_bridge::trainId(train) == tid);
+        assert(*static_cast<const uint32_t*>(train[3].data()) == tid);
+    }
+
+    bool found = reader.seek(1010);
+    assert(found);
+    reader.next(train, &tid);
+    assert(tid == 1010);
+    found = reader.seek(2000);
+    assert(!found);
+    bool more = reader.next(train);
+    assert(!more);
+
+    auto range = reader.range(1005, 1015);
+    assert(range.second - range.first == 10);
+    assert(reader.trainIdAt(range.first) == 1005);
+
+    std::set<std::string> camera = {"camera"};
+    reader.read(range.first, train, &camera);
+    assert(train.size() == 4);
+
+    std::atomic<uint64_t> sum(0);
+    reader.forEach(1005, 1015, [&sum](karabo_bridge::MultipartMsg& t, uint64_t train_id) {
+        assert(t.size() == 6);
+        sum += train_id;
+    }, 3);
+    assert(sum == 10095);
+}
+
+
+int main() {
+    std::string path = "test_recording.kbr";
+    {
+        karabo_bridge::RecordWriter writer(path);
+        // out of order
+        for (uint64_t i = 0; i < 20; ++i) writer.write(makeRecordedTrain(1000 + i * 7 % 20));
+        writer.close();
+    }
+
+    {
+        karabo_bridge::RecordReader reader(path);
+        check(reader);
+    }
+
+    struct stat st;
+    stat(path.c_str(), &st);
+
+    // a count in the index whose size wraps around is not trusted
+    {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        uint64_t index_offset, n_trains;
+        file.seekg(st.st_size - karabo_bridge::record_footer_size);
+        file.read(reinterpret_cast<char*>(&index_offset), sizeof index_offset);
+        file.seekg(index_offset + 8);
+        file.read(reinterpret_cast<char*>(&n_trains), sizeof n_trains);
+        // 24 * 2^61 is a multiple of 2^64
+        n_trains += uint64_t(1) << 61;
+        file.seekp(index_offset + 8);
+        file.write(reinterpret_cast<const char*>(&n_trains), sizeof n_trains);
+    }
+    {
+        karabo_bridge::RecordReader reader(path);
+        check(reader);
+    }
+
+    // without the footer the recording is scanned
+    int rc = truncate(path.c_str(), st.st_size - 1);
+    assert(rc == 0);
+    {
+        karabo_bridge::RecordReader reader(path);
+        check(reader);
+    }
+
+    // a record whose size is 0 ends the scan like a truncated one
+    {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(karabo_bridge::record_file_header_size + 16);
+        uint64_t record_size = 0;
+        file.write(reinterpret_cast<const char*>(&record_size), sizeof record_size);
+    }
+    {
+        karabo_bridge::RecordReader reader(path);
+        assert(reader.size() == 0);
+    }
+
+    std::remove(path.c_str());
+}
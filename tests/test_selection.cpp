@@ -0,0 +1,156 @@
+#include "kb_server.hpp"
+#include "test_helpers.hpp"
+
+#include <atomic>
+#include <cassert>
+#include <thread>
+
+
+int main() {
+    karabo_bridge::MultipartMsg train;
+
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> packer(&buffer);
+    packer.pack_map(2);
+    packer.pack(std::string("metadata.timestamp.tid"));
+    packer.pack(uint64_t(10000000001));
+    packer.pack(std::string("header.pulseCount"));
+    packer.pack(uint64_t(4));
+    karabo_bridge::appendMsgpackData(train, "detector", buffer);
+
+    // (pulses, modules, ss, fs)
+    std::vector<uint16_t> image(4*2*3*5);
+    for (std::size_t i = 0; i < image.size(); ++i) image[i] = static_cast<uint16_t>(i);
+    karabo_bridge::appendArray(train, "detector", "image.data", {4, 2, 3, 5}, "uint16_t", image.data());
+    std::vector<uint64_t> pulse_id = {0, 1, 2, 3};
+    karabo_bridge::appendArray(train, "detector", "image.pulseId", {4}, "uint64_t", pulse_id.data());
+
+    karabo_bridge::appendMsgpackData(train, "motor", buffer);
+
+    karabo_bridge::Selection selection;
+    karabo_bridge::SourceSelection& detector = selection["detector"];
+    detector.paths = {"metadata.timestamp.tid", "image.data", "image.pulseId"};
+    detector.pulses = {1, 3, 9};
+    detector.roi = {{1, 2, 2, 10}};
+
+    auto extensions = karabo_bridge::server_extensions;
+    auto selected = karabo_bridge::applySelection(train, selection, &extensions);
+    // the original train is left untouched
+    assert(train.size() == 8);
+    assert(selected.size() == 6);
+
+    // the client can parse the request which carries the selection
+    auto request_buffer = karabo_bridge::packRequest(selection);
+    zmq::message_t request_msg(request_buffer.data(), request_buffer.size());
+    auto request = karabo_bridge::parseRequest(request_msg);
+    assert(request.selection.size() == 1);
+    assert(request.selection["detector"].paths == detector.paths);
+    assert(request.selection["detector"].pulses == detector.pulses);
+    assert(request.selection["detector"].roi == detector.roi);
+    assert(request.count == 1);
+
+    // a request for several trains
+    request_buffer = karabo_bridge::packRequest(selection, 5);
+    zmq::message_t batch_request_msg(request_buffer.data(), request_buffer.size());
+    request = karabo_bridge::parseRequest(batch_request_msg);
+    assert(request.count == 5);
+    assert(request.selection.size() == 1);
+
+    auto data_pkg = karabo_bridge::decodeMultipartMsg(selected);
+    assert(data_pkg.size() == 1);
+    auto& data = data_pkg.at("detector");
+    assert(data.msgpack_data.size() == 1);
+    assert(data["metadata.timestamp.tid"].as<uint64_t>() == 10000000001);
+
+    assert(data.array["image.pulseId"].shape() == std::vector<unsigned int>({2}));
+    assert(data.array["image.pulseId"].as<uint64_t>() == std::vector<uint64_t>({1, 3}));
+
+    assert(data.array["image.data"].shape() == std::vector<unsigned int>({2, 2, 2, 3}));
+    auto sliced = data.array["image.data"].as<uint16_t>();
+    assert(sliced.size() == 24);
+    // pulse 1, module 0, row 1, column 2
+    assert(sliced[0] == ((1*2 + 0)*3 + 1)*5 + 2);
+    // pulse 3, module 1, row 2, column 4
+    assert(sliced[23] == ((3*2 + 1)*3 + 2)*5 + 4);
+
+    {
+        // a source which only carries arrays
+        std::vector<float> frame(6, 1.f);
+        karabo_bridge::MultipartMsg camera;
+        karabo_bridge::appendArray(camera, "camera", "data.image", {2, 3}, "float", frame.data());
+        auto camera_pkg = karabo_bridge::decodeMultipartMsg(camera);
+        assert(camera_pkg.size() == 1);
+        assert(camera_pkg.at("camera").msgpack_data.empty());
+        assert(camera_pkg.at("camera").array["data.image"].shape() == std::vector<unsigned int>({2, 3}));
+
+        // nothing is left if no source is selected
+        camera.clear();
+        karabo_bridge::appendArray(camera, "camera", "data.image", {2, 3}, "float", frame.data());
+        karabo_bridge::Selection other;
+        other["motor"];
+        assert(karabo_bridge::decodeMultipartMsg(camera, other).empty());
+    }
+
+    // a plain "next"
+    zmq::message_t next_msg(4);
+    memcpy(next_msg.data(), "next", next_msg.size());
+    assert(karabo_bridge::parseRequest(next_msg).selection.empty());
+    assert(karabo_bridge::parseRequest(next_msg).count == 1);
+
+    // a batch reply is split into its trains, any other reply is one train
+    std::deque<karabo_bridge::MultipartMsg> trains(2);
+    karabo_bridge::shareMultipartMsg(train, trains[0]);
+    karabo_bridge::shareMultipartMsg(selected, trains[1]);
+    karabo_bridge::MultipartMsg reply;
+    reply.emplace_back(karabo_bridge::packBatchHeader(trains));
+    for (auto& t : trains) karabo_bridge::shareMultipartMsg(t, reply);
+    auto split = karabo_bridge::splitBatch(reply);
+    assert(split.size() == 2);
+    assert(split[0].size() == train.size() && split[1].size() == selected.size());
+    assert(karabo_bridge::decodeMultipartMsg(split[1]).at("detector").array.size() == 2);
+
+    karabo_bridge::MultipartMsg single;
+    karabo_bridge::shareMultipartMsg(train, single);
+    assert(karabo_bridge::splitBatch(single).size() == 1);
+
+    // the client drops unselected sources and paths from plain servers
+    karabo_bridge::Selection client_selection;
+    client_selection["motor"].paths = {"header.pulseCount"};
+    auto client_pkg = karabo_bridge::decodeMultipartMsg(train, client_selection);
+    assert(client_pkg.size() == 1);
+    assert(client_pkg.at("motor").msgpack_data.size() == 1);
+    assert(client_pkg.at("motor")["header.pulseCount"].as<uint64_t>() == 4);
+
+    {
+        // a replay of 5 trains, at most 2 per reply
+        karabo_bridge::Server server;
+        server.setMaxBatch(2);
+        std::string endpoint = server.bind("tcp://127.0.0.1:*");
+        std::atomic<bool> stop(false);
+        std::thread replay([&] {
+            uint64_t tid = 1000;
+            auto source = [&tid](karabo_bridge::MultipartMsg& train) {
+                if (tid == 1005) return false;
+                train = makeTrain(tid++);
+                return true;
+            };
+            while (!stop) {
+                if (server.poll(10)) server.serve(source);
+            }
+        });
+
+        karabo_bridge::Client client;
+        client.connect(endpoint);
+        auto replayed = client.nextMultipartMsgs(3);
+        assert(replayed.size() == 3);
+        assert(karabo_bridge::trainId(replayed[0]) == 1000 && karabo_bridge::trainId(replayed[2]) == 1002);
+        // the last train is asked for alone and gets an empty batch
+        replayed = client.nextMultipartMsgs(3);
+        assert(replayed.size() == 2);
+        assert(karabo_bridge::trainId(replayed[1]) == 1004);
+        assert(client.nextMultipartMsgs(3).empty());
+
+        stop = true;
+        replay.join();
+    }
+}
@@ -0,0 +1,62 @@
+#include "kb_selective_recorder.hpp"
+#include "test_helpers.hpp"
+
+#include <cassert>
+#include <cstdio>
+
+
+// a detector with (pulses, ss, fs) frames whose pixels are the pulse index
+karabo_bridge::MultipartMsg makePulseTrain(uint64_t tid) {
+    karabo_bridge::MultipartMsg train;
+    appendTrainId(train, "detector", tid);
+    std::vector<float> image(4*2*2);
+    for (std::size_t i = 0; i < image.size(); ++i) image[i] = static_cast<float>(i / 4);
+    karabo_bridge::appendArray(train, "detector", "image.data", {4, 2, 2}, "float", image.data());
+    return train;
+}
+
+
+int main() {
+    std::string path = "test_selective_recorder.kbr";
+    {
+        // keep the pulses 1 and 3 of the even trains
+        karabo_bridge::SelectiveRecorder recorder(path,
+            [](std::map<std::string, karabo_bridge::kb_data>& data_pkg, karabo_bridge::Selection& selection) {
+                if (karabo_bridge::trainId(data_pkg) % 2) return false;
+                selection["detector"].pulses = {1, 3};
+                return true;
+            }, 4, 100);
+
+        for (uint64_t tid = 1000; tid < 1020; ++tid) assert(recorder.push(makePulseTrain(tid)));
+        recorder.close();
+        assert(recorder.recorded() == 10);
+        assert(recorder.rejected() == 10);
+        assert(recorder.dropped() == 0);
+    }
+
+    {
+        karabo_bridge::RecordReader reader(path);
+        assert(reader.size() == 10);
+        karabo_bridge::MultipartMsg train;
+        uint64_t tid;
+        while (reader.next(train, &tid)) {
+            assert(tid % 2 == 0);
+            auto data_pkg = karabo_bridge::decodeMultipartMsg(train);
+            auto& image = data_pkg["detector"].array["image.data"];
+            assert(image.shape() == std::vector<unsigned int>({2, 2, 2}));
+            auto values = image.as<float>();
+            assert(values[0] == 1 && values[4] == 3);
+        }
+    }
+    std::remove(path.c_str());
+
+    {
+        karabo_bridge::SelectiveRecorder recorder(path, karabo_bridge::SelectiveRecorder::trainFilter(
+            [](std::map<std::string, karabo_bridge::kb_data>& data_pkg) {
+                return karabo_bridge::trainId(data_pkg) == 1005; }), 2);
+        for (uint64_t tid = 1000; tid < 1010; ++tid) recorder.push(makePulseTrain(tid));
+        recorder.close();
+        assert(recorder.recorded() + recorder.dropped() + recorder.rejected() == 10);
+    }
+    std::remove(path.c_str());
+}
@@ -0,0 +1,81 @@
+#include "kb_shm_bus.hpp"
+#include "test_helpers.hpp"
+
+#include <cassert>
+#include <sys/wait.h>
+
+
+int main() {
+    // a camera image of 8 KiB per train, which fits in a slot of 64 KiB
+    const std::vector<unsigned int> shape = {64, 64};
+
+    karabo_bridge::ShmBusWriter writer("/kb_test_shm_bus", 4, 1 << 16);
+    karabo_bridge::ShmBusReader reader("/kb_test_shm_bus");
+
+    karabo_bridge::MultipartMsg train;
+    uint64_t tid;
+    assert(!reader.next(train, &tid, 10));
+
+    assert(writer.publish(makeTrain<uint16_t>(1, "camera", shape, "uint16_t")));
+    assert(reader.next(train, &tid, 10));
+    assert(tid == 1 && train.size() == 4);
+    {
+        // the array is a view of the shared memory
+        karabo_bridge::MultipartMsg frames;
+        karabo_bridge::shareMultipartMsg(train, frames);
+        auto data_pkg = karabo_bridge::decodeMultipartMsg(frames);
+        auto& image = data_pkg["camera"].array["image.data"];
+        assert(image.data() == static_cast<const char*>(train[3].data()));
+        assert(image.as<uint16_t>()[4095] == 1);
+    }
+
+    // the slot held by the reader is skipped, the reader misses the
+    // trains which have been overwritten
+    for (uint64_t i = 2; i < 8; ++i) assert(writer.publish(makeTrain<uint16_t>(i, "camera", shape, "uint16_t")));
+    karabo_bridge::MultipartMsg trains[3];
+    for (auto& t : trains) assert(reader.next(t, &tid, 10));
+    assert(tid == 7);
+    assert(reader.missed() == 3);
+
+    // all the slots are held
+    assert(!writer.publish(makeTrain<uint16_t>(8, "camera", shape, "uint16_t")));
+    assert(writer.dropped() == 1);
+    train.clear();
+    assert(writer.publish(makeTrain<uint16_t>(9, "camera", shape, "uint16_t")));
+
+    // too large
+    karabo_bridge::MultipartMsg large = makeTrain<uint16_t>(10, "camera", shape, "uint16_t");
+    large.emplace_back(1 << 16);
+    assert(!writer.publish(large));
+
+    // a new reader starts from the last train
+    karabo_bridge::ShmBusReader reader2("/kb_test_shm_bus");
+    assert(reader2.next(train, &tid, 10));
+    assert(tid == 9);
+    train.clear();
+
+    {
+        // a reader which died holding a train does not hold its slot forever
+        karabo_bridge::ShmBusWriter bus("/kb_test_shm_bus_dead", 2, 1 << 16);
+        bool published = bus.publish(makeTrain<uint16_t>(1, "camera", shape, "uint16_t"));
+        assert(published);
+        pid_t pid = fork();
+        if (pid == 0) {
+            karabo_bridge::ShmBusReader dead("/kb_test_shm_bus_dead");
+            karabo_bridge::MultipartMsg held;
+            _exit(dead.next(held, nullptr, 1000) ? 0 : 1);
+        }
+        int status = -1;
+        waitpid(pid, &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+        published = bus.publish(makeTrain<uint16_t>(2, "camera", shape, "uint16_t"));
+        assert(published);
+        karabo_bridge::ShmBusReader alive("/kb_test_shm_bus_dead");
+        bool received = alive.next(train, &tid, 10);
+        assert(received && tid == 2);
+        published = bus.publish(makeTrain<uint16_t>(3, "camera", shape, "uint16_t"));
+        assert(published);
+        assert(bus.reclaimed() == 1 && bus.dropped() == 0);
+    }
+}
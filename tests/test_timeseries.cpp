@@ -0,0 +1,129 @@
+#include "kb_timeseries.hpp"
+#include "test_helpers.hpp"
+
+#include <cassert>
+
+
+// a motor with its position and a detector with its number of pulses, which
+// is missing in the trains whose ID is a multiple of 5
+std::map<std::string, karabo_bridge::kb_data> makeDataPkg(uint64_t tid) {
+    karabo_bridge::MultipartMsg train;
+    appendTrainId(train, "motor", tid, 1, [tid](msgpack::packer<msgpack::sbuffer>& packer) {
+        packer.pack(std::string("actualPosition"));
+        packer.pack(0.5 * static_cast<double>(tid));
+    });
+    appendTrainId(train, "detector", tid, tid % 5 == 0 ? 0 : 1, [tid](msgpack::packer<msgpack::sbuffer>& packer) {
+        if (tid % 5 == 0) return;
+        packer.pack(std::string("header.pulseCount"));
+        packer.pack(static_cast<int64_t>(tid % 7));
+    });
+    return karabo_bridge::decodeMultipartMsg(train);
+}
+
+
+int main() {
+    karabo_bridge::TimeSeries series(8);
+    auto position = series.addField<double>("motor", "actualPosition");
+    auto pulses = series.addField<int64_t>("detector", "header.pulseCount");
+    auto absent = series.addField<double>("camera", "exposure");
+    auto mistyped = series.addField<int64_t>("motor", "actualPosition");
+
+    std::vector<uint64_t> tids;
+    std::vector<double> positions;
+    std::vector<int64_t> counts;
+    double value;
+
+    assert(series.size() == 0);
+    assert(!series.latest(position, value));
+    assert(series.range(position, 0, 1000, tids, positions) == 0);
+
+    for (uint64_t tid = 1001; tid <= 1006; ++tid) {
+        auto data_pkg = makeDataPkg(tid);
+        assert(series.append(data_pkg));
+    }
+    assert(series.size() == 6);
+    assert(series.firstTrainId() == 1001 && series.lastTrainId() == 1006);
+
+    {
+        assert(series.range(position, 1002, 1004, tids, positions) == 3);
+        assert((tids == std::vector<uint64_t>{1002, 1003, 1004}));
+        assert((positions == std::vector<double>{501., 501.5, 502.}));
+
+        // train 1005 has no pulse count
+        assert(series.range(pulses, 1003, 1006, tids, counts) == 3);
+        assert((tids == std::vector<uint64_t>{1003, 1004, 1006}));
+        assert((counts == std::vector<int64_t>{1003 % 7, 1004 % 7, 1006 % 7}));
+
+        assert(series.range(absent, 0, 2000, tids, positions) == 0);
+        assert(series.range(mistyped, 0, 2000, tids, counts) == 0);
+        assert(series.range(position, 1007, 2000, tids, positions) == 0);
+        assert(series.range(position, 1004, 1003, tids, positions) == 0);
+    }
+
+    {
+        // a train which is older than the last one is ignored
+        auto data_pkg = makeDataPkg(1006);
+        assert(!series.append(data_pkg));
+        data_pkg = makeDataPkg(1002);
+        assert(!series.append(data_pkg));
+        assert(series.rejected() == 2 && series.size() == 6);
+    }
+
+    {
+        // wrap around and overwrite the oldest trains, with a gap in the train IDs
+        for (uint64_t tid : {1007, 1008, 1009, 1020, 1021}) {
+            auto data_pkg = makeDataPkg(tid);
+            assert(series.append(data_pkg));
+        }
+        assert(series.size() == 8 && series.capacity() == 8);
+        assert(series.firstTrainId() == 1004 && series.lastTrainId() == 1021);
+
+        assert(series.range(position, 0, 2000, tids, positions) == 8);
+        assert((tids == std::vector<uint64_t>{1004, 1005, 1006, 1007, 1008, 1009, 1020, 1021}));
+        assert(series.range(position, 1010, 1020, tids, positions) == 1);
+        assert(tids[0] == 1020 && positions[0] == 510.);
+
+        uint64_t tid;
+        assert(series.latest(position, value, &tid) && value == 510.5 && tid == 1021);
+        int64_t count;
+        assert(series.latest(pulses, count, &tid) && count == 1021 % 7 && tid == 1021);
+        assert(!series.latest(absent, value));
+
+        // the pulse count of train 1020 is missing
+        assert(series.range(pulses, 1009, 1021, tids, counts) == 2);
+        assert((tids == std::vector<uint64_t>{1009, 1021}));
+    }
+
+    {
+        auto bins = series.downsample(position, 1004, 1021, 4);
+        assert(bins.size() == 3);
+        assert(bins[0].first_train_id == 1004 && bins[0].count == 4);
+        assert(bins[0].min == 502. && bins[0].max == 503.5 && bins[0].mean == 502.75);
+        assert(bins[1].first_train_id == 1008 && bins[1].count == 2 && bins[1].mean == 504.25);
+        assert(bins[2].first_train_id == 1020 && bins[2].count == 2);
+        assert(bins[2].min == 510. && bins[2].max == 510.5);
+
+        auto all = series.downsample(pulses, 1000, 2000, 1000);
+        assert(all.size() == 1 && all[0].first_train_id == 1000 && all[0].count == 6);
+
+        assert(series.downsample(absent, 0, 2000, 10).empty());
+
+        bool thrown = false;
+        try {
+            series.downsample(position, 0, 2000, 0);
+        } catch (std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    {
+        bool thrown = false;
+        try {
+            karabo_bridge::TimeSeries empty(0);
+        } catch (std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+}